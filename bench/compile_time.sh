@@ -0,0 +1,217 @@
+#!/bin/bash
+# Compile time benchmark of openclc itself, over generated inputs.
+#
+# `run` generates `.cl` files along five axes, each varied on its own from a
+# small base case (16 kernels launched once each, helper depth 2, no header,
+# no host filler):
+#
+#   size      bytes of host code in the file, which the device frontend parses too
+#   kernels   kernels defined and launched
+#   depth     length of the helper call chain every kernel goes through
+#   header    lines of an included header whose definitions no kernel uses
+#   launches  `<<<>>>` launch sites of the 16 kernels, every other one with
+#             explicit shared memory and queue parameters
+#
+# Every case is compiled RUNS times with `--time-report`, in a fresh directory
+# and without the SPIR-V cache or daemon. One row per run and phase is written
+# to a tab separated results file, the `Total` row carries the process peak
+# memory.
+#
+# `compare` takes the fastest run of every case and phase from two results
+# files, and flags phases that got slower, or cases whose peak memory grew, by
+# more than THRESHOLD percent. Phases under MIN_MS in the base are ignored as
+# noise. It exits with 1 if anything regressed, so CI can run it.
+#
+# kernel_scaling.sh is kept as the quick check of the kernels axis alone: it
+# prints the milliseconds per kernel, which should stay flat as the count grows.
+#
+# Usage: ./compile_time.sh run [openclc] [results.tsv] [axes...]
+#        ./compile_time.sh compare <base.tsv> <new.tsv>
+#
+# e.g.   ./compile_time.sh run old/bin/openclc old.tsv
+#        ./compile_time.sh run new/bin/openclc new.tsv
+#        ./compile_time.sh compare old.tsv new.tsv
+
+set -eu
+
+RUNS="${RUNS:-3}"
+THRESHOLD="${THRESHOLD:-10}"
+MIN_MS="${MIN_MS:-5}"
+
+SIZES=(16384 262144 4194304 33554432)
+KERNELS=(1 10 100 1000 5000)
+DEPTHS=(1 4 16 64)
+HEADERS=(1000 10000 50000)
+LAUNCHES=(100 1000 10000)
+
+# Writes $1.cl, and $1.h if it has header lines, with $2 kernels, helper depth $3, $4 header lines, $5 bytes of host filler
+# and $6 launch sites
+generate() {
+  awk -v name="$1" -v kernels="$2" -v depth="$3" -v header="$4" -v filler="$5" -v launches="$6" 'BEGIN {
+    src = name ".cl"
+    if (header > 0) {
+      hdr = name ".h"
+      printf "#ifndef BENCH_HEADER_H\n#define BENCH_HEADER_H\n" > hdr
+      for (i = 0; i < header; i += 2) {
+        printf "#define BENCH_CONST_%d %d\n", i, i > hdr
+        printf "static inline int bench_header_%d(int x) { return x * %d + BENCH_CONST_%d; }\n", i, i, i > hdr
+      }
+      printf "#endif\n" > hdr
+      printf "#include \"%s\"\n", hdr > src
+    }
+    printf "#include <openclc_rt.h>\n\n" > src
+
+    for (d = depth - 1; d >= 0; d--) {
+      printf "float helper_%d(float x)\n{\n", d > src
+      if (d == depth - 1)
+        printf "    return x * 0.5f + 1.0f;\n}\n\n" > src
+      else
+        printf "    return helper_%d(x * %d.0f) - x;\n}\n\n", d + 1, d + 2 > src
+    }
+    for (k = 0; k < kernels; k++) {
+      printf "kernel void k%d(global float *A, float b)\n{\n", k > src
+      if (depth > 0)
+        printf "    A[get_global_id(0)] += helper_0(b * %d);\n}\n\n", k > src
+      else
+        printf "    A[get_global_id(0)] += b * %d;\n}\n\n", k > src
+    }
+
+    # Host code, about 160 bytes a function
+    for (f = 0; f * 160 < filler; f++)
+      printf "static int filler_%d(int x)\n{\n    int y = x * 31 + %d;\n    y ^= y >> 7;\n    return y + (x & %d);\n}\n\n", f, f, f % 255 > src
+
+    printf "int main()\n{\n    oclcInit();\n    float* dA = (float*)oclcMalloc(256 * sizeof(float));\n" > src
+    printf "    dim3 gridDim = { 8 };\n    dim3 blockDim = { 32 };\n" > src
+    for (l = 0; l < launches; l++) {
+      if (l % 2)
+        printf "    k%d<<<gridDim, blockDim, 0, 0>>>(dA, %d.0f);\n", l % kernels, l > src
+      else
+        printf "    k%d<<<gridDim, blockDim>>>(dA, %d.0f);\n", l % kernels, l > src
+    }
+    printf "    oclcDeviceSynchronize();\n    oclcFree(dA);\n    return 0;\n}\n" > src
+  }'
+}
+
+# Prints `case<TAB>axis<TAB>value<TAB>kernels<TAB>depth<TAB>header<TAB>filler<TAB>launches` for every case of the axes in $@
+cases() {
+  for axis in "$@"; do
+    case "$axis" in
+    size) for v in "${SIZES[@]}"; do printf "size_%s\tsize\t%s\t16\t2\t0\t%s\t16\n" "$v" "$v" "$v"; done ;;
+    kernels) for v in "${KERNELS[@]}"; do printf "kernels_%s\tkernels\t%s\t%s\t2\t0\t0\t%s\n" "$v" "$v" "$v" "$v"; done ;;
+    depth) for v in "${DEPTHS[@]}"; do printf "depth_%s\tdepth\t%s\t16\t%s\t0\t0\t16\n" "$v" "$v" "$v"; done ;;
+    header) for v in "${HEADERS[@]}"; do printf "header_%s\theader\t%s\t16\t2\t%s\t0\t16\n" "$v" "$v" "$v"; done ;;
+    launches) for v in "${LAUNCHES[@]}"; do printf "launches_%s\tlaunches\t%s\t16\t2\t0\t0\t%s\n" "$v" "$v" "$v"; done ;;
+    *)
+      echo "Unknown axis '$axis', expected size, kernels, depth, header or launches" >&2
+      exit 1
+      ;;
+    esac
+  done
+}
+
+run() {
+  local openclc="${1:-openclc}"
+  local results="${2:-compile_time.tsv}"
+  shift 2 || shift $#
+  local axes=("$@")
+  if [ ${#axes[@]} -eq 0 ]; then
+    axes=(size kernels depth header launches)
+  fi
+  # Cases are compiled in their own directories
+  if [[ "$openclc" == */* && "$openclc" != /* ]]; then
+    openclc="$PWD/$openclc"
+  fi
+  if [[ "$results" != /* ]]; then
+    results="$PWD/$results"
+  fi
+
+  WORKDIR="$(mktemp -d)"
+  trap 'rm -rf "$WORKDIR"' EXIT
+
+  printf "case\taxis\tvalue\tsource_bytes\trun\tphase\tcount\twall_ms\tcpu_ms\tpeak_rss_mib\n" > "$results"
+  printf "%-16s %12s %12s %14s\n" case "source KiB" "total ms" "peak RSS MiB" >&2
+  cases "${axes[@]}" | while IFS=$'\t' read -r name axis value kernels depth header filler launches; do
+    mkdir -p "$WORKDIR/$name"
+    cd "$WORKDIR/$name"
+    generate "$name" "$kernels" "$depth" "$header" "$filler" "$launches"
+    local bytes
+    bytes=$(cat "$name".* | wc -c)
+
+    for ((run = 1; run <= RUNS; run++)); do
+      rm -rf openclc-tmp
+      env -u OPENCLC_CACHE_DIR "$openclc" "$name.cl" --no-daemon --time-report -o "$name" > report.txt
+      # Rows of the phase table end in four numbers, phase names may have spaces
+      awk -v prefix="$name\t$axis\t$value\t$bytes\t$run" '
+        /^Total: / { gsub(/,/, ""); printf "%s\tTotal\t1\t%s\t%s\t%s\n", prefix, $2, $5, $8 }
+        /^Phase / { table = 1; next }
+        table && NF == 0 { table = 0 }
+        table {
+          phase = $1
+          for (i = 2; i <= NF - 4; i++)
+            phase = phase " " $i
+          printf "%s\t%s\t%s\t%s\t%s\t%s\n", prefix, phase, $(NF - 3), $(NF - 2), $(NF - 1), $NF
+        }' report.txt >> "$results"
+    done
+
+    awk -F'\t' -v name="$name" -v kib=$((bytes / 1024)) '
+      $1 == name && $6 == "Total" && (best == "" || $8 < best) { best = $8; rss = $10 }
+      END { printf "%-16s %12d %12.1f %14.1f\n", name, kib, best, rss }' "$results" >&2
+    cd "$WORKDIR"
+  done
+  echo "Results written to $results" >&2
+}
+
+compare() {
+  if [ $# -ne 2 ]; then
+    echo "Usage: $0 compare <base.tsv> <new.tsv>" >&2
+    exit 1
+  fi
+  awk -F'\t' -v threshold="$THRESHOLD" -v min_ms="$MIN_MS" '
+    FNR == 1 { file++; next }
+    {
+      key = $1 "\t" $6
+      if (!((file, key) in wall) || $8 < wall[file, key])
+        wall[file, key] = $8
+      if ($6 == "Total" && (!((file, key) in rss) || $10 < rss[file, key]))
+        rss[file, key] = $10
+      if (file == 1 && !(key in seen)) {
+        seen[key] = 1
+        order[++n] = key
+      }
+    }
+    END {
+      printf "%-16s %-28s %12s %12s %8s\n", "case", "phase", "base", "new", "change"
+      for (i = 1; i <= n; i++) {
+        key = order[i]
+        if (!((2, key) in wall))
+          continue
+        split(key, parts, "\t")
+        if (wall[1, key] >= min_ms) {
+          change = (wall[2, key] / wall[1, key] - 1) * 100
+          flag = change > threshold ? "  REGRESSION" : ""
+          regressions += (flag != "")
+          printf "%-16s %-28s %10.1fms %10.1fms %+7.1f%%%s\n", parts[1], parts[2], wall[1, key], wall[2, key], change, flag
+        }
+        if ((1, key) in rss && rss[1, key] > 0) {
+          change = (rss[2, key] / rss[1, key] - 1) * 100
+          flag = change > threshold ? "  REGRESSION" : ""
+          regressions += (flag != "")
+          printf "%-16s %-28s %9.1fMiB %9.1fMiB %+7.1f%%%s\n", parts[1], "Peak RSS", rss[1, key], rss[2, key], change, flag
+        }
+      }
+      printf "\n%d regressions over %s%%\n", regressions, threshold
+      exit (regressions > 0)
+    }' "$1" "$2"
+}
+
+MODE="${1:-}"
+shift || true
+case "$MODE" in
+run) run "$@" ;;
+compare) compare "$@" ;;
+*)
+  echo "Usage: $0 run [openclc] [results.tsv] [axes...]" >&2
+  echo "       $0 compare <base.tsv> <new.tsv>" >&2
+  exit 1
+  ;;
+esac
@@ -0,0 +1,60 @@
+#!/bin/bash
+# Times openclc on generated files holding an increasing number of kernels.
+#
+# Compile time should grow linearly with the kernel count, so the last column
+# (milliseconds per kernel) should stay roughly flat.
+#
+# Usage: ./kernel_scaling.sh [openclc] [kernel counts...]
+
+set -eu
+
+OPENCLC="${1:-openclc}"
+shift || true
+COUNTS=("$@")
+if [ ${#COUNTS[@]} -eq 0 ]; then
+  COUNTS=(10 100 1000 2500 5000)
+fi
+
+WORKDIR="$(mktemp -d)"
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR"
+
+# Writes a file with $1 kernels and a host main that launches each of them once
+generate() {
+  local n="$1"
+  local file="$2"
+  {
+    echo '#include <openclc_rt.h>'
+    echo
+    for ((i = 0; i < n; i++)); do
+      echo "kernel void k$i(global float *A, float b)"
+      echo "{"
+      echo "    A[get_global_id(0)] += b * $i;"
+      echo "}"
+      echo
+    done
+    echo 'int main()'
+    echo '{'
+    echo '    oclcInit();'
+    echo '    float* dA = (float*)oclcMalloc(256 * sizeof(float));'
+    echo '    dim3 gridDim = { 8 };'
+    echo '    dim3 blockDim = { 32 };'
+    for ((i = 0; i < n; i++)); do
+      echo "    k$i<<<gridDim, blockDim>>>(dA, 1.0f);"
+    done
+    echo '    oclcDeviceSynchronize();'
+    echo '    oclcFree(dA);'
+    echo '}'
+  } > "$file"
+}
+
+printf "%8s %12s %12s %14s\n" kernels "source KiB" "total ms" "ms per kernel"
+for n in "${COUNTS[@]}"; do
+  generate "$n" "scaling_$n.cl"
+  start=$(date +%s%N)
+  "$OPENCLC" "scaling_$n.cl" -o "scaling_$n" > /dev/null
+  end=$(date +%s%N)
+  ms=$(((end - start) / 1000000))
+  kib=$(($(wc -c < "scaling_$n.cl") / 1024))
+  printf "%8d %12d %12d %14s\n" "$n" "$kib" "$ms" "$(awk "BEGIN { printf \"%.3f\", $ms / $n }")"
+done
@@ -0,0 +1,98 @@
+#include <openclc_rt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define TAPS 16
+
+// Small helpers and private arrays, which are only cheap once inlined and promoted to registers
+float tap_weight(int tap, float scale)
+{
+    return scale / (float)(tap + 1);
+}
+
+float dot_taps(const float* window, const float* weights)
+{
+    float sum = 0.0f;
+    __attribute__((opencl_unroll_hint(TAPS)))
+    for (int i = 0; i < TAPS; i++) {
+        sum += window[i] * weights[i];
+    }
+    return sum;
+}
+
+kernel void fir(constant float* in, global float* out, int n, float scale)
+{
+    int gid = get_global_id(0);
+
+    float weights[TAPS];
+    for (int i = 0; i < TAPS; i++) {
+        weights[i] = tap_weight(i, scale);
+    }
+
+    float window[TAPS];
+    for (int i = 0; i < TAPS; i++) {
+        window[i] = in[(gid + i) % n];
+    }
+
+    float acc = 0.0f;
+    for (int iter = 0; iter < 64; iter++) {
+        // `scale * n` is loop invariant
+        acc += dot_taps(window, weights) / (scale * n + iter);
+    }
+    out[gid] = acc;
+}
+
+static double now_ms()
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char** argv)
+{
+    oclcInit();
+
+    int n = 1 << 20;
+    int launches = argc > 1 ? atoi(argv[1]) : 20;
+    size_t sz = n * sizeof(float);
+
+    float* in = (float*)malloc(sz);
+    for (int i = 0; i < n; i++) {
+        in[i] = (float)(i % 97);
+    }
+
+    float* dIn = (float*)oclcMalloc(sz);
+    float* dOut = (float*)oclcMalloc(sz);
+    oclcMemcpy(dIn, in, sz, oclcMemcpyHostToDevice);
+
+    dim3 gridDim = { n / 64 };
+    dim3 blockDim = { 64 };
+
+    // The first launch also builds the program
+    fir<<<gridDim, blockDim>>>(dIn, dOut, n, 2.0f);
+    oclcDeviceSynchronize();
+
+    double start = now_ms();
+    for (int i = 0; i < launches; i++) {
+        fir<<<gridDim, blockDim>>>(dIn, dOut, n, 2.0f);
+    }
+    oclcDeviceSynchronize();
+    double elapsed = now_ms() - start;
+
+    // The sum of the outputs lets the levels be checked against each other
+    float* out = (float*)malloc(sz);
+    oclcMemcpy(out, dOut, sz, oclcMemcpyDeviceToHost);
+    double checksum = 0.0;
+    for (int i = 0; i < n; i++) {
+        checksum += out[i];
+    }
+
+    printf("%.3f %.9g\n", elapsed / launches, checksum);
+
+    oclcFree(dIn);
+    oclcFree(dOut);
+    free(in);
+    free(out);
+}
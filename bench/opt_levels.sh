@@ -0,0 +1,38 @@
+#!/bin/bash
+# Compares kernel runtime of opt_levels.cl built at -O0 to -O3.
+#
+# Meant for a CPU OpenCL device such as PoCL, where the device compiler does
+# little on its own and the SPIR-V we emit shows directly in the runtime.
+# Point the ICD loader at PoCL with e.g. OCL_ICD_VENDORS=/etc/OpenCL/vendors/pocl.icd
+#
+# The sum of the kernel's outputs at every level is checked against -O0, the
+# optimizations must not change results beyond float rounding.
+#
+# Usage: ./opt_levels.sh [openclc] [launches]
+
+set -eu
+
+OPENCLC="${1:-openclc}"
+LAUNCHES="${2:-20}"
+BENCHDIR="$(cd "$(dirname "$0")" && pwd)"
+
+WORKDIR="$(mktemp -d)"
+trap 'rm -rf "$WORKDIR"' EXIT
+cd "$WORKDIR"
+
+printf "%6s %14s %12s %18s\n" level "ms per launch" "SPIR-V bytes" "output checksum"
+reference=""
+for level in 0 1 2 3; do
+  "$OPENCLC" "$BENCHDIR/opt_levels.cl" "-O$level" -o "opt_levels_O$level" > /dev/null
+  # The first variant of the generated source, named after the input and a hash of its path
+  spv_bytes=$(cat openclc-tmp/opt_levels.????????.spv | wc -c)
+  read -r ms checksum < <("./opt_levels_O$level" "$LAUNCHES")
+  printf "%6s %14s %12d %18s\n" "-O$level" "$ms" "$spv_bytes" "$checksum"
+
+  if [ -z "$reference" ]; then
+    reference="$checksum"
+  elif ! awk -v a="$reference" -v b="$checksum" 'BEGIN { d = a - b; if (d < 0) d = -d; m = a < 0 ? -a : a; exit !(d <= 1e-5 * m) }'; then
+    echo "error: -O$level output checksum $checksum differs from -O0 checksum $reference" >&2
+    exit 1
+  fi
+done
@@ -0,0 +1,53 @@
+#include <assert.h>
+#include <openclc_rt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Read by both kernels. Compiled per kernel, as `--cache-dir` does, each kernel's module carries the table.
+constant float weights[4] = { 0.5f, 0.25f, 0.125f, 0.125f };
+
+kernel void scale(global float* A)
+{
+    size_t gid = get_global_id(0);
+    A[gid] *= weights[gid % 4];
+}
+
+kernel void offset(global float* A)
+{
+    size_t gid = get_global_id(0);
+    A[gid] += weights[(gid + 1) % 4];
+}
+
+int main()
+{
+    oclcInit();
+
+    int n = 256;
+    size_t sz = n * sizeof(float);
+
+    float* A = (float*)malloc(sz);
+    for (int i = 0; i < n; i++) {
+        A[i] = i;
+    }
+
+    float* dA = (float*)oclcMalloc(sz);
+    oclcMemcpy(dA, A, sz, oclcMemcpyHostToDevice);
+
+    dim3 gridDim = { n / 32 };
+    dim3 blockDim = { 32 };
+    scale<<<gridDim, blockDim>>>(dA);
+    offset<<<gridDim, blockDim>>>(dA);
+
+    oclcMemcpy(A, dA, sz, oclcMemcpyDeviceToHost);
+    oclcDeviceSynchronize();
+
+    const float weights[4] = { 0.5f, 0.25f, 0.125f, 0.125f };
+    for (int i = 0; i < n; i++) {
+        assert(A[i] == i * weights[i % 4] + weights[(i + 1) % 4]);
+    }
+
+    puts("Passed");
+
+    oclcFree(dA);
+    free(A);
+}
@@ -0,0 +1,426 @@
+//===--- Daemon.cpp - Persistent Compile Server ---------------------------===//
+//
+// A request is three lists of strings: the working directory, the command
+// line and the environment of the client. A list is its count followed by
+// every string as its size and bytes, counts and sizes being 32 bit in host
+// byte order.
+//
+// The daemon answers with frames of a kind byte, a 32 bit size and that many
+// bytes. The output of the compile is relayed in `Stdout` and `Stderr`
+// frames as it is printed, the last frame is `Exit` with the exit status.
+//
+//===----------------------------------------------------------------------===//
+
+#include "Daemon.h"
+#include "fmt/core.h"
+#include "llvm/Support/xxhash.h"
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <vector>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+using namespace openclc;
+
+#ifndef _WIN32
+
+namespace {
+
+enum class Frame : char {
+    Stdout = 1,
+    Stderr = 2,
+    Exit = 3,
+};
+
+/// Limits on requests and frames, anything larger isn't from openclc
+constexpr uint32_t MaxStrings = 1 << 20;
+constexpr uint32_t MaxStringSize = 64 << 20;
+
+#ifdef MSG_NOSIGNAL
+constexpr int SendFlags = MSG_NOSIGNAL;
+#else
+constexpr int SendFlags = 0; // `SO_NOSIGPIPE` is set on the socket instead
+#endif
+
+/// Path of the listening socket, removed by the signal handler when the daemon is stopped
+char SocketPathToRemove[sizeof(sockaddr_un::sun_path)];
+
+void removeSocketAndExit(int signal)
+{
+    ::unlink(SocketPathToRemove);
+    ::_exit(128 + signal);
+}
+
+bool sendAll(int fd, const void* data, std::size_t size)
+{
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = ::send(fd, bytes, size, SendFlags);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+bool recvAll(int fd, void* data, std::size_t size)
+{
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = ::recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return false;
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+/// Writes relayed output to this process' stdout or stderr
+void writeAll(int fd, llvm::StringRef data)
+{
+    while (!data.empty()) {
+        ssize_t written = ::write(fd, data.data(), data.size());
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+        data = data.drop_front(written);
+    }
+}
+
+bool sendStrings(int fd, llvm::ArrayRef<llvm::StringRef> strings)
+{
+    uint32_t count = strings.size();
+    if (!sendAll(fd, &count, sizeof(count)))
+        return false;
+    for (llvm::StringRef string : strings) {
+        uint32_t size = string.size();
+        if (!sendAll(fd, &size, sizeof(size)) || !sendAll(fd, string.data(), size))
+            return false;
+    }
+    return true;
+}
+
+bool recvStrings(int fd, std::vector<std::string>& strings)
+{
+    uint32_t count;
+    if (!recvAll(fd, &count, sizeof(count)) || count > MaxStrings)
+        return false;
+    strings.resize(count);
+    for (std::string& string : strings) {
+        uint32_t size;
+        if (!recvAll(fd, &size, sizeof(size)) || size > MaxStringSize)
+            return false;
+        string.resize(size);
+        if (!recvAll(fd, string.data(), size))
+            return false;
+    }
+    return true;
+}
+
+bool sendFrame(int fd, Frame kind, llvm::StringRef data)
+{
+    uint32_t size = data.size();
+    return sendAll(fd, &kind, sizeof(kind)) && sendAll(fd, &size, sizeof(size)) && sendAll(fd, data.data(), size);
+}
+
+/// Whether the other end of a connected socket runs as this user. Requests carry the environment and have code run, so
+/// neither end talks to another user's process.
+bool peerIsThisUser(int fd)
+{
+#ifdef SO_PEERCRED
+    ucred credentials;
+    socklen_t size = sizeof(credentials);
+    return ::getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == ::getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return ::getpeereid(fd, &uid, &gid) == 0 && uid == ::getuid();
+#endif
+}
+
+void disableSigPipe([[maybe_unused]] int fd)
+{
+#ifdef SO_NOSIGPIPE
+    int on = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+}
+
+/// A Unix socket and the address of `socketPath`, or -1 if the path is too long for one
+int unixSocket(const std::string& socketPath, sockaddr_un& address)
+{
+    if (socketPath.size() >= sizeof(address.sun_path))
+        return -1;
+    address = {};
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0)
+        disableSigPipe(fd);
+    return fd;
+}
+
+/// A socket connected to the daemon on `socketPath`, or -1 if none listens there
+int connectToDaemon(const std::string& socketPath)
+{
+    sockaddr_un address;
+    int fd = unixSocket(socketPath, address);
+    if (fd < 0)
+        return -1;
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || !peerIsThisUser(fd)) {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/// Runs in the compiling child, takes over the client's working directory and environment and compiles its command line
+[[noreturn]] void compileInChild(const std::string& directory, const std::vector<std::string>& arguments, std::vector<std::string>& environment,
+    int stdoutFd, int stderrFd, llvm::function_ref<int(llvm::ArrayRef<const char*> argv)> compile)
+{
+    ::dup2(stdoutFd, STDOUT_FILENO);
+    ::dup2(stderrFd, STDERR_FILENO);
+    ::close(stdoutFd);
+    ::close(stderrFd);
+
+    if (::chdir(directory.c_str()) != 0) {
+        fmt::print(stderr, "The openclc daemon can't enter `{}`: {}\n", directory, std::strerror(errno));
+        std::exit(1);
+    }
+
+    // The host compiler is run with the client's environment too, `environ` points into `environment` from here on
+    static std::vector<char*> variables;
+    for (std::string& variable : environment)
+        variables.push_back(variable.data());
+    variables.push_back(nullptr);
+    environ = variables.data();
+
+    std::vector<const char*> argv;
+    for (const std::string& argument : arguments)
+        argv.push_back(argument.c_str());
+    std::exit(compile(argv));
+}
+
+/// Runs in the session process of an accepted client: reads its request, compiles it in a child and relays the child's output
+///
+/// Only this client waits on its own slow request or full socket, the daemon is back to accepting right after the fork.
+[[noreturn]] void serveClient(int client, llvm::function_ref<int(llvm::ArrayRef<const char*> argv)> compile)
+{
+    std::signal(SIGINT, SIG_DFL);
+    std::signal(SIGTERM, SIG_DFL);
+    std::signal(SIGCHLD, SIG_DFL);
+
+    // Clients send the whole request right away, one that stalls is dropped
+    timeval timeout { 10, 0 };
+    ::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::vector<std::string> directory, arguments, environment;
+    if (!recvStrings(client, directory) || !recvStrings(client, arguments) || !recvStrings(client, environment)
+        || directory.size() != 1 || arguments.empty())
+        ::_exit(1);
+
+    int stdoutPipe[2], stderrPipe[2];
+    if (::pipe(stdoutPipe) != 0 || ::pipe(stderrPipe) != 0)
+        ::_exit(1);
+
+    pid_t child = ::fork();
+    if (child == 0) {
+        ::close(client);
+        ::close(stdoutPipe[0]);
+        ::close(stderrPipe[0]);
+        compileInChild(directory[0], arguments, environment, stdoutPipe[1], stderrPipe[1], compile);
+    }
+    ::close(stdoutPipe[1]);
+    ::close(stderrPipe[1]);
+    if (child < 0)
+        ::_exit(1);
+
+    // Both pipes close when the child exits
+    pollfd output[2] = { pollfd { stdoutPipe[0], POLLIN, 0 }, pollfd { stderrPipe[0], POLLIN, 0 } };
+    while (output[0].fd >= 0 || output[1].fd >= 0) {
+        if (::poll(output, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (std::size_t stream = 0; stream < 2; stream++) {
+            pollfd& polled = output[stream];
+            if (polled.fd < 0 || !(polled.revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            char buffer[64 * 1024];
+            ssize_t size = ::read(polled.fd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR)
+                continue;
+            // A client that went away misses the rest of the output, the compile still finishes
+            if (size > 0) {
+                sendFrame(client, stream == 0 ? Frame::Stdout : Frame::Stderr, llvm::StringRef(buffer, size));
+                continue;
+            }
+            ::close(polled.fd);
+            polled.fd = -1;
+        }
+    }
+
+    int status = 0;
+    while (::waitpid(child, &status, 0) < 0 && errno == EINTR) { }
+    int32_t exitCode = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    sendFrame(client, Frame::Exit, llvm::StringRef(reinterpret_cast<const char*>(&exitCode), sizeof(exitCode)));
+    ::_exit(0);
+}
+
+} // end anonymous namespace
+
+std::string openclc::DefaultDaemonSocketPath(llvm::StringRef producer)
+{
+    std::filesystem::path dir;
+    if (const char* runtimeDir = std::getenv("XDG_RUNTIME_DIR"); runtimeDir && *runtimeDir) {
+        dir = runtimeDir;
+    } else {
+        std::error_code ec;
+        dir = std::filesystem::temp_directory_path(ec);
+        if (ec)
+            dir = "/tmp";
+    }
+    return (dir / fmt::format("openclc-{}-{:016x}.sock", ::getuid(), llvm::xxh3_64bits(producer))).string();
+}
+
+int openclc::RunDaemon(const std::string& socketPath, llvm::function_ref<int(llvm::ArrayRef<const char*> argv)> compile)
+{
+    if (int running = connectToDaemon(socketPath); running >= 0) {
+        ::close(running);
+        fmt::print(stderr, "An openclc daemon already listens on `{}`\n", socketPath);
+        return 1;
+    }
+
+    sockaddr_un address;
+    int listener = unixSocket(socketPath, address);
+    if (listener < 0) {
+        fmt::print(stderr, "Can't create the daemon socket `{}`\n", socketPath);
+        return 1;
+    }
+    // Left behind by a daemon that was killed
+    ::unlink(socketPath.c_str());
+    mode_t mask = ::umask(0077);
+    bool bound = ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    ::umask(mask);
+    if (!bound || ::listen(listener, SOMAXCONN) != 0) {
+        fmt::print(stderr, "Can't listen on `{}`: {}\n", socketPath, std::strerror(errno));
+        ::close(listener);
+        return 1;
+    }
+
+    std::memcpy(SocketPathToRemove, socketPath.c_str(), socketPath.size() + 1);
+    std::signal(SIGINT, removeSocketAndExit);
+    std::signal(SIGTERM, removeSocketAndExit);
+    fmt::print("openclc daemon listening on `{}`\n", socketPath);
+
+    // Session processes are reaped as they exit
+    std::signal(SIGCHLD, SIG_IGN);
+    while (true) {
+        int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fmt::print(stderr, "The openclc daemon failed to accept a request: {}\n", std::strerror(errno));
+            return 1;
+        }
+        disableSigPipe(client);
+        if (!peerIsThisUser(client)) {
+            ::close(client);
+            continue;
+        }
+
+        std::fflush(nullptr);
+        if (::fork() == 0) {
+            ::close(listener);
+            serveClient(client, compile);
+        }
+        ::close(client);
+    }
+}
+
+std::optional<int> openclc::ForwardToDaemon(const std::string& socketPath, llvm::ArrayRef<const char*> argv)
+{
+    int fd = connectToDaemon(socketPath);
+    if (fd < 0)
+        return std::nullopt;
+
+    std::error_code ec;
+    std::string directory = std::filesystem::current_path(ec).string();
+    std::vector<llvm::StringRef> arguments(argv.begin(), argv.end());
+    std::vector<llvm::StringRef> environment;
+    for (char** variable = environ; *variable; variable++)
+        environment.push_back(*variable);
+    if (ec || !sendStrings(fd, { directory }) || !sendStrings(fd, arguments) || !sendStrings(fd, environment)) {
+        ::close(fd);
+        return std::nullopt;
+    }
+
+    bool answered = false;
+    while (true) {
+        Frame kind;
+        uint32_t size;
+        if (!recvAll(fd, &kind, sizeof(kind)) || !recvAll(fd, &size, sizeof(size)) || size > MaxStringSize)
+            break;
+        std::string data(size, '\0');
+        if (!recvAll(fd, data.data(), size))
+            break;
+        answered = true;
+
+        if (kind == Frame::Exit && size == sizeof(int32_t)) {
+            int32_t status;
+            std::memcpy(&status, data.data(), sizeof(status));
+            ::close(fd);
+            return status;
+        }
+        writeAll(kind == Frame::Stdout ? STDOUT_FILENO : STDERR_FILENO, data);
+    }
+    ::close(fd);
+
+    // Compiling again in process would repeat the output already relayed
+    if (!answered)
+        return std::nullopt;
+    fmt::print(stderr, "The openclc daemon on `{}` stopped before the compile finished\n", socketPath);
+    return 1;
+}
+
+#else
+
+std::string openclc::DefaultDaemonSocketPath(llvm::StringRef producer)
+{
+    return "";
+}
+
+int openclc::RunDaemon(const std::string& socketPath, llvm::function_ref<int(llvm::ArrayRef<const char*> argv)> compile)
+{
+    fmt::print(stderr, "--daemon needs Unix sockets and fork, which this platform doesn't have\n");
+    return 1;
+}
+
+std::optional<int> openclc::ForwardToDaemon(const std::string& socketPath, llvm::ArrayRef<const char*> argv)
+{
+    return std::nullopt;
+}
+
+#endif
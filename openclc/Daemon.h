@@ -0,0 +1,49 @@
+//===--- Daemon.h - Persistent Compile Server -------------------*- C++ -*-===//
+//
+// `openclc --daemon` pays the fixed cost of an invocation once: the process
+// is loaded, LLVM's options are registered and the device headers are
+// precompiled before it listens on a Unix socket. Other invocations forward
+// their command line to it and relay back what it prints.
+//
+// Every accepted client is served by a process forked from the warm daemon,
+// which reads the request, forks the child compiling it and relays the
+// child's output, so the daemon itself never waits on a client. The child
+// moves to the client's working directory and environment and then runs as
+// an ordinary invocation would. The driver's options and lazily computed
+// state are process wide, so forking keeps requests from seeing each other's,
+// and a request that exits on an error only takes its own child down.
+//
+// Unix sockets and fork are POSIX only, on Windows every invocation compiles
+// in process.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_DAEMON_H
+#define OPENCLC_DAEMON_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include <optional>
+#include <string>
+
+namespace openclc {
+
+/// Socket of the daemon for this user and `producer`, in `$XDG_RUNTIME_DIR` or the temporary directory
+///
+/// The producer is part of the name, so invocations never reach a daemon of another openclc or LLVM version.
+std::string DefaultDaemonSocketPath(llvm::StringRef producer);
+
+/// Serves requests on `socketPath` until killed, each in a child that runs `compile` on the client's command line
+///
+/// Returns 1 with an error printed if another daemon already listens on the socket or it can't be created.
+int RunDaemon(const std::string& socketPath, llvm::function_ref<int(llvm::ArrayRef<const char*> argv)> compile);
+
+/// Has the daemon on `socketPath` compile `argv` in the working directory and environment of this process, relaying its output
+///
+/// Returns its exit status, or `std::nullopt` if no daemon answered and the caller should compile in process.
+std::optional<int> ForwardToDaemon(const std::string& socketPath, llvm::ArrayRef<const char*> argv);
+
+} // end namespace openclc
+
+#endif
@@ -126,12 +126,48 @@ void DeviceFrontendDiagnosticPrinter::HandleDiagnostic(DiagnosticsEngine::Level
         return;
     }
 
+    llvm::raw_svector_ostream DiagMessageStream(OutStr);
+    printDiagnosticOptions(DiagMessageStream, Level, Info, *DiagOpts);
+
+    if (Deferred) {
+        FullSourceLoc Loc;
+        if (Info.getLocation().isValid())
+            Loc = FullSourceLoc(Info.getLocation(), Info.getSourceManager());
+        DeferredDiags.emplace_back(Level, Info.getID(), DiagMessageStream.str(), Loc, Info.getRanges(), Info.getFixItHints());
+        return;
+    }
+
     // Default implementation (Warnings/errors count).
     DiagnosticConsumer::HandleDiagnostic(Level, Info);
 
-    llvm::raw_svector_ostream DiagMessageStream(OutStr);
-    printDiagnosticOptions(DiagMessageStream, Level, Info, *DiagOpts);
+    emit(Level, Info.getLocation().isValid() ? FullSourceLoc(Info.getLocation(), Info.getSourceManager()) : FullSourceLoc(),
+        DiagMessageStream.str(), Info.getRanges(), Info.getFixItHints());
+}
 
+void DeviceFrontendDiagnosticPrinter::emitDeferred(llvm::function_ref<bool(const StoredDiagnostic&)> Keep)
+{
+    bool KeepCurrent = true;
+    for (const StoredDiagnostic& Diag : DeferredDiags) {
+        if (Diag.getLevel() != DiagnosticsEngine::Note)
+            KeepCurrent = Keep(Diag);
+        if (!KeepCurrent)
+            continue;
+
+        // Same bookkeeping as DiagnosticConsumer::HandleDiagnostic
+        if (Diag.getLevel() == DiagnosticsEngine::Warning)
+            ++NumWarnings;
+        else if (Diag.getLevel() >= DiagnosticsEngine::Error)
+            ++NumErrors;
+
+        emit(Diag.getLevel(), Diag.getLocation(), Diag.getMessage(), Diag.getRanges(), Diag.getFixIts());
+    }
+
+    DeferredDiags.clear();
+}
+
+void DeviceFrontendDiagnosticPrinter::emit(DiagnosticsEngine::Level Level, FullSourceLoc Loc, StringRef Message,
+    ArrayRef<CharSourceRange> Ranges, ArrayRef<FixItHint> FixIts)
+{
     // Keeps track of the starting position of the location
     // information (e.g., "foo.c:10:4:") that precedes the error
     // message. We use this information to determine how long the
@@ -145,11 +181,11 @@ void DeviceFrontendDiagnosticPrinter::HandleDiagnostic(DiagnosticsEngine::Level
     // This is important as if the location is missing, we may be emitting
     // diagnostics in a context that lacks language options, a source manager, or
     // other infrastructure necessary when emitting more rich diagnostics.
-    if (!Info.getLocation().isValid()) {
+    if (!Loc.isValid()) {
         TextDiagnostic::printDiagnosticLevel(OS, Level, DiagOpts->ShowColors);
         TextDiagnostic::printDiagnosticMessage(
             OS, /*IsSupplemental=*/Level == DiagnosticsEngine::Note,
-            DiagMessageStream.str(), OS.tell() - StartOfLocationInfo,
+            Message, OS.tell() - StartOfLocationInfo,
             DiagOpts->MessageLength, DiagOpts->ShowColors);
         OS.flush();
         return;
@@ -157,12 +193,10 @@ void DeviceFrontendDiagnosticPrinter::HandleDiagnostic(DiagnosticsEngine::Level
 
     // Assert that the rest of our infrastructure is setup properly.
     assert(DiagOpts && "Unexpected diagnostic without options set");
-    assert(Info.hasSourceManager() && "Unexpected diagnostic with no source manager");
+    assert(Loc.hasManager() && "Unexpected diagnostic with no source manager");
     assert(TextDiag && "Unexpected diagnostic outside source file processing");
 
-    TextDiag->emitDiagnostic(
-        FullSourceLoc(Info.getLocation(), Info.getSourceManager()), Level,
-        DiagMessageStream.str(), Info.getRanges(), Info.getFixItHints());
+    TextDiag->emitDiagnostic(Loc, Level, Message, Ranges, FixIts);
 
     OS.flush();
-}
\ No newline at end of file
+}
@@ -12,6 +12,10 @@
 // It's modified to suppress some preprocessor errors when extracting device code from c sources
 // like #include errors for c system headers.
 //
+// It can also defer diagnostics until the end of the translation unit, so that
+// errors in host code, which is parsed as OpenCL C, can be told apart from
+// errors in kernels once the kernels are known.
+//
 //===----------------------------------------------------------------------===//
 
 #ifndef LLVM_CLANG_DEVICE_FRONTEND_DIAGNOSTIC_PRINTER_H
@@ -20,7 +24,9 @@
 #include "clang/Basic/Diagnostic.h"
 #include "clang/Basic/LLVM.h"
 #include "llvm/ADT/IntrusiveRefCntPtr.h"
+#include "llvm/ADT/STLFunctionalExtras.h"
 #include <memory>
+#include <vector>
 
 namespace clang {
 class DiagnosticOptions;
@@ -40,6 +46,13 @@ class DeviceFrontendDiagnosticPrinter : public DiagnosticConsumer {
     LLVM_PREFERRED_TYPE(bool)
     unsigned OwnsOutputStream : 1;
 
+    /// Whether diagnostics are stored instead of printed, see `setDeferred`.
+    bool Deferred = false;
+    std::vector<StoredDiagnostic> DeferredDiags;
+
+    void emit(DiagnosticsEngine::Level Level, FullSourceLoc Loc, StringRef Message,
+        ArrayRef<CharSourceRange> Ranges, ArrayRef<FixItHint> FixIts);
+
 public:
     DeviceFrontendDiagnosticPrinter(raw_ostream& os, DiagnosticOptions* diags,
         bool OwnsOutputStream = false);
@@ -50,6 +63,15 @@ public:
     /// used.
     void setPrefix(std::string Value) { Prefix = std::move(Value); }
 
+    /// setDeferred - Store diagnostics instead of printing them. Stored
+    /// diagnostics aren't counted until they are released by `emitDeferred`.
+    void setDeferred(bool Value) { Deferred = Value; }
+
+    /// emitDeferred - Print and count the stored diagnostics that `Keep` accepts
+    /// and drop the rest. Notes follow the decision made for the diagnostic
+    /// they are attached to. Must be called before `EndSourceFile`.
+    void emitDeferred(llvm::function_ref<bool(const StoredDiagnostic&)> Keep);
+
     void BeginSourceFile(const LangOptions& LO, const Preprocessor* PP) override;
     void EndSourceFile() override;
     void HandleDiagnostic(DiagnosticsEngine::Level Level,
@@ -0,0 +1,136 @@
+//===--- DeviceLibrary.cpp - Precompiled Kernel Archives ------------------===//
+//
+// Layout: the line `!<oclclib>`, the size of the index in bytes on its own
+// line, the JSON index, then the bitcode of every member back to back.
+//
+// The index is `{"producer": ..., "members": [{"name", "offset", "size",
+// "hash", "metadata"}, ...]}`, with offsets counted from the end of the index
+// and `hash` the `SpvCache::hash` of the member's bitcode. The index is padded
+// with spaces and every member to a multiple of 4 bytes, so the bitcode
+// readers see word aligned buffers in the mapped file.
+//
+//===----------------------------------------------------------------------===//
+
+#include "DeviceLibrary.h"
+#include "SpvCache.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace openclc;
+
+static constexpr llvm::StringLiteral Magic = "!<oclclib>\n";
+
+static constexpr std::size_t Alignment = 4;
+
+static std::size_t alignTo(std::size_t size)
+{
+    return (size + Alignment - 1) / Alignment * Alignment;
+}
+
+std::unique_ptr<DeviceLibrary> DeviceLibrary::open(const std::string& path, std::string& error)
+{
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer) {
+        error = buffer.getError().message();
+        return nullptr;
+    }
+
+    llvm::StringRef contents = (*buffer)->getBuffer();
+    if (!contents.consume_front(Magic)) {
+        error = "not a device library";
+        return nullptr;
+    }
+    auto [sizeLine, rest] = contents.split('\n');
+    std::size_t indexSize;
+    if (sizeLine.getAsInteger(10, indexSize) || indexSize > rest.size()) {
+        error = "truncated index";
+        return nullptr;
+    }
+
+    auto library = std::unique_ptr<DeviceLibrary>(new DeviceLibrary());
+    library->Index = rest.take_front(indexSize);
+    llvm::StringRef data = rest.drop_front(indexSize);
+
+    llvm::Expected<llvm::json::Value> index = llvm::json::parse(library->Index);
+    if (!index) {
+        error = "corrupt index: " + llvm::toString(index.takeError());
+        return nullptr;
+    }
+    const llvm::json::Object* root = index->getAsObject();
+    const llvm::json::Array* members = root ? root->getArray("members") : nullptr;
+    std::optional<llvm::StringRef> producer = root ? root->getString("producer") : std::nullopt;
+    if (!members || !producer) {
+        error = "corrupt index";
+        return nullptr;
+    }
+    library->Producer = producer->str();
+
+    for (const llvm::json::Value& value : *members) {
+        const llvm::json::Object* member = value.getAsObject();
+        std::optional<llvm::StringRef> name = member ? member->getString("name") : std::nullopt;
+        std::optional<int64_t> offset = member ? member->getInteger("offset") : std::nullopt;
+        std::optional<int64_t> size = member ? member->getInteger("size") : std::nullopt;
+        const llvm::json::Object* metadata = member ? member->getObject("metadata") : nullptr;
+        if (!name || !offset || !size || !metadata || *offset < 0 || *size < 0 || std::size_t(*offset) + std::size_t(*size) > data.size()) {
+            error = "corrupt member in index";
+            return nullptr;
+        }
+
+        library->MemberIndices.try_emplace(*name, library->Members.size());
+        library->Members.push_back(Member { name->str(), *metadata, data.substr(*offset, *size) });
+    }
+
+    library->Buffer = std::move(*buffer);
+    return library;
+}
+
+bool DeviceLibrary::write(const std::string& path, llvm::StringRef producer, llvm::ArrayRef<Member> members, std::string& error)
+{
+    llvm::json::Array index;
+    std::size_t offset = 0;
+    for (const Member& member : members) {
+        index.push_back(llvm::json::Object {
+            { "name", member.name },
+            { "offset", int64_t(offset) },
+            { "size", int64_t(member.bitcode.size()) },
+            { "hash", SpvCache::hash({ member.bitcode }) },
+            { "metadata", llvm::json::Object(member.metadata) },
+        });
+        offset += alignTo(member.bitcode.size());
+    }
+
+    std::string indexText;
+    llvm::raw_string_ostream(indexText) << llvm::json::Value(llvm::json::Object { { "producer", producer }, { "members", std::move(index) } });
+    std::string header = Magic.str();
+    std::string sizeLine = std::to_string(indexText.size()) + "\n";
+    // Widening the index can make its size line longer, which moves the index again
+    while ((header.size() + sizeLine.size() + indexText.size()) % Alignment != 0) {
+        indexText.push_back(' ');
+        sizeLine = std::to_string(indexText.size()) + "\n";
+    }
+
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    if (ec) {
+        error = ec.message();
+        return false;
+    }
+    os << header << sizeLine << indexText;
+    for (const Member& member : members) {
+        os << member.bitcode;
+        os.write_zeros(alignTo(member.bitcode.size()) - member.bitcode.size());
+    }
+    os.close();
+    if (os.has_error()) {
+        error = os.error().message();
+        os.clear_error();
+        return false;
+    }
+    return true;
+}
+
+const DeviceLibrary::Member* DeviceLibrary::find(llvm::StringRef name) const
+{
+    auto it = MemberIndices.find(name);
+    return it == MemberIndices.end() ? nullptr : &Members[it->second];
+}
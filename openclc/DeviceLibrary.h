@@ -0,0 +1,67 @@
+//===--- DeviceLibrary.h - Precompiled Kernel Archives ----------*- C++ -*-===//
+//
+// A `.oclclib` device library holds kernels that were compiled and optimized
+// once, as LLVM bitcode, together with whatever the driver needs to generate
+// their host stubs. Applications link in only the kernels they launch, so
+// their build time doesn't grow with the size of the library.
+//
+// The container knows nothing about kernels beyond their names. Each member
+// carries an opaque JSON object of metadata that is written and read back by
+// the driver.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_DEVICE_LIBRARY_H
+#define OPENCLC_DEVICE_LIBRARY_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace openclc {
+
+class DeviceLibrary {
+public:
+    struct Member {
+        std::string name;
+        llvm::json::Object metadata;
+        /// Points into the mapped library when read, and at the caller's buffer when written
+        llvm::StringRef bitcode;
+    };
+
+    /// Maps the library at `path` and reads its index, members are only read once they are used
+    ///
+    /// Returns null with `error` set if the file can't be read or isn't a device library.
+    static std::unique_ptr<DeviceLibrary> open(const std::string& path, std::string& error);
+
+    /// Writes `members` as a device library to `path`, returns false with `error` set on failure
+    static bool write(const std::string& path, llvm::StringRef producer, llvm::ArrayRef<Member> members, std::string& error);
+
+    /// Compiler and LLVM version the library was built with
+    llvm::StringRef producer() const { return Producer; }
+
+    /// The JSON index of the library, which changes whenever a member's bitcode or metadata does, since it holds a hash of
+    /// every member's bitcode
+    llvm::StringRef index() const { return Index; }
+
+    llvm::ArrayRef<Member> members() const { return Members; }
+
+    /// The member named `name`, or null
+    const Member* find(llvm::StringRef name) const;
+
+private:
+    std::unique_ptr<llvm::MemoryBuffer> Buffer;
+    std::string Producer;
+    llvm::StringRef Index;
+    std::vector<Member> Members;
+    llvm::StringMap<std::size_t> MemberIndices;
+};
+
+} // end namespace openclc
+
+#endif
@@ -0,0 +1,321 @@
+//===--- DevicePipeline.cpp - Device Code to SPIR-V -----------------------===//
+//
+// `opencl-c.h` is linked in from the `opencl_headers` library, the device
+// header lives here. Both are mapped into each clang instance from memory,
+// so compiling never touches the file system for them.
+//
+//===----------------------------------------------------------------------===//
+
+#include "DevicePipeline.h"
+#include "LLVMSPIRVLib/LLVMSPIRVLib.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Passes/StandardInstrumentations.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/ADCE.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopDeletion.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include <cstring>
+#include <ostream>
+
+using namespace openclc;
+
+extern const char* opencl_c_h_data;
+extern size_t opencl_c_h_size;
+
+/// Utility needed in ConfigureDeviceCompilerInstance, to set contents of `opencl-c.h`
+namespace {
+
+struct OpenCLBuiltinMemoryBuffer final : public llvm::MemoryBuffer {
+    OpenCLBuiltinMemoryBuffer(const void* data, uint64_t data_length)
+    {
+        const char* dataCasted = reinterpret_cast<const char*>(data);
+        init(dataCasted, dataCasted + data_length, true);
+    }
+
+    virtual llvm::MemoryBuffer::BufferKind getBufferKind() const override
+    {
+        return llvm::MemoryBuffer::MemoryBuffer_Malloc;
+    }
+
+    virtual ~OpenCLBuiltinMemoryBuffer() override { }
+};
+
+} // end anonymous namespace
+
+/// Device declarations openclc provides on top of `opencl-c.h`
+///
+/// `spec_const(type, name, id, default)` declares a constant in a kernel body whose value is chosen on the host before launching.
+/// `__spirv_SpecConstant` calls are lowered to `OpSpecConstant` decorated with `SpecId` `id` by the SPIR-V translator.
+/// `__launch_bounds__(maxThreadsPerBlock[, minBlocksPerMultiprocessor])` is CUDA's, recorded as a `LaunchBoundsAnnotation` annotation.
+static constexpr llvm::StringLiteral OpenCLCDeviceHeader = R"(#ifndef __OPENCLC_DEVICE_H
+#define __OPENCLC_DEVICE_H
+
+#define __OPENCLC_SPEC_CONSTANT(type) type __attribute__((overloadable, const)) __spirv_SpecConstant(int, type);
+__OPENCLC_SPEC_CONSTANT(bool)
+__OPENCLC_SPEC_CONSTANT(char)
+__OPENCLC_SPEC_CONSTANT(uchar)
+__OPENCLC_SPEC_CONSTANT(short)
+__OPENCLC_SPEC_CONSTANT(ushort)
+__OPENCLC_SPEC_CONSTANT(int)
+__OPENCLC_SPEC_CONSTANT(uint)
+__OPENCLC_SPEC_CONSTANT(long)
+__OPENCLC_SPEC_CONSTANT(ulong)
+__OPENCLC_SPEC_CONSTANT(float)
+#ifdef cl_khr_fp64
+__OPENCLC_SPEC_CONSTANT(double)
+#endif
+#undef __OPENCLC_SPEC_CONSTANT
+
+#define spec_const(type, name, id, default) const type name = __spirv_SpecConstant(id, (type)(default))
+
+#define __launch_bounds__(...) __attribute__((annotate("openclc_launch_bounds", __VA_ARGS__)))
+
+#endif // __OPENCLC_DEVICE_H
+)";
+
+void openclc::ConfigureDeviceCompilerInstance(clang::CompilerInstance& clangInstance, const DeviceOptions& options)
+{
+    // target
+    clangInstance.getTargetOpts().Triple = "spirv64-unknown-unknown";
+    clangInstance.setTarget(clang::TargetInfo::CreateTargetInfo(clangInstance.getDiagnostics(), std::make_shared<clang::TargetOptions>(clangInstance.getTargetOpts())));
+
+    // instance options
+    clangInstance.createFileManager();
+    clangInstance.createSourceManager(clangInstance.getFileManager());
+
+    // language options, copied from CLSPV
+    // -std=CL2.0 by default.
+    clangInstance.getLangOpts().C99 = true;
+    clangInstance.getLangOpts().RTTI = false;
+    clangInstance.getLangOpts().RTTIData = false;
+    clangInstance.getLangOpts().MathErrno = false;
+    clangInstance.getLangOpts().Optimize = options.optLevel > 0;
+    clangInstance.getLangOpts().NoBuiltin = true;
+    clangInstance.getLangOpts().ModulesSearchAll = false;
+    clangInstance.getLangOpts().SinglePrecisionConstants = true;
+    clangInstance.getLangOpts().DeclareOpenCLBuiltins = true;
+    clangInstance.getLangOpts().NativeHalfType = true; // enabled by default
+    clangInstance.getLangOpts().NativeHalfArgsAndReturns = true; // enabled by default
+    clangInstance.getCodeGenOpts().StackRealignment = true;
+    clangInstance.getCodeGenOpts().SimplifyLibCalls = false;
+    clangInstance.getCodeGenOpts().EmitOpenCLArgMetadata = false;
+    clangInstance.getCodeGenOpts().DisableO0ImplyOptNone = true;
+    clangInstance.getCodeGenOpts().OptimizationLevel = options.optLevel;
+
+    std::vector<std::string> includes;
+    clang::LangOptions::setLangDefaults(
+        clangInstance.getLangOpts(),
+        options.language,
+        llvm::Triple { "spirv64-unknown-unknown" },
+        includes,
+        options.standard);
+
+    clangInstance.getPreprocessorOpts().addMacroDef("__SPIRV__");
+    std::unique_ptr<llvm::MemoryBuffer> opencl_c_h_buffer(new OpenCLBuiltinMemoryBuffer(opencl_c_h_data, opencl_c_h_size));
+    clang::FileEntryRef opencl_c_h_ref = clangInstance.getFileManager().getVirtualFileRef("include/opencl-c.h", opencl_c_h_buffer->getBufferSize(), 0);
+    clangInstance.getSourceManager().overrideFileContents(opencl_c_h_ref, std::move(opencl_c_h_buffer));
+    std::unique_ptr<llvm::MemoryBuffer> openclc_device_h_buffer = llvm::MemoryBuffer::getMemBuffer(OpenCLCDeviceHeader, "openclc-device.h");
+    clang::FileEntryRef openclc_device_h_ref = clangInstance.getFileManager().getVirtualFileRef("include/openclc-device.h", openclc_device_h_buffer->getBufferSize(), 0);
+    clangInstance.getSourceManager().overrideFileContents(openclc_device_h_ref, std::move(openclc_device_h_buffer));
+
+    for (const std::string& define : options.defines) {
+        clangInstance.getPreprocessorOpts().addMacroDef(define);
+    }
+
+    for (const std::string& include : options.includes) {
+        clangInstance.getHeaderSearchOpts().AddPath(include, clang::frontend::After, false, false);
+    }
+}
+
+/// Runs the LLVM optimization pipeline for `-O1` to `-O3` over `mod`
+///
+/// This is a subset of the default pipeline, limited to passes whose output llvm-spirv accepts. In particular there is no
+/// vectorization, since its vector widths need not be valid in SPIR-V. Loops are unrolled as `opencl_unroll_hint` asks at
+/// every level, and by the usual heuristics from `-O2`.
+void openclc::OptimizeModule(llvm::Module& mod, unsigned optLevel)
+{
+    llvm::LoopAnalysisManager LAM;
+    llvm::FunctionAnalysisManager FAM;
+    llvm::CGSCCAnalysisManager CGAM;
+    llvm::ModuleAnalysisManager MAM;
+
+    // Every pass is a `--time-trace` event when the calling thread is traced
+    llvm::PassInstrumentationCallbacks PIC;
+    llvm::TimeProfilingPassesHandler timeProfiling;
+    timeProfiling.registerCallbacks(PIC);
+
+    llvm::PassBuilder PB(nullptr, llvm::PipelineTuningOptions(), std::nullopt, &PIC);
+    PB.registerModuleAnalyses(MAM);
+    PB.registerCGSCCAnalyses(CGAM);
+    PB.registerFunctionAnalyses(FAM);
+    PB.registerLoopAnalyses(LAM);
+    PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+
+    llvm::ModulePassManager MPM;
+
+    // Only kernels are called from the host, everything else may be inlined away and dropped
+    MPM.addPass(llvm::InternalizePass([](const llvm::GlobalValue& gv) {
+        auto* fn = llvm::dyn_cast<llvm::Function>(&gv);
+        return fn && fn->getCallingConv() == llvm::CallingConv::SPIR_KERNEL;
+    }));
+    MPM.addPass(llvm::GlobalDCEPass());
+
+    llvm::FunctionPassManager earlyFPM;
+    earlyFPM.addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
+    earlyFPM.addPass(llvm::EarlyCSEPass());
+    earlyFPM.addPass(llvm::SimplifyCFGPass());
+    MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(earlyFPM)));
+
+    // Inline bottom up, cleaning up each function before its callers consider inlining it
+    llvm::ModuleInlinerWrapperPass inliner(llvm::getInlineParams(optLevel, 0));
+    llvm::FunctionPassManager simplifyFPM;
+    simplifyFPM.addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG));
+    simplifyFPM.addPass(llvm::EarlyCSEPass(/*UseMemorySSA=*/true));
+    simplifyFPM.addPass(llvm::InstCombinePass());
+    simplifyFPM.addPass(llvm::SimplifyCFGPass());
+    inliner.getPM().addPass(llvm::createCGSCCToFunctionPassAdaptor(std::move(simplifyFPM)));
+    MPM.addPass(std::move(inliner));
+
+    llvm::FunctionPassManager loopFPM;
+    llvm::LoopPassManager rotateLPM;
+    rotateLPM.addPass(llvm::LoopRotatePass());
+    rotateLPM.addPass(llvm::LICMPass(llvm::LICMOptions()));
+    loopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(std::move(rotateLPM), /*UseMemorySSA=*/true));
+    llvm::LoopPassManager unrollLPM;
+    unrollLPM.addPass(llvm::IndVarSimplifyPass());
+    unrollLPM.addPass(llvm::LoopDeletionPass());
+    unrollLPM.addPass(llvm::LoopFullUnrollPass(optLevel, /*OnlyWhenForced=*/optLevel < 2));
+    loopFPM.addPass(llvm::createFunctionToLoopPassAdaptor(std::move(unrollLPM)));
+    loopFPM.addPass(llvm::SROAPass(llvm::SROAOptions::ModifyCFG)); // arrays indexed by unrolled induction variables
+    if (optLevel > 1)
+        loopFPM.addPass(llvm::GVNPass());
+    loopFPM.addPass(llvm::LoopUnrollPass(llvm::LoopUnrollOptions(optLevel, /*OnlyWhenForced=*/optLevel < 2, /*ForgetSCEV=*/false)));
+    loopFPM.addPass(llvm::InstCombinePass());
+    loopFPM.addPass(llvm::SimplifyCFGPass());
+    loopFPM.addPass(llvm::ADCEPass());
+    MPM.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(loopFPM)));
+    MPM.addPass(llvm::GlobalDCEPass());
+
+    MPM.run(mod, MAM);
+}
+
+/// Rough upper bound on the bytes llvm-spirv emits for `mod`, so the output buffer is allocated once
+std::size_t openclc::EstimateSpvSize(const llvm::Module& mod)
+{
+    std::size_t instructions = 0;
+    for (const llvm::Function& fn : mod)
+        instructions += fn.getInstructionCount() + fn.arg_size();
+    // Header, capabilities, the extended instruction set import and debug names
+    constexpr std::size_t preamble = 4096;
+    // Most instructions are a result type, a result id and a handful of operands
+    constexpr std::size_t bytesPerInstruction = 24;
+    return preamble + (instructions + mod.global_size()) * bytesPerInstruction;
+}
+
+/// https://stackoverflow.com/questions/786555/c-stream-to-memory
+/// https://gist.github.com/stephanlachnit/4a06f8475afd144e73235e2a2584b000
+///
+/// Stream Buffer backed by a std::vector<char>
+///
+/// For interfaces heavily bound to std::ostream << patterns
+namespace {
+
+struct membuf : std::streambuf {
+public:
+    membuf() { }
+    membuf(std::size_t sizeHint) { vec.reserve(sizeHint); }
+    std::streamsize xsputn(const char* s, std::streamsize count) override
+    {
+        vec.insert(vec.end(), s, s + count);
+        return count;
+    }
+    int_type overflow(int_type ch) override
+    {
+        if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            vec.push_back(traits_type::to_char_type(ch));
+        return traits_type::not_eof(ch);
+    }
+    std::vector<char> vec;
+};
+
+} // end anonymous namespace
+
+bool openclc::WriteSpv(llvm::Module& mod, SPIRV::VersionNumber version, std::vector<uint32_t>& spv, std::string& error)
+{
+    membuf mbuf(EstimateSpvSize(mod));
+    std::ostream os(&mbuf);
+    SPIRV::TranslatorOpts translatorOptions(version);
+    if (!llvm::writeSpirv(&mod, translatorOptions, os, error))
+        return false;
+
+    assert(mbuf.vec.size() % 4 == 0 && "Generated SPIR-V is corrupt, exiting.");
+    spv.resize(mbuf.vec.size() / 4);
+    std::memcpy(spv.data(), mbuf.vec.data(), mbuf.vec.size());
+    return true;
+}
+
+/// SPIR-V Tools environment matching a SPIR-V version
+spv_target_env openclc::SpvTargetEnv(SPIRV::VersionNumber version)
+{
+    spv_target_env env;
+    switch (version) {
+    case SPIRV::VersionNumber::SPIRV_1_0:
+        env = SPV_ENV_UNIVERSAL_1_0;
+        break;
+    case SPIRV::VersionNumber::SPIRV_1_1:
+        env = SPV_ENV_UNIVERSAL_1_1;
+        break;
+    case SPIRV::VersionNumber::SPIRV_1_2:
+        env = SPV_ENV_UNIVERSAL_1_2;
+        break;
+    case SPIRV::VersionNumber::SPIRV_1_3:
+        env = SPV_ENV_UNIVERSAL_1_3;
+        break;
+    case SPIRV::VersionNumber::SPIRV_1_4:
+        env = SPV_ENV_UNIVERSAL_1_4;
+        break;
+    case SPIRV::VersionNumber::SPIRV_1_5:
+        env = SPV_ENV_UNIVERSAL_1_5;
+        break;
+    }
+    return env;
+}
+
+/// spirv-opt flags of a `--spv-opt` profile
+///
+/// Returns false for an unknown profile.
+bool openclc::SpvOptPassFlags(llvm::StringRef profile, std::vector<std::string>& flags)
+{
+    if (profile == "perf") {
+        flags = { "-O" };
+    } else if (profile == "size") {
+        flags = { "-Os" };
+    } else if (profile == "none") {
+        flags = {};
+    } else if (profile.consume_front("custom:")) {
+        llvm::SmallVector<llvm::StringRef> passes;
+        profile.split(passes, ',', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+        flags.clear();
+        for (llvm::StringRef pass : passes)
+            flags.push_back("--" + pass.trim().ltrim('-').str());
+    } else {
+        return false;
+    }
+    return true;
+}
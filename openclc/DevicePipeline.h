@@ -0,0 +1,74 @@
+//===--- DevicePipeline.h - Device Code to SPIR-V ---------------*- C++ -*-===//
+//
+// The steps that take OpenCL C from a configured clang instance to validated
+// SPIR-V, shared by the openclc driver and the libopenclc runtime compiler.
+//
+// Nothing here reads the driver's command line, prints or exits. The driver
+// maps its flags onto `DeviceOptions` and reports failures itself, so the
+// library can run the same pipeline on many threads at once and hand errors
+// back to its caller.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_DEVICE_PIPELINE_H
+#define OPENCLC_DEVICE_PIPELINE_H
+
+#include "LLVMSPIRVLib/LLVMSPIRVOpts.h"
+#include "spirv-tools/libspirv.h"
+#include "clang/Basic/LangStandard.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace clang {
+class CompilerInstance;
+}
+
+namespace llvm {
+class Module;
+}
+
+namespace openclc {
+
+/// Annotation `__launch_bounds__` expands to in the device header
+inline constexpr llvm::StringLiteral LaunchBoundsAnnotation = "openclc_launch_bounds";
+
+/// Language and preprocessor options of device code
+struct DeviceOptions {
+    clang::Language language = clang::Language::OpenCL;
+    clang::LangStandard::Kind standard = clang::LangStandard::lang_opencl12;
+    /// LLVM optimization level, 0 to 3
+    unsigned optLevel = 2;
+    std::vector<std::string> defines;
+    std::vector<std::string> includes;
+};
+
+/// Applies the target, language and preprocessor options of the device codegen frontend
+///
+/// Maps `opencl-c.h` and `openclc-device.h` into the instance's file manager as `include/...`, to be named in the
+/// preprocessor's includes or a PCH. Diagnostics must already be created.
+void ConfigureDeviceCompilerInstance(clang::CompilerInstance& clangInstance, const DeviceOptions& options);
+
+/// Runs the LLVM optimization pipeline for `-O1` to `-O3` over `mod`
+void OptimizeModule(llvm::Module& mod, unsigned optLevel);
+
+/// Rough upper bound on the bytes llvm-spirv emits for `mod`, so the output buffer is allocated once
+std::size_t EstimateSpvSize(const llvm::Module& mod);
+
+/// Lowers `mod` to SPIR-V `version` with llvm-spirv, which rewrites the module as it goes
+///
+/// Returns false with the translator's message in `error`.
+bool WriteSpv(llvm::Module& mod, SPIRV::VersionNumber version, std::vector<uint32_t>& spv, std::string& error);
+
+/// SPIR-V Tools environment matching a SPIR-V version
+spv_target_env SpvTargetEnv(SPIRV::VersionNumber version);
+
+/// spirv-opt flags of a `--spv-opt` profile: perf, size, none or custom:<pass>,<pass>,...
+///
+/// Returns false for an unknown profile.
+bool SpvOptPassFlags(llvm::StringRef profile, std::vector<std::string>& flags);
+
+} // end namespace openclc
+
+#endif
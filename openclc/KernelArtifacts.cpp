@@ -0,0 +1,134 @@
+//===--- KernelArtifacts.cpp - Intermediate Files of Device Code ----------===//
+//
+// SPIR-V is counted by walking its words rather than with the SPIR-V Tools
+// parser, every instruction starts with its word count and opcode.
+//
+//===----------------------------------------------------------------------===//
+
+#include "KernelArtifacts.h"
+#include "spirv-tools/libspirv.hpp"
+#include "spirv/unified1/spirv.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LLVMRemarkStreamer.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Remarks/RemarkStreamer.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+
+using namespace openclc;
+
+/// Words before the first instruction: magic number, version, generator, id bound and schema
+static constexpr std::size_t SpvHeaderWords = 5;
+
+namespace {
+
+/// Opens `path` for `write` to fill, reporting open and write failures in `error`
+template <typename WriteFn>
+bool WriteFile(const std::string& path, bool binary, std::string& error, WriteFn write)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec, binary ? llvm::sys::fs::OF_None : llvm::sys::fs::OF_Text);
+    if (ec) {
+        error = "Failed to open `" + path + "`: " + ec.message();
+        return false;
+    }
+    write(os);
+    os.close();
+    if (os.has_error()) {
+        error = "Failed to write `" + path + "`: " + os.error().message();
+        os.clear_error();
+        return false;
+    }
+    return true;
+}
+
+} // end anonymous namespace
+
+bool openclc::WriteModuleFile(const llvm::Module& mod, const std::string& path, bool bitcode, std::string& error)
+{
+    return WriteFile(path, bitcode, error, [&](llvm::raw_ostream& os) {
+        if (bitcode)
+            llvm::WriteBitcodeToFile(mod, os);
+        else
+            mod.print(os, nullptr);
+    });
+}
+
+bool openclc::WriteSpvFile(const std::vector<uint32_t>& spv, spv_target_env env, const std::string& path, bool disassemble, std::string& error)
+{
+    std::string text;
+    if (disassemble) {
+        spvtools::SpirvTools tools(env);
+        std::string messages;
+        tools.SetMessageConsumer([&messages](spv_message_level_t, const char*, const spv_position_t&, const char* message) { messages += message; });
+        uint32_t options = SPV_BINARY_TO_TEXT_OPTION_FRIENDLY_NAMES | SPV_BINARY_TO_TEXT_OPTION_INDENT | SPV_BINARY_TO_TEXT_OPTION_COMMENT;
+        if (!tools.Disassemble(spv, &text, options)) {
+            error = "Failed to disassemble `" + path + "`: " + messages;
+            return false;
+        }
+    }
+    return WriteFile(path, !disassemble, error, [&](llvm::raw_ostream& os) {
+        if (disassemble)
+            os << text;
+        else
+            os.write(reinterpret_cast<const char*>(spv.data()), spv.size() * sizeof(uint32_t));
+    });
+}
+
+SpvStatistics openclc::CountSpvInstructions(llvm::ArrayRef<uint32_t> spv)
+{
+    SpvStatistics stats;
+    stats.bytes = spv.size() * sizeof(uint32_t);
+    for (std::size_t i = SpvHeaderWords; i < spv.size();) {
+        uint32_t wordCount = spv[i] >> 16;
+        if (wordCount == 0 || i + wordCount > spv.size())
+            break;
+        stats.instructions++;
+        switch (static_cast<SpvOp>(spv[i] & 0xffff)) {
+        case SpvOpFunction:
+            stats.functions++;
+            break;
+        case SpvOpLoad:
+            stats.loads++;
+            break;
+        case SpvOpStore:
+            stats.stores++;
+            break;
+        case SpvOpControlBarrier:
+        case SpvOpMemoryBarrier:
+            stats.barriers++;
+            break;
+        default:
+            break;
+        }
+        i += wordCount;
+    }
+    return stats;
+}
+
+OptimizationRemarksFile::OptimizationRemarksFile() = default;
+
+OptimizationRemarksFile::~OptimizationRemarksFile()
+{
+    if (!File)
+        return;
+    // The context may outlive the file, later passes must not stream into it
+    Context->setLLVMRemarkStreamer(nullptr);
+    Context->setMainRemarkStreamer(nullptr);
+    File->keep();
+}
+
+bool OptimizationRemarksFile::open(llvm::LLVMContext& ctx, const std::string& path, llvm::StringRef passes, std::string& error)
+{
+    llvm::Expected<std::unique_ptr<llvm::ToolOutputFile>> file = llvm::setupLLVMOptimizationRemarks(ctx, path, passes, "yaml", /*RemarksWithHotness=*/false);
+    if (!file) {
+        error = llvm::toString(file.takeError());
+        return false;
+    }
+    Context = &ctx;
+    File = std::move(*file);
+    return true;
+}
@@ -0,0 +1,74 @@
+//===--- KernelArtifacts.h - Intermediate Files of Device Code --*- C++ -*-===//
+//
+// `--emit` writes the stages a kernel goes through on its way to the driver:
+// the optimized LLVM module handed to llvm-spirv, as text or bitcode, and the
+// SPIR-V that is embedded, as a binary or disassembled. `SpvStatistics`
+// counts what a SPIR-V module holds for the per kernel summary, and
+// `OptimizationRemarksFile` streams the remarks of the LLVM passes to YAML.
+//
+// Like `DevicePipeline`, nothing here prints or exits, failures are handed
+// back with their reason.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_KERNEL_ARTIFACTS_H
+#define OPENCLC_KERNEL_ARTIFACTS_H
+
+#include "spirv-tools/libspirv.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace llvm {
+class LLVMContext;
+class Module;
+class ToolOutputFile;
+}
+
+namespace openclc {
+
+/// Writes `mod` to `path` as LLVM assembly, or as bitcode if `bitcode`
+///
+/// Returns false with the reason in `error`.
+bool WriteModuleFile(const llvm::Module& mod, const std::string& path, bool bitcode, std::string& error);
+
+/// Writes `spv` to `path` as raw words, or as spirv-dis assembly if `disassemble`
+///
+/// Returns false with the reason in `error`.
+bool WriteSpvFile(const std::vector<uint32_t>& spv, spv_target_env env, const std::string& path, bool disassemble, std::string& error);
+
+/// Instruction counts and size of a SPIR-V module
+struct SpvStatistics {
+    std::size_t bytes = 0;
+    std::size_t instructions = 0;
+    std::size_t functions = 0;
+    std::size_t loads = 0;
+    std::size_t stores = 0;
+    std::size_t barriers = 0;
+};
+
+/// Counts the instructions of `spv`, stopping at the first malformed one
+SpvStatistics CountSpvInstructions(llvm::ArrayRef<uint32_t> spv);
+
+/// Streams the optimization remarks emitted in an LLVM context to a YAML file, until destroyed
+class OptimizationRemarksFile {
+    llvm::LLVMContext* Context = nullptr;
+    std::unique_ptr<llvm::ToolOutputFile> File;
+
+public:
+    OptimizationRemarksFile();
+    ~OptimizationRemarksFile();
+
+    /// Starts streaming the remarks of the passes matching the regex `passes`, or of every pass if empty, from `ctx` to `path`
+    ///
+    /// Returns false with the reason in `error`.
+    bool open(llvm::LLVMContext& ctx, const std::string& path, llvm::StringRef passes, std::string& error);
+};
+
+} // end namespace openclc
+
+#endif
@@ -0,0 +1,170 @@
+//===--- SpvCache.cpp - Persistent SPIR-V Cache ---------------------------===//
+//
+// Layout: `<dir>/<first 2 hex digits of key>/<remaining digits>.spv`, holding
+// the raw SPIR-V words of one entry. openclc keeps its precompiled device
+// headers in `<dir>/pch/<key>.pch` and its runtime in `<dir>/libopenclc_rt-*.a`,
+// which count towards the size limit too.
+//
+//===----------------------------------------------------------------------===//
+
+#include "SpvCache.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA256.h"
+#include "llvm/Support/raw_ostream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+
+using namespace openclc;
+namespace fs = std::filesystem;
+
+/// First word of every SPIR-V module, used to reject truncated or foreign files
+static constexpr uint32_t SpvMagicNumber = 0x07230203;
+
+/// Fraction of `MaxSize` that `evict` shrinks the cache to, so that a full cache isn't rescanned on every store
+static constexpr std::uintmax_t EvictTargetPercent = 90;
+
+/// Age past which a `.tmp` file is left over from an interrupted store rather than being written
+static constexpr std::chrono::hours StaleTemporaryAge { 1 };
+
+SpvCache::SpvCache(fs::path dir, std::uintmax_t maxSize)
+    : Dir(std::move(dir))
+    , MaxSize(maxSize)
+{
+}
+
+std::string SpvCache::hash(llvm::ArrayRef<llvm::StringRef> parts)
+{
+    llvm::SHA256 hasher;
+    for (llvm::StringRef part : parts) {
+        uint64_t size = part.size();
+        hasher.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&size), sizeof(size)));
+        hasher.update(part);
+    }
+    return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+fs::path SpvCache::entryPath(llvm::StringRef key) const
+{
+    assert(key.size() > 2 && "cache keys are hex encoded hashes");
+    fs::path path = Dir;
+    path /= key.take_front(2).str();
+    path /= key.drop_front(2).str() + ".spv";
+    return path;
+}
+
+bool SpvCache::lookup(llvm::StringRef key, std::vector<uint32_t>& words)
+{
+    fs::path path = entryPath(key);
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(path.string(), /*IsText=*/false, /*RequiresNullTerminator=*/false);
+    if (!buffer)
+        return false;
+
+    llvm::StringRef bytes = (*buffer)->getBuffer();
+    if (bytes.size() < sizeof(uint32_t) || bytes.size() % sizeof(uint32_t) != 0)
+        return false;
+
+    words.resize(bytes.size() / sizeof(uint32_t));
+    std::memcpy(words.data(), bytes.data(), bytes.size());
+    if (words[0] != SpvMagicNumber) {
+        words.clear();
+        return false;
+    }
+
+    // Mark the entry as recently used. Losing a race with `evict` in another process only costs a miss next time.
+    std::error_code ec;
+    fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+
+    return true;
+}
+
+void SpvCache::store(llvm::StringRef key, llvm::ArrayRef<uint32_t> words)
+{
+    fs::path path = entryPath(key);
+
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    if (ec)
+        return;
+
+    // Write to a unique sibling, then rename over the entry. Renames within a directory are atomic.
+    int fd;
+    llvm::SmallString<256> tmpPath;
+    if (llvm::sys::fs::createUniqueFile(path.string() + ".%%%%%%%%.tmp", fd, tmpPath))
+        return;
+
+    {
+        llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+        os.write(reinterpret_cast<const char*>(words.data()), words.size() * sizeof(uint32_t));
+        os.close();
+        if (os.has_error()) {
+            os.clear_error();
+            fs::remove(tmpPath.str().str(), ec);
+            return;
+        }
+    }
+
+    fs::rename(tmpPath.str().str(), path, ec);
+    if (ec) {
+        fs::remove(tmpPath.str().str(), ec);
+        return;
+    }
+
+    Dirty = true;
+}
+
+void SpvCache::evict()
+{
+    if (!Dirty.exchange(false))
+        return;
+
+    struct Entry {
+        fs::path path;
+        std::uintmax_t size;
+        fs::file_time_type lastUse;
+    };
+    std::vector<Entry> entries;
+    std::uintmax_t totalSize = 0;
+
+    std::error_code ec;
+    fs::file_time_type staleBefore = fs::file_time_type::clock::now() - StaleTemporaryAge;
+    for (fs::recursive_directory_iterator it(Dir, ec), end; !ec && it != end; it.increment(ec)) {
+        fs::path extension = it->path().extension();
+        if (!it->is_regular_file(ec) || (extension != ".spv" && extension != ".pch" && extension != ".a" && extension != ".tmp"))
+            continue;
+
+        Entry entry { it->path(), it->file_size(ec), it->last_write_time(ec) };
+        if (ec) { // removed by a concurrent `evict`
+            ec.clear();
+            continue;
+        }
+
+        if (extension == ".tmp") {
+            if (entry.lastUse < staleBefore)
+                fs::remove(entry.path, ec);
+            ec.clear();
+            continue;
+        }
+
+        totalSize += entry.size;
+        entries.push_back(std::move(entry));
+    }
+
+    if (totalSize <= MaxSize)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.lastUse < b.lastUse; });
+
+    std::uintmax_t targetSize = MaxSize / 100 * EvictTargetPercent;
+    for (const Entry& entry : entries) {
+        if (totalSize <= targetSize)
+            break;
+        fs::remove(entry.path, ec);
+        totalSize -= entry.size;
+    }
+}
@@ -0,0 +1,61 @@
+//===--- SpvCache.h - Persistent SPIR-V Cache -------------------*- C++ -*-===//
+//
+// A content addressed, on-disk store of optimized SPIR-V shared by every
+// openclc process pointed at the same directory, similar to ccache.
+//
+// Entries are written to a unique temporary file and renamed into place, so
+// concurrent `make -j` jobs never observe a partially written entry. Hits
+// refresh the entry's modification time, which `evict` uses to drop the least
+// recently used entries once the cache outgrows its size limit, along with
+// the PCHs and runtime libraries openclc keeps in the same directory.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_SPV_CACHE_H
+#define OPENCLC_SPV_CACHE_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace openclc {
+
+class SpvCache {
+    std::filesystem::path Dir;
+    std::uintmax_t MaxSize;
+
+    /// Set once an entry is stored, so `evict` only scans the directory when it could have grown.
+    std::atomic<bool> Dirty = false;
+
+    std::filesystem::path entryPath(llvm::StringRef key) const;
+
+public:
+    SpvCache(std::filesystem::path dir, std::uintmax_t maxSize);
+
+    /// Hex encoded SHA-256 of `parts`, each part is length prefixed so that
+    /// different splits of the same bytes hash differently.
+    static std::string hash(llvm::ArrayRef<llvm::StringRef> parts);
+
+    /// Fills `words` with the entry for `key`.
+    ///
+    /// Returns true on a hit. Missing, unreadable and corrupt entries are all misses.
+    bool lookup(llvm::StringRef key, std::vector<uint32_t>& words);
+
+    /// Atomically publishes `words` under `key`. Failures are silently ignored
+    /// since the cache is only an accelerator.
+    void store(llvm::StringRef key, llvm::ArrayRef<uint32_t> words);
+
+    /// Removes least recently used entries, PCHs and runtime libraries until the cache fits in its size limit, and temporaries left behind
+    /// by interrupted stores.
+    ///
+    /// Only scans once something was stored. A new PCH comes with new device flags, so with stores of their kernels too.
+    void evict();
+};
+
+} // end namespace openclc
+
+#endif
@@ -0,0 +1,208 @@
+//===--- TimeReport.cpp - Phase Timing and Time Traces --------------------===//
+//
+// CPU times are those of the thread that ran the region, so regions on pool
+// threads don't count each other's work. The host compiler runs in another
+// process, its regions show the time openclc waited for it.
+//
+//===----------------------------------------------------------------------===//
+
+#include "TimeReport.h"
+#include "fmt/core.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/Support/Error.h"
+#include "llvm/Support/Process.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+using namespace openclc;
+
+namespace {
+
+struct Region {
+    std::string phase;
+    std::string file;
+    std::string kernel;
+    double wall;
+    double cpu;
+    std::size_t peakMemory;
+};
+
+std::atomic<bool> Reporting = false;
+std::mutex RegionsMutex;
+std::vector<Region> Regions;
+std::chrono::steady_clock::time_point ReportStart;
+
+std::atomic<bool> Tracing = false;
+std::atomic<unsigned> TraceGranularity = 0;
+
+/// CPU time of the calling thread in milliseconds
+double ThreadCpuTime()
+{
+#if defined(_WIN32)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0;
+    auto ticks = [](FILETIME time) { return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+    return (ticks(kernel) + ticks(user)) / 1e4; // 100 ns ticks
+#else
+    timespec time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time) != 0)
+        return 0;
+    return time.tv_sec * 1e3 + time.tv_nsec / 1e6;
+#endif
+}
+
+/// CPU time of every thread of this process in milliseconds
+double ProcessCpuTime()
+{
+    llvm::sys::TimePoint<> elapsed;
+    std::chrono::nanoseconds user, system;
+    llvm::sys::Process::GetTimeUsage(elapsed, user, system);
+    return std::chrono::duration<double, std::milli>(user + system).count();
+}
+
+double MiB(std::size_t bytes)
+{
+    return bytes / (1024.0 * 1024.0);
+}
+
+} // end anonymous namespace
+
+std::size_t openclc::PeakMemoryUsage()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#if __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return std::size_t(usage.ru_maxrss) * 1024; // KiB
+#endif
+#endif
+}
+
+void openclc::StartTimeReport()
+{
+    std::lock_guard<std::mutex> lock(RegionsMutex);
+    Regions.clear();
+    ReportStart = std::chrono::steady_clock::now();
+    Reporting = true;
+}
+
+std::string openclc::FormatTimeReport()
+{
+    std::lock_guard<std::mutex> lock(RegionsMutex);
+    std::chrono::duration<double, std::milli> total = std::chrono::steady_clock::now() - ReportStart;
+
+    struct Totals {
+        std::size_t count = 0;
+        double wall = 0;
+        double cpu = 0;
+        std::size_t peakMemory = 0;
+    };
+    // In the order they were first recorded
+    llvm::MapVector<std::string, Totals, std::map<std::string, unsigned>> phases;
+    llvm::MapVector<std::string, Totals, std::map<std::string, unsigned>> kernels;
+    for (const Region& region : Regions) {
+        for (Totals* totals : { &phases[region.phase], region.kernel.empty() ? nullptr : &kernels[region.file + ":" + region.kernel] }) {
+            if (!totals)
+                continue;
+            totals->count++;
+            totals->wall += region.wall;
+            totals->cpu += region.cpu;
+            totals->peakMemory = std::max(totals->peakMemory, region.peakMemory);
+        }
+    }
+
+    std::string report = fmt::format("===--- openclc time report ---===\n"
+                                     "Total: {:.3f} ms wall, {:.3f} ms CPU, {:.1f} MiB peak RSS\n\n",
+        total.count(), ProcessCpuTime(), MiB(PeakMemoryUsage()));
+
+    // Nested regions count in their own phase and the enclosing one, and regions on parallel threads add up past the total
+    report += fmt::format("{:<28} {:>7} {:>12} {:>12} {:>14}\n", "Phase", "Count", "Wall ms", "CPU ms", "Peak RSS MiB");
+    for (const auto& [phase, totals] : phases)
+        report += fmt::format("{:<28} {:>7} {:>12.3f} {:>12.3f} {:>14.1f}\n", phase, totals.count, totals.wall, totals.cpu, MiB(totals.peakMemory));
+
+    if (!kernels.empty()) {
+        std::vector<std::pair<std::string, Totals>> slowest(kernels.begin(), kernels.end());
+        std::stable_sort(slowest.begin(), slowest.end(), [](const auto& a, const auto& b) { return a.second.wall > b.second.wall; });
+        report += fmt::format("\n{:<44} {:>12} {:>12} {:>14}\n", "Kernel", "Wall ms", "CPU ms", "Peak RSS MiB");
+        for (const auto& [kernel, totals] : slowest)
+            report += fmt::format("{:<44} {:>12.3f} {:>12.3f} {:>14.1f}\n", kernel, totals.wall, totals.cpu, MiB(totals.peakMemory));
+    }
+    return report;
+}
+
+void openclc::StartTimeTrace(unsigned granularity)
+{
+    TraceGranularity = granularity;
+    Tracing = true;
+    llvm::timeTraceProfilerInitialize(granularity, "openclc");
+}
+
+bool openclc::FinishTimeTrace(const std::string& path, std::string& error)
+{
+    Tracing = false;
+    llvm::Error written = llvm::timeTraceProfilerWrite(path, path);
+    llvm::timeTraceProfilerCleanup();
+    if (written) {
+        error = llvm::toString(std::move(written));
+        return false;
+    }
+    return true;
+}
+
+TimeTraceThread::TimeTraceThread()
+    : Active(Tracing && !llvm::getTimeTraceProfilerInstance())
+{
+    if (Active)
+        llvm::timeTraceProfilerInitialize(TraceGranularity, "openclc");
+}
+
+TimeTraceThread::~TimeTraceThread()
+{
+    // Hands the events over to be written with the main thread's, pool threads outlive the trace
+    if (Active)
+        llvm::timeTraceProfilerFinishThread();
+}
+
+TimeRegion::TimeRegion(llvm::StringRef phase, llvm::StringRef file, llvm::StringRef kernel)
+    : Trace(phase, kernel.empty() ? file.str() : (file + ":" + kernel).str())
+    , Recording(Reporting)
+{
+    if (!Recording)
+        return;
+    Phase = phase.str();
+    File = file.str();
+    Kernel = kernel.str();
+    WallStart = std::chrono::steady_clock::now();
+    CpuStart = ThreadCpuTime();
+}
+
+TimeRegion::~TimeRegion()
+{
+    if (!Recording)
+        return;
+    std::chrono::duration<double, std::milli> wall = std::chrono::steady_clock::now() - WallStart;
+    Region region { std::move(Phase), std::move(File), std::move(Kernel), wall.count(), ThreadCpuTime() - CpuStart, PeakMemoryUsage() };
+    std::lock_guard<std::mutex> lock(RegionsMutex);
+    Regions.push_back(std::move(region));
+}
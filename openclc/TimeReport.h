@@ -0,0 +1,69 @@
+//===--- TimeReport.h - Phase Timing and Time Traces ------------*- C++ -*-===//
+//
+// `TimeRegion` times a phase of the compile, e.g. scanning a file for
+// launches or lowering a kernel to SPIR-V. With `--time-report` each region
+// is recorded with its wall time, the CPU time of its thread and the peak
+// RSS of the process when it ended, and `FormatTimeReport` sums them per
+// phase and per kernel. With `--time-trace` each region is also an event of
+// LLVM's time trace profiler, next to clang's parser and codegen events.
+//
+// The time trace profiler keeps one instance per thread. Pool tasks open a
+// `TimeTraceThread` so their events are collected while the trace runs.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef OPENCLC_TIME_REPORT_H
+#define OPENCLC_TIME_REPORT_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/TimeProfiler.h"
+#include <chrono>
+#include <cstddef>
+#include <string>
+
+namespace openclc {
+
+/// Peak resident memory of this process in bytes, 0 if unknown
+std::size_t PeakMemoryUsage();
+
+/// Starts recording regions for `FormatTimeReport`, and the total time of the report
+void StartTimeReport();
+
+/// Phase totals and per kernel times of the regions recorded since `StartTimeReport`
+std::string FormatTimeReport();
+
+/// Starts LLVM's time trace profiler on this thread and every `TimeTraceThread`, for events of at least `granularity` µs
+void StartTimeTrace(unsigned granularity);
+
+/// Writes the events since `StartTimeTrace` to `path` as Chrome trace JSON and stops the profiler
+///
+/// Returns false with the reason in `error`.
+bool FinishTimeTrace(const std::string& path, std::string& error);
+
+/// Collects the time trace events of a pool task, if the trace runs
+class TimeTraceThread {
+    bool Active;
+
+public:
+    TimeTraceThread();
+    ~TimeTraceThread();
+};
+
+/// Times the enclosing scope as `phase` of `file`, or of `kernel` in `file`
+class TimeRegion {
+    llvm::TimeTraceScope Trace;
+    bool Recording;
+    std::string Phase;
+    std::string File;
+    std::string Kernel;
+    std::chrono::steady_clock::time_point WallStart;
+    double CpuStart;
+
+public:
+    TimeRegion(llvm::StringRef phase, llvm::StringRef file = {}, llvm::StringRef kernel = {});
+    ~TimeRegion();
+};
+
+} // end namespace openclc
+
+#endif
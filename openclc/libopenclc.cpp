@@ -0,0 +1,292 @@
+//===--- libopenclc.cpp - Runtime Compilation of OpenCL C -----------------===//
+//
+// Each call parses the source with a clang instance and LLVM context of its
+// own and runs the shared device pipeline over it. Neither holds state
+// another thread can see, so only the cache of finished SPIR-V is locked.
+//
+// Unlike the driver, every kernel and function of the source is compiled,
+// since there are no launch sites to tell which are used.
+//
+//===----------------------------------------------------------------------===//
+
+#include "libopenclc.h"
+#include "DevicePipeline.h"
+#include "SpvCache.h"
+#include "spirv-tools/libspirv.hpp"
+#include "spirv-tools/optimizer.hpp"
+#include "clang/CodeGen/CodeGenAction.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Lex/PreprocessorOptions.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdlib>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <optional>
+
+namespace {
+
+/// `oclcCompileSource` options, parsed
+struct CompileOptions {
+    openclc::DeviceOptions device;
+    SPIRV::VersionNumber spvVersion = SPIRV::VersionNumber::SPIRV_1_0;
+    std::vector<std::string> spvOptFlags = { "-O" };
+    bool werror = false;
+    /// The flags in the order given, part of the cache key
+    std::string key;
+};
+
+bool ParseOptions(llvm::StringRef options, CompileOptions& parsed, std::string& error)
+{
+    llvm::SmallVector<llvm::StringRef> flags;
+    llvm::SplitString(options, flags);
+    for (llvm::StringRef flag : flags) {
+        parsed.key += flag.str() + "\n";
+
+        llvm::StringRef name = flag;
+        if (!name.consume_front("--") && !name.consume_front("-")) {
+            error = "Expected a flag, got `" + flag.str() + "`";
+            return false;
+        }
+
+        if (name.consume_front("cl-std=")) {
+            std::optional<clang::LangStandard::Kind> standard = llvm::StringSwitch<std::optional<clang::LangStandard::Kind>>(name)
+                                                                    .Case("CL1.0", clang::LangStandard::lang_opencl10)
+                                                                    .Case("CL1.1", clang::LangStandard::lang_opencl11)
+                                                                    .Case("CL1.2", clang::LangStandard::lang_opencl12)
+                                                                    .Case("CL2.0", clang::LangStandard::lang_opencl20)
+                                                                    .Case("CL3.0", clang::LangStandard::lang_opencl30)
+                                                                    .Case("CLC++1.0", clang::LangStandard::lang_openclcpp10)
+                                                                    .Case("CLC++2021", clang::LangStandard::lang_openclcpp2021)
+                                                                    .Default(std::nullopt);
+            if (!standard) {
+                error = "Unknown OpenCL standard in `" + flag.str() + "`";
+                return false;
+            }
+            parsed.device.standard = *standard;
+            parsed.device.language = name.starts_with("CLC++") ? clang::Language::OpenCLCXX : clang::Language::OpenCL;
+        } else if (name.consume_front("spv-version=")) {
+            std::optional<SPIRV::VersionNumber> version = llvm::StringSwitch<std::optional<SPIRV::VersionNumber>>(name)
+                                                              .Case("1.0", SPIRV::VersionNumber::SPIRV_1_0)
+                                                              .Case("1.1", SPIRV::VersionNumber::SPIRV_1_1)
+                                                              .Case("1.2", SPIRV::VersionNumber::SPIRV_1_2)
+                                                              .Case("1.3", SPIRV::VersionNumber::SPIRV_1_3)
+                                                              .Case("1.4", SPIRV::VersionNumber::SPIRV_1_4)
+                                                              .Case("1.5", SPIRV::VersionNumber::SPIRV_1_5)
+                                                              .Default(std::nullopt);
+            if (!version) {
+                error = "Unknown SPIR-V version in `" + flag.str() + "`, expected 1.0 to 1.5";
+                return false;
+            }
+            parsed.spvVersion = *version;
+        } else if (name.consume_front("spv-opt=")) {
+            // Unknown pass names are only found by registering them
+            spvtools::Optimizer optimizer(SPV_ENV_UNIVERSAL_1_0);
+            if (!openclc::SpvOptPassFlags(name, parsed.spvOptFlags) || !optimizer.RegisterPassesFromFlags(parsed.spvOptFlags, /*preserve_interface=*/true)) {
+                error = "Unknown spirv-opt profile or pass in `" + flag.str() + "`";
+                return false;
+            }
+        } else if (name == "Werror") {
+            parsed.werror = true;
+        } else if (name.consume_front("D") && !name.empty()) {
+            parsed.device.defines.push_back(name.str());
+        } else if (name.consume_front("I") && !name.empty()) {
+            parsed.device.includes.push_back(name.str());
+        } else if (name.consume_front("O") && name.size() == 1 && name[0] >= '0' && name[0] <= '3') {
+            parsed.device.optLevel = name[0] - '0';
+        } else {
+            error = "Unknown flag `" + flag.str() + "`";
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Prints messages of spirv-opt and the validator to `log`
+spvtools::MessageConsumer LogMessageConsumer(std::string& log)
+{
+    return [&log](spv_message_level_t level, const char*, const spv_position_t&, const char* message) {
+        bool error = level == SPV_MSG_FATAL || level == SPV_MSG_INTERNAL_ERROR || level == SPV_MSG_ERROR;
+        log += std::string(error ? "error: " : "warning: ") + message + "\n";
+    };
+}
+
+/// Compiles `source` to SPIR-V, appending diagnostics to `log`
+bool CompileToSpv(llvm::StringRef source, const CompileOptions& options, std::vector<uint32_t>& spv, std::string& log)
+{
+    clang::CompilerInstance clangInstance;
+
+    clangInstance.getDiagnosticOpts().Warnings.push_back("no-unsafe-buffer-usage");
+    llvm::raw_string_ostream diagnosticsStream(log);
+    clangInstance.createDiagnostics(new clang::TextDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts()), true);
+    clangInstance.getDiagnostics().setWarningsAsErrors(options.werror);
+
+    llvm::StringRef fileName = options.device.language == clang::Language::OpenCLCXX ? "source.clcpp" : "source.cl";
+    clangInstance.getFrontendOpts().Inputs.push_back(clang::FrontendInputFile(llvm::MemoryBufferRef(source, fileName), clang::InputKind(options.device.language)));
+
+    openclc::ConfigureDeviceCompilerInstance(clangInstance, options.device);
+
+    clangInstance.getHeaderSearchOpts().UseStandardSystemIncludes = false;
+    clangInstance.getHeaderSearchOpts().UseStandardCXXIncludes = false;
+    clangInstance.getPreprocessorOpts().Includes.push_back("opencl-c.h");
+    clangInstance.getPreprocessorOpts().Includes.push_back("openclc-device.h");
+
+    llvm::LLVMContext ctx;
+    clang::EmitLLVMOnlyAction action(&ctx);
+    bool parsed = clangInstance.ExecuteAction(action);
+    clangInstance.getDiagnostics().getClient()->finish();
+    std::unique_ptr<llvm::Module> mod = action.takeModule();
+    if (!parsed || !mod)
+        return false;
+
+    // `__launch_bounds__` only means something to the stubs the driver generates
+    if (llvm::GlobalVariable* annotations = mod->getGlobalVariable("llvm.global.annotations"))
+        annotations->eraseFromParent();
+
+    if (options.device.optLevel > 0)
+        openclc::OptimizeModule(*mod, options.device.optLevel);
+
+    std::string translatorError;
+    if (!openclc::WriteSpv(*mod, options.spvVersion, spv, translatorError)) {
+        log += "error: " + translatorError + "\n";
+        return false;
+    }
+
+    spv_target_env env = openclc::SpvTargetEnv(options.spvVersion);
+    if (!options.spvOptFlags.empty()) {
+        // Validated once below, after all passes
+        spvtools::OptimizerOptions optimizerOptions;
+        optimizerOptions.set_run_validator(false);
+
+        spvtools::Optimizer optimizer(env);
+        optimizer.SetMessageConsumer(LogMessageConsumer(log));
+        optimizer.RegisterPassesFromFlags(options.spvOptFlags, /*preserve_interface=*/true);
+        if (!optimizer.Run(spv.data(), spv.size(), &spv, optimizerOptions))
+            return false;
+    }
+
+    spvtools::SpirvTools tools(env);
+    tools.SetMessageConsumer(LogMessageConsumer(log));
+    return tools.Validate(spv);
+}
+
+/// SPIR-V of earlier compiles, by source and options
+///
+/// Two threads compiling the same source at once both compile it, the second result replaces the first.
+class CompileCache {
+    struct Entry {
+        std::string key;
+        std::vector<uint32_t> spv;
+        std::string log;
+    };
+
+    std::mutex Mutex;
+    /// Most recently used first
+    std::list<Entry> Entries;
+    llvm::StringMap<std::list<Entry>::iterator> Index;
+    std::size_t Size = 0;
+    std::size_t Capacity = 64 << 20;
+
+    void erase(std::list<Entry>::iterator entry)
+    {
+        Size -= entry->spv.size() * sizeof(uint32_t);
+        Index.erase(entry->key);
+        Entries.erase(entry);
+    }
+
+    void evict()
+    {
+        while (Size > Capacity)
+            erase(std::prev(Entries.end()));
+    }
+
+public:
+    bool lookup(llvm::StringRef key, std::vector<uint32_t>& spv, std::string& log)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        auto it = Index.find(key);
+        if (it == Index.end())
+            return false;
+        Entries.splice(Entries.begin(), Entries, it->second);
+        spv = it->second->spv;
+        log = it->second->log;
+        return true;
+    }
+
+    void insert(const std::string& key, const std::vector<uint32_t>& spv, const std::string& log)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (spv.size() * sizeof(uint32_t) > Capacity)
+            return;
+        if (auto it = Index.find(key); it != Index.end())
+            erase(it->second);
+        Entries.push_front(Entry { key, spv, log });
+        Index[key] = Entries.begin();
+        Size += spv.size() * sizeof(uint32_t);
+        evict();
+    }
+
+    void setCapacity(std::size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Capacity = bytes;
+        evict();
+    }
+};
+
+CompileCache& Cache()
+{
+    static CompileCache cache;
+    return cache;
+}
+
+/// Diagnostics of this thread's last compile, see `oclcCompileLog`
+thread_local std::string CompileLog;
+
+} // end anonymous namespace
+
+int oclcCompileSource(const char* source, const char* options, unsigned char** spv, size_t* spv_size)
+{
+    CompileLog.clear();
+
+    CompileOptions parsed;
+    if (!ParseOptions(options ? options : "", parsed, CompileLog)) {
+        CompileLog += "\n";
+        return oclcCompileInvalidOptions;
+    }
+
+    std::string key = openclc::SpvCache::hash({ source, parsed.key });
+    std::vector<uint32_t> words;
+    if (!Cache().lookup(key, words, CompileLog)) {
+        if (!CompileToSpv(source, parsed, words, CompileLog))
+            return oclcCompileError;
+        Cache().insert(key, words, CompileLog);
+    }
+
+    std::size_t bytes = words.size() * sizeof(uint32_t);
+    *spv = static_cast<unsigned char*>(std::malloc(bytes));
+    std::memcpy(*spv, words.data(), bytes);
+    *spv_size = bytes;
+    return oclcCompileSuccess;
+}
+
+const char* oclcCompileLog(void)
+{
+    return CompileLog.c_str();
+}
+
+void oclcFreeSpv(unsigned char* spv)
+{
+    std::free(spv);
+}
+
+void oclcSetCompileCacheSize(size_t bytes)
+{
+    Cache().setCapacity(bytes);
+}
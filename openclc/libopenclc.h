@@ -0,0 +1,69 @@
+/*===--- libopenclc.h - Runtime Compilation of OpenCL C ---------*- C -*-===*\
+|*                                                                          *|
+|* libopenclc compiles OpenCL C to SPIR-V inside the calling process, with  *|
+|* the same frontend, optimization pipeline and spirv-opt profiles as the   *|
+|* openclc driver. Applications that generate kernels at runtime pass the   *|
+|* result to `oclcBuildSpv` from `openclc_rt.h` and launch it, without      *|
+|* writing files or starting a compiler process.                            *|
+|*                                                                          *|
+\*===----------------------------------------------------------------------===*/
+
+#ifndef LIBOPENCLC_H
+#define LIBOPENCLC_H
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#ifdef LIBOPENCLC_BUILD
+#define OCLC_JIT_API __declspec(dllexport)
+#else
+#define OCLC_JIT_API __declspec(dllimport)
+#endif
+#else
+#define OCLC_JIT_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    oclcCompileSuccess = 0,
+    /// `options` holds a flag that isn't listed at `oclcCompileSource`, or a malformed one
+    oclcCompileInvalidOptions,
+    /// The source has errors, or the SPIR-V it lowered to failed validation
+    oclcCompileError,
+} OclcCompileStatus;
+
+/// Compiles the OpenCL C kernels in the null terminated `source` to SPIR-V
+///
+/// `options` may be NULL, or a space separated list of
+///   -cl-std=CL1.0|CL1.1|CL1.2|CL2.0|CL3.0|CLC++1.0|CLC++2021 (default CL1.2)
+///   -D<name>[=<value>], -I<dir>, -O0 to -O3 (default -O2), -Werror
+///   -spv-version=1.0 to 1.5 (default 1.0), -spv-opt=perf|size|none|custom:<pass>,<pass>,... (default perf)
+///
+/// On success `*spv` points to `*spv_size` bytes of validated SPIR-V, which the caller releases with `oclcFreeSpv`.
+/// Every call compiles in its own context, so any number of threads may compile at once. Sources compiled before with the
+/// same options are returned from an in-process cache, headers found through `-I` are not part of its key.
+///
+/// Returns an `OclcCompileStatus`, the diagnostics are kept for `oclcCompileLog`.
+OCLC_JIT_API int oclcCompileSource(const char* source, const char* options, unsigned char** spv, size_t* spv_size);
+
+/// Diagnostics of the last `oclcCompileSource` on the calling thread, empty if it compiled without warnings
+///
+/// Valid until the thread calls `oclcCompileSource` again.
+OCLC_JIT_API const char* oclcCompileLog(void);
+
+/// Releases SPIR-V returned by `oclcCompileSource`
+OCLC_JIT_API void oclcFreeSpv(unsigned char* spv);
+
+/// Limits the SPIR-V the in-process cache holds to `bytes`, least recently used sources are evicted past it
+///
+/// Defaults to 64 MiB, 0 empties the cache and disables it.
+OCLC_JIT_API void oclcSetCompileCacheSize(size_t bytes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
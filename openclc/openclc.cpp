@@ -1,38 +1,97 @@
+#include "Daemon.h"
 #include "DeviceFrontendDiagnosticPrinter.h"
+#include "DeviceLibrary.h"
+#include "DevicePipeline.h"
+#include "KernelArtifacts.h"
 #include "LLVMSPIRVLib/LLVMSPIRVLib.h"
+#include "SpvCache.h"
+#include "TimeReport.h"
 #include "fmt/color.h"
 #include "fmt/core.h"
 #include "fmt/ranges.h"
+#include "spirv-tools/libspirv.hpp"
+#include "spirv-tools/linker.hpp"
 #include "spirv-tools/optimizer.hpp"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/GlobalDecl.h"
 #include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/CodeGen/CodeGenAction.h"
+#include "clang/CodeGen/ModuleBuilder.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Frontend/FrontendActions.h"
 #include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Frontend/Utils.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/PPCallbacks.h"
 #include "clang/Lex/PreprocessorOptions.h"
+#include "clang/Sema/Sema.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallSet.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Analysis/InlineCost.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/DebugInfo.h"
 #include "llvm/Linker/Linker.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Passes/PassBuilder.h"
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Error.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Transforms/IPO/GlobalDCE.h"
+#include "llvm/Transforms/IPO/Inliner.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/MergeFunctions.h"
+#include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/Scalar/ADCE.h"
+#include "llvm/Transforms/Scalar/EarlyCSE.h"
+#include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/IndVarSimplify.h"
+#include "llvm/Transforms/Scalar/LICM.h"
+#include "llvm/Transforms/Scalar/LoopDeletion.h"
+#include "llvm/Transforms/Scalar/LoopPassManager.h"
+#include "llvm/Transforms/Scalar/LoopRotation.h"
+#include "llvm/Transforms/Scalar/LoopUnrollPass.h"
+#include "llvm/Transforms/Scalar/SROA.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include <LLVMSPIRVLib/LLVMSPIRVLib.h>
 #include <LLVMSPIRVLib/LLVMSPIRVOpts.h>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <clang/Basic/DiagnosticIDs.h>
 #include <clang/Basic/DiagnosticOptions.h>
 #include <clang/Basic/LangStandard.h>
 #include <clang/Frontend/CompilerInvocation.h>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/Support/MemoryBuffer.h>
 #include <memory>
-#include <regex>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <spirv-tools/libspirv.h>
-#include <sstream>
 
 // OS specific includes
 #if defined(_WIN32)
@@ -45,30 +104,90 @@
 #include <unistd.h>
 #endif
 
-#define OPENCLC_VERSION "0.0.4"
+/// Part of every cache key and of the stamps of generated sources, bump it whenever the generated code changes
+#define OPENCLC_VERSION "0.1.0"
 
 namespace cli = llvm::cl;
 
-extern const char* opencl_c_h_data;
-extern size_t opencl_c_h_size;
-
 static fmt::text_style err = fg(fmt::color::crimson) | fmt::emphasis::bold;
 static fmt::text_style good = fg(fmt::color::green);
 static llvm::ExitOnError LLVMExitOnErr;
 
+/// Output of the `-j` task running on this thread, printed by the main thread once all tasks are done so files don't interleave
+static thread_local std::string* TaskOutput = nullptr;
+
+/// `fmt::print`, into the output of the task running on this thread if there is one
+template <typename... T>
+void Print(fmt::format_string<T...> format, T&&... args)
+{
+    if (TaskOutput)
+        fmt::format_to(std::back_inserter(*TaskOutput), format, std::forward<T>(args)...);
+    else
+        fmt::print(format, std::forward<T>(args)...);
+}
+
+/// `Print` in the style of errors
+template <typename... T>
+void PrintError(fmt::format_string<T...> format, T&&... args)
+{
+    if (TaskOutput)
+        TaskOutput->append(fmt::format(err, format, std::forward<T>(args)...));
+    else
+        fmt::print(err, format, std::forward<T>(args)...);
+}
+
 /// Command Line Options
 /// https://llvm.org/docs/CommandLine.html
 static cli::OptionCategory OpenCLCOptions("OpenCLC Options");
-static cli::list<std::string> InputFilenames(cli::Positional, cli::desc("<Input files>"), cli::OneOrMore, cli::cat(OpenCLCOptions));
+static cli::list<std::string> InputFilenames(cli::Positional, cli::desc("<Input files>"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
 static cli::opt<std::string> OutputFileName("o", cli::desc("Output Filename"), cli::init("a.out"), cli::cat(OpenCLCOptions));
 static cli::opt<bool> Verbose("v", cli::desc("Verbose"), cli::cat(OpenCLCOptions));
 static cli::opt<bool> Werror("Werror", cli::desc("Warnings are errors"), cli::cat(OpenCLCOptions));
 static cli::opt<bool> Wall("Wall", cli::desc("Enable all Clang warnings"), cli::cat(OpenCLCOptions));
 static cli::opt<std::string> CCBin("ccbin", cli::desc("Set Host C Compiler"), cli::init("zig cc"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> CXXBin("cxxbin", cli::desc("Set the host C++ compiler, which compiles the host code of .clpp inputs and links C++ objects"), cli::init("zig c++"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> ARBin("ar", cli::desc("Set the archiver the runtime library is built with"), cli::init("zig ar"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> CompileOnly("c", cli::desc("Compile each input to an object file instead of linking an executable, every kernel is kept for launches from other objects"), cli::cat(OpenCLCOptions));
 static cli::list<std::string> Warnings(cli::Prefix, "W", cli::desc("Enable or disable a warning in Clang"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
 static cli::list<std::string> Includes(cli::Prefix, "I", cli::desc("Add a directory to be searched for header files"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
 static cli::list<std::string> Defines(cli::Prefix, "D", cli::desc("Define a #define directive"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
 static cli::opt<bool> Debug("g", cli::desc("Skip optimization passes and leave debug information"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> SpvOpt("spv-opt", cli::desc("spirv-opt passes run on the SPIR-V: perf, size, none or custom:<pass>,<pass>,... (default: perf, or none with -g)"), cli::value_desc("profile"), cli::init("perf"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> SpvValidateEachPass("spv-validate-each-pass", cli::desc("Validate the SPIR-V after every spirv-opt pass instead of once at the end"), cli::cat(OpenCLCOptions));
+enum OptLevelKind {
+    OPT_LEVEL_0,
+    OPT_LEVEL_1,
+    OPT_LEVEL_2,
+    OPT_LEVEL_3,
+};
+static cli::opt<OptLevelKind> OptLevel(
+    "O",
+    cli::desc("LLVM optimization level of device code (default: -O2, or -O0 with -g)"),
+    cli::values(
+        clEnumValN(OPT_LEVEL_0, "0", "No LLVM passes"),
+        clEnumValN(OPT_LEVEL_1, "1", "Inline and simplify, unroll only loops marked with opencl_unroll_hint"),
+        clEnumValN(OPT_LEVEL_2, "2", "Also GVN and unrolling by the usual heuristics"),
+        clEnumValN(OPT_LEVEL_3, "3", "Inline and unroll more aggressively")),
+    cli::Prefix,
+    cli::init(OPT_LEVEL_2),
+    cli::cat(OpenCLCOptions));
+static cli::opt<std::string> CacheDir("cache-dir", cli::desc("Reuse optimized SPIR-V per kernel from this directory (default: $OPENCLC_CACHE_DIR, disabled if unset)"), cli::value_desc("dir"), cli::init(std::getenv("OPENCLC_CACHE_DIR") ? std::getenv("OPENCLC_CACHE_DIR") : ""), cli::cat(OpenCLCOptions));
+static cli::opt<unsigned> CacheMaxSize("cache-max-size", cli::desc("Size limit of the SPIR-V cache in MiB, least recently used kernels and PCHs are evicted past it"), cli::value_desc("MiB"), cli::init(1024), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> DevicePrelude("device-prelude", cli::desc("Header included before all device code, precompiled together with opencl-c.h"), cli::value_desc("header"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> NoPCH("no-pch", cli::desc("Parse opencl-c.h and the device prelude for every file instead of using a precompiled header"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> DepFile("MD", cli::desc("Write a Makefile style depfile of the inputs and the headers they include (default: <output>.d, or foo.d for -c -o foo.o)"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> DepFileName("MF", cli::desc("Write the depfile to <file>, implies -MD"), cli::value_desc("file"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> DeviceLink("device-link", cli::desc("Link the device code of all inputs into one SPIR-V module, whose program every kernel shares"), cli::cat(OpenCLCOptions));
+static cli::list<std::string> Libraries("l", cli::Prefix, cli::desc("Link the launched kernels of the device library lib<name>.oclclib, .oclclib inputs are linked the same way"), cli::value_desc("name"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
+static cli::list<std::string> LibraryDirs("L", cli::Prefix, cli::desc("Add a directory to be searched for -l device libraries"), cli::value_desc("dir"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
+static cli::opt<bool> BuildLibrary("device-library", cli::desc("Compile the kernels of the inputs into a .oclclib device library written to -o, instead of an executable"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> Daemon("daemon", cli::desc("Serve the compiles of other openclc invocations on a Unix socket until killed, so they skip the startup cost"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> DaemonSocket("daemon-socket", cli::desc("Socket of the compile server (default: $OPENCLC_DAEMON_SOCKET, or one per user and version in $XDG_RUNTIME_DIR or the temporary directory)"), cli::value_desc("path"), cli::init(std::getenv("OPENCLC_DAEMON_SOCKET") ? std::getenv("OPENCLC_DAEMON_SOCKET") : ""), cli::cat(OpenCLCOptions));
+static cli::opt<bool> NoDaemon("no-daemon", cli::desc("Compile in this process even if a compile server is running"), cli::cat(OpenCLCOptions));
+static cli::opt<bool> TimeReport("time-report", cli::desc("Print the wall and CPU time and peak memory of every compile phase, and per kernel"), cli::cat(OpenCLCOptions));
+static cli::opt<std::string> TimeTrace("time-trace", cli::desc("Write a Chrome trace of the compile phases and clang's frontend to <file>"), cli::value_desc("file"), cli::cat(OpenCLCOptions));
+static cli::opt<unsigned> TimeTraceGranularity("time-trace-granularity", cli::desc("Leave events shorter than this out of --time-trace, in microseconds"), cli::value_desc("us"), cli::init(500), cli::cat(OpenCLCOptions));
+static cli::opt<unsigned> Jobs("j", cli::Prefix, cli::desc("Compile up to N input files in parallel (0 uses every hardware thread)"), cli::value_desc("N"), cli::init(1), cli::cat(OpenCLCOptions));
 enum CLStd {
     CL_STD_100,
     CL_STD_110,
@@ -99,29 +218,95 @@ static cli::opt<SPIRV::VersionNumber> SpvVersion(
         clEnumValN(SPIRV::VersionNumber::SPIRV_1_5, "1.5", "SPIR-V 1.5")),
     cli::init(SPIRV::VersionNumber::SPIRV_1_0),
     cli::cat(OpenCLCOptions));
+static cli::list<std::string> SpvVariantFlags("spv-variant", cli::desc("Embed a SPIR-V module of <version>[:<spv-opt profile>], repeat for more. The runtime builds the highest version the device accepts (default: --spv-version and --spv-opt)"), cli::value_desc("variant"), cli::ZeroOrMore, cli::cat(OpenCLCOptions));
+enum EmitKind {
+    EMIT_LLVM_IR,
+    EMIT_LLVM_BC,
+    EMIT_SPIRV,
+    EMIT_SPIRV_ASM,
+    EMIT_OPT_REMARKS,
+};
+static cli::list<EmitKind> Emit(
+    "emit",
+    cli::desc("Write these stages of every kernel next to the generated sources in ./openclc-tmp, and print a summary of each kernel's SPIR-V"),
+    cli::values(
+        clEnumValN(EMIT_LLVM_IR, "llvm-ir", "Optimized LLVM IR handed to llvm-spirv, <source>.<kernel>.ll"),
+        clEnumValN(EMIT_LLVM_BC, "llvm-bc", "The same as LLVM bitcode, <source>.<kernel>.bc"),
+        clEnumValN(EMIT_SPIRV, "spirv", "SPIR-V after spirv-opt, <source>.<kernel>.spv"),
+        clEnumValN(EMIT_SPIRV_ASM, "spirv-asm", "The same disassembled, <source>.<kernel>.spvasm"),
+        clEnumValN(EMIT_OPT_REMARKS, "opt-remarks", "Remarks of the LLVM passes on what they inlined, unrolled or missed, <source>.opt.yaml")),
+    cli::CommaSeparated,
+    cli::cat(OpenCLCOptions));
+static cli::opt<std::string> OptRemarksFilter("opt-remarks-filter", cli::desc("Only write the --emit=opt-remarks of LLVM passes matching <regex>, e.g. inline|loop-unroll"), cli::value_desc("regex"), cli::cat(OpenCLCOptions));
 
-/// https://stackoverflow.com/questions/786555/c-stream-to-memory
-///
-/// https://gist.github.com/stephanlachnit/4a06f8475afd144e73235e2a2584b000
-///
-/// Stream Buffer backed by a std::vector<char>
-///
-/// For interfaces heavily bound to std::ostream << patterns
-struct membuf : std::streambuf {
-public:
-    membuf() { }
-    std::streamsize xsputn(const char* s, std::streamsize count) override
-    {
-        for (int i = 0; i < count; i++)
-            vec.push_back(s[i]);
-
-        pbump(count);
+/// One SPIR-V module embedded in every generated host source
+struct SpvVariant {
+    SPIRV::VersionNumber version;
+    /// `--spv-opt` profile and the spirv-opt flags it stands for
+    std::string spvOpt;
+    std::vector<std::string> spvOptFlags;
 
-        return count;
+    /// e.g. `1.4`
+    std::string versionString() const
+    {
+        uint32_t v = static_cast<uint32_t>(version);
+        return fmt::format("{}.{}", (v >> 16) & 0xff, (v >> 8) & 0xff);
     }
-    std::vector<char> vec;
 };
 
+/// The SPIR-V variants to embed, from `--spv-variant` or else `--spv-version` and `--spv-opt`
+///
+/// `-g` alone implies the `none` profile. Exits on malformed variants, so it is first called before any file is compiled.
+const std::vector<SpvVariant>& SpvVariants()
+{
+    static const std::vector<SpvVariant> variants = [] {
+        llvm::StringRef defaultSpvOpt = SpvOpt;
+        if (Debug && SpvOpt.getNumOccurrences() == 0)
+            defaultSpvOpt = "none";
+
+        std::vector<SpvVariant> variants;
+        if (SpvVariantFlags.empty())
+            variants.push_back({ SpvVersion, defaultSpvOpt.str() });
+        for (llvm::StringRef flag : SpvVariantFlags) {
+            auto [version, profile] = flag.split(':');
+            std::optional<SPIRV::VersionNumber> number = llvm::StringSwitch<std::optional<SPIRV::VersionNumber>>(version)
+                                                             .Case("1.0", SPIRV::VersionNumber::SPIRV_1_0)
+                                                             .Case("1.1", SPIRV::VersionNumber::SPIRV_1_1)
+                                                             .Case("1.2", SPIRV::VersionNumber::SPIRV_1_2)
+                                                             .Case("1.3", SPIRV::VersionNumber::SPIRV_1_3)
+                                                             .Case("1.4", SPIRV::VersionNumber::SPIRV_1_4)
+                                                             .Case("1.5", SPIRV::VersionNumber::SPIRV_1_5)
+                                                             .Default(std::nullopt);
+            if (!number) {
+                PrintError("Unknown SPIR-V version `{}` in `--spv-variant={}`, expected 1.0 to 1.5\n", version.str(), flag.str());
+                std::exit(1);
+            }
+            if (llvm::any_of(variants, [&](const SpvVariant& other) { return other.version == *number; })) {
+                PrintError("SPIR-V {} is given by more than one `--spv-variant`\n", version.str());
+                std::exit(1);
+            }
+            variants.push_back({ *number, flag.contains(':') ? profile.str() : defaultSpvOpt.str() });
+        }
+
+        for (SpvVariant& variant : variants) {
+            if (!openclc::SpvOptPassFlags(variant.spvOpt, variant.spvOptFlags)) {
+                PrintError("Unknown `--spv-opt` profile `{}`, expected perf, size, none or custom:<passes>\n", variant.spvOpt);
+                std::exit(1);
+            }
+        }
+        return variants;
+    }();
+    return variants;
+}
+
+/// `-O` as a number, `-g` alone implies `-O0`
+unsigned DeviceOptLevel()
+{
+    if (Debug && OptLevel.getNumOccurrences() == 0)
+        return 0;
+    return static_cast<unsigned>(OptLevel.getValue());
+}
+
 /// Function that acts as a stdout logger for the spvtools::Optimizer
 void optimizerMessageConsumer(spv_message_level_t level, const char* source, const spv_position_t& position, const char* message)
 {
@@ -129,165 +314,276 @@ void optimizerMessageConsumer(spv_message_level_t level, const char* source, con
     switch (level) {
     case SPV_MSG_FATAL:
         strLevel = "SPV_MSG_FATAL";
+        break;
     case SPV_MSG_ERROR:
         strLevel = "SPV_MSG_ERROR";
+        break;
     case SPV_MSG_INTERNAL_ERROR:
-        strLevel = "SPV_MSG_INTERL_ERROR";
+        strLevel = "SPV_MSG_INTERNAL_ERROR";
+        break;
     case SPV_MSG_WARNING:
         strLevel = "SPV_MSG_WARNING";
+        break;
     case SPV_MSG_DEBUG:
         strLevel = "SPV_MSG_DEBUG";
+        break;
     case SPV_MSG_INFO:
         strLevel = "SPV_MSG_INFO";
+        break;
     }
 
-    fmt::print(err, "OPTIMIZER_{}: `{}`\n", strLevel, message);
+    PrintError("OPTIMIZER_{}: `{}`\n", strLevel, message);
 }
 
-/// Utility needed in SourceToModule, to set contents of `opencl-c.h`
-struct OpenCLBuiltinMemoryBuffer final : public llvm::MemoryBuffer {
-    OpenCLBuiltinMemoryBuffer(const void* data, uint64_t data_length)
-    {
-        const char* dataCasted = reinterpret_cast<const char*>(data);
-        init(dataCasted, dataCasted + data_length, true);
-    }
-
-    virtual llvm::MemoryBuffer::BufferKind getBufferKind() const override
-    {
-        return llvm::MemoryBuffer::MemoryBuffer_Malloc;
-    }
+/// Part of the cache keys that tells the SPIR-V of different variants apart
+std::string SpvVariantKey(const SpvVariant& variant)
+{
+    return fmt::format("SPIR-V {}: {}", variant.versionString(), fmt::join(variant.spvOptFlags, " "));
+}
 
-    virtual ~OpenCLBuiltinMemoryBuffer() override { }
-};
+/// Whether an input holds C++ for OpenCL device code and C++ host code, rather than OpenCL C and C
+bool IsCXXInput(llvm::StringRef fileName)
+{
+    return fileName.ends_with(".clpp");
+}
 
-/// Kills process with helpful messages if there are compilation errors.
+/// Applies the target, language and preprocessor options of the device codegen frontend
 ///
-/// Credit: https://github.com/google/clspv/blob/2776a72da17dfffdd1680eeaff26a8bebdaa60f7/lib/Compiler.cpp#L1079
-std::unique_ptr<llvm::Module>
-SourceToModule(llvm::LLVMContext& ctx, std::string& fileContents, std::string& fileName)
+/// A PCH is only accepted by a `clang::CompilerInstance` configured exactly like the one that built it,
+/// so both `BuildDevicePCH` and `DeviceFrontend` go through here. Diagnostics must already be created.
+void ConfigureDeviceCompilerInstance(clang::CompilerInstance& clangInstance, const std::string& fileName)
 {
-    clang::CompilerInstance clangInstance;
-
-    // TODO: decide language based on `.cl` or `.clpp` exentsion
-    llvm::MemoryBufferRef membufref = llvm::MemoryBufferRef(llvm::StringRef(fileContents), llvm::StringRef(fileName));
-    clang::FrontendInputFile clSrcFile(membufref, clang::InputKind(clang::Language::OpenCL));
-
-    // warnings to disable
-    clangInstance.getDiagnosticOpts().Warnings.push_back("no-unsafe-buffer-usage");
-    for (std::string warning : Warnings) {
-        clangInstance.getDiagnosticOpts().Warnings.push_back(warning);
-    }
-
-    // clang compiler instance options
-    // diagnostics
-    std::string log;
-    llvm::raw_string_ostream diagnosticsStream(log);
-    clangInstance.createDiagnostics(
-        new clang::TextDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts()),
-        true);
-    clangInstance.getDiagnostics().setEnableAllWarnings(Wall);
-    clangInstance.getDiagnostics().setWarningsAsErrors(Werror);
-
-    // input
-    clangInstance.getFrontendOpts().Inputs.push_back(clSrcFile);
-
-    // target
-    clangInstance.getTargetOpts().Triple = "spirv64-unknown-unknown";
-    clangInstance.setTarget(clang::TargetInfo::CreateTargetInfo(clangInstance.getDiagnostics(), std::make_shared<clang::TargetOptions>(clangInstance.getTargetOpts())));
-
-    // instance options
-    clangInstance.createFileManager();
-    clangInstance.createSourceManager(clangInstance.getFileManager());
-
-    // language options, copied from CLSPV
-    // -std=CL2.0 by default.
-    clangInstance.getLangOpts().C99 = true;
-    clangInstance.getLangOpts().RTTI = false;
-    clangInstance.getLangOpts().RTTIData = false;
-    clangInstance.getLangOpts().MathErrno = false;
-    clangInstance.getLangOpts().Optimize = false;
-    clangInstance.getLangOpts().NoBuiltin = true;
-    clangInstance.getLangOpts().ModulesSearchAll = false;
-    clangInstance.getLangOpts().SinglePrecisionConstants = true;
-    clangInstance.getLangOpts().DeclareOpenCLBuiltins = true;
-    clangInstance.getLangOpts().NativeHalfType = true; // enabled by default
-    clangInstance.getLangOpts().NativeHalfArgsAndReturns = true; // enabled by default
-    clangInstance.getCodeGenOpts().StackRealignment = true;
-    clangInstance.getCodeGenOpts().SimplifyLibCalls = false;
-    clangInstance.getCodeGenOpts().EmitOpenCLArgMetadata = false;
-    clangInstance.getCodeGenOpts().DisableO0ImplyOptNone = true;
-    clangInstance.getCodeGenOpts().OptimizationLevel = 0;
-
-    clang::Language lang;
-    clang::LangStandard::Kind langStd;
-
-    if (fileName.ends_with(".cl") || fileName.ends_with(".ocl")) {
-        lang = clang::Language::OpenCL;
+    openclc::DeviceOptions options;
+    options.optLevel = DeviceOptLevel();
+    options.defines.assign(Defines.begin(), Defines.end());
+    options.includes.assign(Includes.begin(), Includes.end());
+
+    if (IsCXXInput(fileName)) {
+        // C++ for OpenCL 1.0 is OpenCL C 2.0 underneath, 2021 is OpenCL C 3.0
+        options.language = clang::Language::OpenCLCXX;
+        options.standard = CLStd == CL_STD_300 ? clang::LangStandard::lang_openclcpp2021 : clang::LangStandard::lang_openclcpp10;
+    } else if (fileName.ends_with(".cl") || fileName.ends_with(".ocl")) {
+        options.language = clang::Language::OpenCL;
         switch (CLStd) {
         case CL_STD_100:
-            langStd = clang::LangStandard::lang_opencl10;
+            options.standard = clang::LangStandard::lang_opencl10;
             break;
         case CL_STD_110:
-            langStd = clang::LangStandard::lang_opencl11;
+            options.standard = clang::LangStandard::lang_opencl11;
             break;
         case CL_STD_120:
-            langStd = clang::LangStandard::lang_opencl12;
+            options.standard = clang::LangStandard::lang_opencl12;
             break;
         case CL_STD_200:
-            langStd = clang::LangStandard::lang_opencl20;
+            options.standard = clang::LangStandard::lang_opencl20;
             break;
         case CL_STD_300:
-            langStd = clang::LangStandard::lang_opencl30;
+            options.standard = clang::LangStandard::lang_opencl30;
             break;
         }
     } else {
-        fmt::print(err, "Invalid file extension supplied. Use `.cl` or `.ocl` for OpenCL C. Note only C host code is allowed.\n");
+        PrintError("Invalid file extension supplied. Use `.cl` or `.ocl` for OpenCL C with C host code, or `.clpp` for C++ for OpenCL with C++ host code.\n");
         std::exit(1);
     }
 
-    std::vector<std::string> includes;
-    clang::LangOptions::setLangDefaults(
-        clangInstance.getLangOpts(),
-        lang,
-        llvm::Triple { "spirv64-unknown-unknown" },
-        includes,
-        langStd);
+    openclc::ConfigureDeviceCompilerInstance(clangInstance, options);
+}
 
-    clangInstance.getPreprocessorOpts().addMacroDef("__SPIRV__");
-    std::unique_ptr<llvm::MemoryBuffer> opencl_c_h_buffer(new OpenCLBuiltinMemoryBuffer(opencl_c_h_data, opencl_c_h_size));
-    clangInstance.getPreprocessorOpts().Includes.push_back("opencl-c.h");
-    clang::FileEntryRef opencl_c_h_ref = clangInstance.getFileManager().getVirtualFileRef("include/opencl-c.h", opencl_c_h_buffer->getBufferSize(), 0);
-    clangInstance.getSourceManager().overrideFileContents(opencl_c_h_ref, std::move(opencl_c_h_buffer));
+/// Records the headers read from disk by the device frontend
+///
+/// `-I` directories are searched as system directories, so system headers count too. Host headers that
+/// aren't found and the in memory `opencl-c.h` are skipped.
+class DeviceDependencyCollector : public clang::DependencyCollector {
+public:
+    bool needSystemDependencies() override { return true; }
 
-    for (auto define : Defines) {
-        clangInstance.getPreprocessorOpts().addMacroDef(define);
+    bool sawDependency(llvm::StringRef Filename, bool FromModule, bool IsSystem, bool IsModuleFile, bool IsMissing) override
+    {
+        return !IsMissing && !IsModuleFile && llvm::sys::fs::exists(Filename);
     }
+};
 
-    for (auto include : Includes) {
-        clangInstance.getHeaderSearchOpts().AddPath(include, clang::frontend::After, false, false);
-    }
+/// `--device-prelude` and the headers it includes
+struct DevicePreludeFiles {
+    /// The prelude first, then its headers in the order they are first included
+    std::vector<std::string> paths;
+    /// Hash of the contents of `paths`
+    std::string key;
+};
+
+/// The files of `--device-prelude` for the language of `fileName`, found once by preprocessing it and shared by every file
+///
+/// They are all part of the PCH and cache keys, so editing a header the prelude includes rebuilds the PCH like editing the
+/// prelude does. Kept by path, since the children of `--daemon` inherit what the daemon read for its own flags.
+const DevicePreludeFiles& DevicePreludeHeaders(const std::string& fileName)
+{
+    static std::mutex preludeMutex;
+    static llvm::StringMap<DevicePreludeFiles> preludes;
+
+    std::string path = DevicePrelude.empty() ? std::string() : std::filesystem::absolute(std::string(DevicePrelude)).string();
+    std::lock_guard<std::mutex> lock(preludeMutex);
+    auto [prelude, inserted] = preludes.try_emplace(fmt::format("{}:{}", IsCXXInput(fileName) ? "clpp" : "cl", path));
+    if (!inserted || path.empty())
+        return prelude->second;
+
+    openclc::TimeRegion region("Scan device prelude", fileName);
+    clang::CompilerInstance clangInstance;
+    std::string log;
+    llvm::raw_string_ostream diagnosticsStream(log);
+    clangInstance.createDiagnostics(new clang::TextDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts()), true);
+    ConfigureDeviceCompilerInstance(clangInstance, fileName);
+    clangInstance.getHeaderSearchOpts().UseStandardSystemIncludes = false;
+    clangInstance.getHeaderSearchOpts().UseStandardCXXIncludes = false;
 
-    // Get llvm::Module from `clangInstance`
-    clang::EmitLLVMOnlyAction action(&ctx);
+    std::string preludeSource = fmt::format("#include \"opencl-c.h\"\n#include \"openclc-device.h\"\n#include \"{}\"\n", path);
+    llvm::MemoryBufferRef membufref = llvm::MemoryBufferRef(llvm::StringRef(preludeSource), llvm::StringRef("openclc-device-prelude.h"));
+    clangInstance.getFrontendOpts().Inputs.push_back(clang::FrontendInputFile(membufref, clang::InputKind(IsCXXInput(fileName) ? clang::Language::OpenCLCXX : clang::Language::OpenCL).getHeader()));
+    auto dependencyCollector = std::make_shared<DeviceDependencyCollector>();
+    clangInstance.addDependencyCollector(dependencyCollector);
 
-    bool success = action.BeginSourceFile(clangInstance, clSrcFile);
-    if (!success) {
-        fmt::print(err, "Preparation for file '{}' failed\n", fileName);
+    clang::PreprocessOnlyAction action;
+    clangInstance.ExecuteAction(action);
+    if (clangInstance.getDiagnostics().getClient()->getNumErrors() > 0) {
+        PrintError("Failed to read device prelude '{}'\n{}", std::string(DevicePrelude), log);
         std::exit(1);
     }
 
-    llvm::Error result = action.Execute();
-    action.EndSourceFile();
+    std::vector<std::string> contents;
+    for (const std::string& header : dependencyCollector->getDependencies()) {
+        llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(header);
+        if (!buffer) {
+            PrintError("Failed to read device prelude header '{}': {}\n", header, buffer.getError().message());
+            std::exit(1);
+        }
+        prelude->second.paths.push_back(header);
+        contents.push_back(header);
+        contents.push_back((*buffer)->getBuffer().str());
+    }
+    prelude->second.key = openclc::SpvCache::hash(std::vector<llvm::StringRef>(contents.begin(), contents.end()));
+    return prelude->second;
+}
+
+/// Everything besides the source itself and the SPIR-V variants that changes how device code compiles
+///
+/// Shared by the `SpvCache` keys and the PCH file names.
+std::vector<std::string> DeviceCompilationKey(const std::string& fileName)
+{
+    std::vector<std::string> parts = {
+        OPENCLC_VERSION,
+        LLVM_VERSION_STRING,
+        std::filesystem::path(fileName).extension().string(),
+        std::to_string(static_cast<int>(CLStd.getValue())),
+        Debug ? "g" : "",
+        "O" + std::to_string(DeviceOptLevel()),
+        DevicePreludeHeaders(fileName).key,
+    };
+    for (const std::string& define : Defines)
+        parts.push_back("-D" + define);
+    for (const std::string& include : Includes)
+        parts.push_back("-I" + include);
+
+    return parts;
+}
+
+/// Precompiles `opencl-c.h`, `openclc-device.h` and `--device-prelude` to `pchPath`, returns false if they don't compile
+bool BuildDevicePCH(const std::string& fileName, const std::string& pchPath)
+{
+    openclc::TimeRegion region("Precompile headers", fileName);
+    clang::CompilerInstance clangInstance;
+
+    std::string pchSource = "#include \"opencl-c.h\"\n#include \"openclc-device.h\"\n";
+    if (!DevicePrelude.empty())
+        pchSource.append(fmt::format("#include \"{}\"\n", std::filesystem::absolute(std::string(DevicePrelude)).string()));
+
+    llvm::MemoryBufferRef membufref = llvm::MemoryBufferRef(llvm::StringRef(pchSource), llvm::StringRef("openclc-device-pch.h"));
+    clang::FrontendInputFile pchSrcFile(membufref, clang::InputKind(IsCXXInput(fileName) ? clang::Language::OpenCLCXX : clang::Language::OpenCL).getHeader());
+
+    // diagnostics
+    std::string log;
+    llvm::raw_string_ostream diagnosticsStream(log);
+    clangInstance.createDiagnostics(
+        new clang::TextDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts()),
+        true);
+
+    ConfigureDeviceCompilerInstance(clangInstance, fileName);
+
+    // input and output, clang writes the PCH to a temporary and renames it into place
+    clangInstance.getFrontendOpts().Inputs.push_back(pchSrcFile);
+    clangInstance.getFrontendOpts().OutputFile = pchPath;
+
+    clang::GeneratePCHAction action;
+    clangInstance.ExecuteAction(action);
 
     clang::DiagnosticConsumer* const consumer = clangInstance.getDiagnostics().getClient();
     consumer->finish();
 
-    if ((consumer->getNumWarnings() > 0) || (consumer->getNumErrors() > 0))
-        fmt::print(err, "{}", log);
-    if (consumer->getNumErrors() > 0)
-        std::exit(1);
+    if (consumer->getNumErrors() > 0) {
+        PrintError("Precompiling device headers failed\n{}", log);
+        return false;
+    }
+    return true;
+}
+
+/// Absolute directory `--daemon` keeps its PCHs in, so every request finds them whatever its working directory and cache
+static std::string DaemonPCHDir;
 
-    return action.takeModule();
+/// PCH of `opencl-c.h` and `--device-prelude` for the current flags, built on first use
+///
+/// PCHs are named by a hash of the device flags, so they are shared by every file, job and invocation with the same flags.
+/// They live next to the SPIR-V cache if one is enabled, otherwise in `./openclc-tmp`, or with the daemon's. Empty if the
+/// headers don't compile, which is only reported by the first file to use the PCH.
+std::string DevicePCH(const std::string& fileName)
+{
+    static std::mutex pchMutex;
+    static llvm::StringMap<std::string> pchPaths;
+
+    std::vector<std::string> parts = DeviceCompilationKey(fileName);
+    parts.push_back("pch");
+    std::vector<llvm::StringRef> refs(parts.begin(), parts.end());
+    std::string key = openclc::SpvCache::hash(refs);
+
+    // A PCH the daemon built may have been removed with the cache since
+    std::lock_guard<std::mutex> lock(pchMutex);
+    if (auto it = pchPaths.find(key); it != pchPaths.end() && (it->second.empty() || std::filesystem::exists(it->second)))
+        return it->second;
+
+    std::filesystem::path pchDir = DaemonPCHDir;
+    if (pchDir.empty())
+        pchDir = (CacheDir.empty() ? std::filesystem::path("./openclc-tmp") : std::filesystem::path(std::string(CacheDir))) / "pch";
+    std::filesystem::create_directories(pchDir);
+    std::string pchPath = (pchDir / (key + ".pch")).string();
+
+    if (std::filesystem::exists(pchPath)) {
+        // Marks the PCH as recently used for `SpvCache::evict`
+        std::error_code ec;
+        std::filesystem::last_write_time(pchPath, std::filesystem::file_time_type::clock::now(), ec);
+    } else {
+        if (Verbose)
+            Print("Debug: Precompiling device headers to '{}'\n", pchPath);
+        if (!BuildDevicePCH(fileName, pchPath))
+            pchPath.clear();
+    }
+
+    return pchPaths[key] = pchPath;
+}
+
+/// A `spec_const` declared in a kernel body
+struct SpecConstant {
+    std::string name;
+    /// `SpecId` of the `OpSpecConstant`, shared by every kernel of the file
+    unsigned id;
+    /// Type of the host setter's argument, and the type its value is passed to OpenCL as
+    std::string hostType;
+    std::string storageType;
+};
+
+/// Work-group size as `x, y, z`, with `1` for unused dimensions
+using WorkGroupSize = std::array<unsigned, 3>;
+
+/// `32x1x1`, or `?` for a size that isn't known at compile time
+std::string WorkGroupSizeString(const std::optional<WorkGroupSize>& size)
+{
+    return size ? fmt::format("{}x{}x{}", (*size)[0], (*size)[1], (*size)[2]) : "?";
 }
 
 struct Kernel {
@@ -296,533 +592,3417 @@ struct Kernel {
     /// Function Arg Type and Names
     std::vector<std::string> kParamTypes;
     std::vector<std::string> kParams;
-    // (x,y): x lines, then y chars to the correct place in the source string
-    std::pair<std::size_t, std::size_t> beginSourceLocation;
-    std::pair<std::size_t, std::size_t> endSourceLocation;
-
-    std::string toString()
+    /// Byte offsets of the first and last character of the definition in the main file
+    std::size_t beginSourceOffset;
+    std::size_t endSourceOffset;
+    /// Hash of the source of the kernel, of the device code and type definitions it uses and of the macros they expand
+    std::string sourceHash;
+    /// Byte ranges of the main file definitions the kernel uses that host code doesn't, cut from the host source with the kernel
+    std::vector<std::pair<std::size_t, std::size_t>> deviceOnlyRanges;
+    /// Specialization constants, each gets a `<kName>_set_<name>` setter next to the stub
+    std::vector<SpecConstant> kSpecConsts;
+    /// Marked `__attribute__((used))`, so it is kept even if never launched
+    bool kUsed = false;
+    /// Block size every launch must use, from `reqd_work_group_size` or `InferWorkGroupSizes`. The stub checks it.
+    std::optional<WorkGroupSize> kReqdWorkGroupSize;
+    /// Block size the kernel is likely launched with, from `work_group_size_hint` or `InferWorkGroupSizes`
+    std::optional<WorkGroupSize> kWorkGroupSizeHint;
+    /// Most work-items per block from `__launch_bounds__`, 0 if unbounded. The stub checks it.
+    unsigned kMaxWorkGroupSize = 0;
+    /// A template kernel, which only its instances are compiled from. Its source is still cut from the host source.
+    bool kTemplate = false;
+    /// Uses a program scope variable that can be written, which it shares with the other kernels of the program
+    bool kSharesGlobals = false;
+
+    std::string toString() const
     {
-        std::string decl = fmt::format("int {}(dim3 gd, dim3 bd, ", this->kName);
+        std::string decl = fmt::format("int {}(dim3 gd, dim3 bd, size_t shmem, cl_command_queue queue", this->kName);
         for (int i = 0; i < kParams.size(); i++) {
-            decl.append(fmt::format("{} {}", kParamTypes[i], kParams[i]));
-            if (i < kParams.size() - 1)
-                decl.append(", ");
+            decl.append(fmt::format(", {} {}", kParamTypes[i], kParams[i]));
         }
         decl.append(")");
         return decl;
     }
+};
 
-    std::size_t beginSourceOffset(std::string src)
-    {
-        std::size_t charOffset = 0;
-        std::size_t newlinesEncountered = 0;
-        while (newlinesEncountered < (std::get<0>(this->beginSourceLocation) - 1)) {
-            if (src.at(charOffset) == '\n')
-                newlinesEncountered++;
-            charOffset++;
-        }
-        charOffset += (std::get<1>(this->beginSourceLocation) - 1);
+/// Builds the `Kernel` descriptor of a `__kernel` function, reporting kernels the stubs can't express with `std::nullopt`
+std::optional<Kernel> KernelFromDecl(clang::ASTContext& Context, clang::FunctionDecl* Declaration)
+{
+    clang::FullSourceLoc startFullLocation = Context.getFullLoc(Declaration->getBeginLoc());
 
-        return charOffset;
+    if (Declaration->getReturnType().getAsString() != std::string("void")) {
+        PrintError("Kernel Declaration `{}` has return type `{}`\n", Declaration->getNameAsString(), Declaration->getReturnType().getAsString());
+        return std::nullopt;
     }
 
-    std::size_t endSourceOffset(std::string src)
-    {
-        std::size_t charOffset = 0;
-        std::size_t newlinesEncountered = 0;
-        while (newlinesEncountered < (std::get<0>(this->endSourceLocation) - 1)) {
-            if (src.at(charOffset) == '\n')
-                newlinesEncountered++;
-            charOffset++;
-        }
-        charOffset += (std::get<1>(this->endSourceLocation) - 1);
+    std::vector<std::string> kParamTypes;
+    std::vector<std::string> kParams;
 
-        return charOffset;
-    }
-};
-static std::vector<Kernel> KernelDecls;
+    for (int i = 0; i < Declaration->getNumParams(); i++) {
+        clang::ParmVarDecl* pvd = Declaration->getParamDecl(i);
+        std::string paramType = pvd->getOriginalType().getAsString();
+
+        if (paramType.find("__constant") != std::string::npos)
+            paramType.replace(0, sizeof("__constant ") - 1, "");
+        if (paramType.find("__global") != std::string::npos)
+            paramType.replace(0, sizeof("__global ") - 1, "");
+        if (paramType.find("__local") != std::string::npos) {
+            Print("__local memory used in kernel `{}`, but dynamically allocated smem is not supported\n", Declaration->getNameAsString());
+            return std::nullopt;
+        }
 
-class FindKernelDeclVisitor
-    : public clang::RecursiveASTVisitor<FindKernelDeclVisitor> {
-public:
-    explicit FindKernelDeclVisitor(clang::ASTContext* Context)
-        : Context(Context)
-    {
+        kParamTypes.push_back(paramType);
+        kParams.push_back(std::string(pvd->getName()));
     }
 
-    bool VisitFunctionDecl(clang::FunctionDecl* Declaration)
-    {
-        clang::FullSourceLoc startFullLocation = Context->getFullLoc(Declaration->getBeginLoc());
-
-        // useful for debugging
-        // fmt::print("DEBUG: Found `{}` at {}:{}\n", Declaration->getNameAsString(), startFullLocation.getSpellingLineNumber(), startFullLocation.getSpellingColumnNumber());
-        // fmt::print("\tKernel? {}\n", (Declaration->getFunctionType()->getCallConv() == clang::CallingConv::CC_OpenCLKernel));
-        // fmt::print("\tvalid location? {}\n", startFullLocation.isValid());
-        // fmt::print("\tin system header? {}\n", startFullLocation.isInSystemHeader());
-        // fmt::print("\tret type? {}\n", Declaration->getReturnType().getAsString());
-        // fmt::print("\tDefined? {}\n", Declaration->isDefined());
-
-        if (!startFullLocation.isValid() || startFullLocation.isInSystemHeader() || Declaration->getFunctionType()->getCallConv() != clang::CallingConv::CC_OpenCLKernel)
-            return true;
-
-        if (Declaration->getReturnType().getAsString() != std::string("void")) {
-            fmt::print(err, "Kernel Declaration `{}` has return type `{}`\n", Declaration->getNameAsString(), Declaration->getReturnType().getAsString());
-            std::exit(1);
+    // Clang already knows where the definition starts and ends, so the file never has to be rescanned for lines
+    clang::SourceManager& SM = Context.getSourceManager();
+    std::size_t beginOffset = SM.getFileOffset(SM.getExpansionLoc(Declaration->getBeginLoc()));
+    std::size_t endOffset = SM.getFileOffset(SM.getExpansionLoc(Declaration->getEndLoc()));
+
+    std::optional<WorkGroupSize> reqdWorkGroupSize;
+    if (auto* attr = Declaration->getAttr<clang::ReqdWorkGroupSizeAttr>())
+        reqdWorkGroupSize = WorkGroupSize { attr->getXDim(), attr->getYDim(), attr->getZDim() };
+    std::optional<WorkGroupSize> workGroupSizeHint;
+    if (auto* attr = Declaration->getAttr<clang::WorkGroupSizeHintAttr>())
+        workGroupSizeHint = WorkGroupSize { attr->getXDim(), attr->getYDim(), attr->getZDim() };
+
+    // The bounds of template kernels may depend on their arguments, they are read from each instance
+    unsigned maxWorkGroupSize = 0;
+    for (const clang::AnnotateAttr* attr : Declaration->specific_attrs<clang::AnnotateAttr>()) {
+        if (attr->getAnnotation() != openclc::LaunchBoundsAnnotation || llvm::any_of(attr->args(), [](clang::Expr* arg) { return arg->isValueDependent(); }))
+            continue;
+        std::optional<llvm::APSInt> maxThreads = attr->args_size() > 0 && attr->args_size() <= 2 ? (*attr->args_begin())->getIntegerConstantExpr(Context) : std::nullopt;
+        if (!maxThreads || maxThreads->isNonPositive() || maxThreads->getActiveBits() > 32) {
+            PrintError("Kernel `{}` has invalid `__launch_bounds__`, expected a positive integer constant and an optional second one\n", Declaration->getNameAsString());
+            return std::nullopt;
         }
+        maxWorkGroupSize = maxThreads->getZExtValue();
+    }
+    if (reqdWorkGroupSize && maxWorkGroupSize && (*reqdWorkGroupSize)[0] * (*reqdWorkGroupSize)[1] * (*reqdWorkGroupSize)[2] > maxWorkGroupSize) {
+        PrintError("Kernel `{}` requires a block of {}, more than its `__launch_bounds__({})`\n", Declaration->getNameAsString(), WorkGroupSizeString(reqdWorkGroupSize), maxWorkGroupSize);
+        return std::nullopt;
+    }
 
-        std::vector<std::string> kParamTypes;
-        std::vector<std::string> kParams;
+    if (Verbose) {
+        Print(
+            "Debug: Found Kernel `{}` at {}:{}\n",
+            Declaration->getNameAsString(),
+            startFullLocation.getSpellingLineNumber(),
+            startFullLocation.getSpellingColumnNumber());
+    }
 
-        for (int i = 0; i < Declaration->getNumParams(); i++) {
-            clang::ParmVarDecl* pvd = Declaration->getParamDecl(i);
-            std::string paramType = pvd->getOriginalType().getAsString();
+    return Kernel {
+        .kName = Declaration->getNameAsString(),
+        .kParamTypes = kParamTypes,
+        .kParams = kParams,
+        .beginSourceOffset = beginOffset,
+        .endSourceOffset = endOffset,
+        .kUsed = Declaration->hasAttr<clang::UsedAttr>(),
+        .kReqdWorkGroupSize = reqdWorkGroupSize,
+        .kWorkGroupSizeHint = workGroupSizeHint,
+        .kMaxWorkGroupSize = maxWorkGroupSize,
+    };
+}
 
-            if (paramType.find("__constant") != std::string::npos)
-                paramType.replace(0, sizeof("__constant ") - 1, "");
-            if (paramType.find("__global") != std::string::npos)
-                paramType.replace(0, sizeof("__global ") - 1, "");
-            if (paramType.find("__local") != std::string::npos) {
-                fmt::print("__local memory used in kernel `{}`, but dynamically allocated smem is not supported\n", Declaration->getNameAsString());
-                std::exit(1);
-            }
+/// What a device library keeps of a `Kernel`, everything but its place in the file it was compiled from
+llvm::json::Object KernelLibraryMetadata(const Kernel& kernel)
+{
+    llvm::json::Array params;
+    for (std::size_t i = 0; i < kernel.kParams.size(); i++)
+        params.push_back(llvm::json::Object { { "type", kernel.kParamTypes[i] }, { "name", kernel.kParams[i] } });
+
+    llvm::json::Array specConsts;
+    for (const SpecConstant& sc : kernel.kSpecConsts) {
+        specConsts.push_back(llvm::json::Object {
+            { "name", sc.name },
+            { "id", int64_t(sc.id) },
+            { "hostType", sc.hostType },
+            { "storageType", sc.storageType },
+        });
+    }
 
-            kParamTypes.push_back(paramType);
-            kParams.push_back(std::string(pvd->getName()));
-        }
+    llvm::json::Object metadata { { "params", std::move(params) }, { "specConstants", std::move(specConsts) } };
+    // Hints and the sizes themselves are part of the bitcode, only the stub's checks need them here
+    if (kernel.kReqdWorkGroupSize)
+        metadata["reqdWorkGroupSize"] = llvm::json::Array { (*kernel.kReqdWorkGroupSize)[0], (*kernel.kReqdWorkGroupSize)[1], (*kernel.kReqdWorkGroupSize)[2] };
+    if (kernel.kMaxWorkGroupSize)
+        metadata["maxWorkGroupSize"] = int64_t(kernel.kMaxWorkGroupSize);
+    return metadata;
+}
 
-        clang::FullSourceLoc endFullLocation = Context->getFullLoc(Declaration->getEndLoc());
+/// Rebuilds the `Kernel` of a device library member from `KernelLibraryMetadata`, exiting on metadata that doesn't parse
+Kernel KernelFromLibraryMember(const openclc::DeviceLibrary::Member& member, const std::string& libraryPath)
+{
+    auto fail = [&] {
+        PrintError("Device library `{}` has corrupt metadata for kernel `{}`\n", libraryPath, member.name);
+        std::exit(1);
+    };
+
+    // Library kernels are only linked in when launched
+    Kernel kernel { .kName = member.name, .beginSourceOffset = 0, .endSourceOffset = 0, .kUsed = true };
+    const llvm::json::Array* params = member.metadata.getArray("params");
+    const llvm::json::Array* specConsts = member.metadata.getArray("specConstants");
+    if (!params || !specConsts)
+        fail();
+
+    for (const llvm::json::Value& value : *params) {
+        const llvm::json::Object* param = value.getAsObject();
+        std::optional<llvm::StringRef> type = param ? param->getString("type") : std::nullopt;
+        std::optional<llvm::StringRef> name = param ? param->getString("name") : std::nullopt;
+        if (!type || !name)
+            fail();
+        kernel.kParamTypes.push_back(type->str());
+        kernel.kParams.push_back(name->str());
+    }
 
-        KernelDecls.push_back(
-            Kernel {
-                .kName = Declaration->getNameAsString(),
-                .kParamTypes = kParamTypes,
-                .kParams = kParams,
-                .beginSourceLocation = std::pair(startFullLocation.getSpellingLineNumber(), startFullLocation.getSpellingColumnNumber()),
-                .endSourceLocation = std::pair(endFullLocation.getSpellingLineNumber(), endFullLocation.getSpellingColumnNumber()),
-            });
+    for (const llvm::json::Value& value : *specConsts) {
+        const llvm::json::Object* sc = value.getAsObject();
+        std::optional<llvm::StringRef> name = sc ? sc->getString("name") : std::nullopt;
+        std::optional<int64_t> id = sc ? sc->getInteger("id") : std::nullopt;
+        std::optional<llvm::StringRef> hostType = sc ? sc->getString("hostType") : std::nullopt;
+        std::optional<llvm::StringRef> storageType = sc ? sc->getString("storageType") : std::nullopt;
+        if (!name || !id || *id < 0 || !hostType || !storageType)
+            fail();
+        kernel.kSpecConsts.push_back(SpecConstant { name->str(), static_cast<unsigned>(*id), hostType->str(), storageType->str() });
+    }
 
-        if (Verbose) {
-            fmt::println(
-                "Debug: Found Kernel `{}` at {}:{}",
-                Declaration->getNameAsString(),
-                startFullLocation.getSpellingLineNumber(),
-                startFullLocation.getSpellingColumnNumber());
+    if (const llvm::json::Array* reqd = member.metadata.getArray("reqdWorkGroupSize")) {
+        WorkGroupSize size;
+        if (reqd->size() != size.size())
+            fail();
+        for (std::size_t i = 0; i < size.size(); i++) {
+            std::optional<int64_t> dim = (*reqd)[i].getAsInteger();
+            if (!dim || *dim <= 0)
+                fail();
+            size[i] = static_cast<unsigned>(*dim);
         }
-
-        return true;
+        kernel.kReqdWorkGroupSize = size;
     }
-
-private:
-    clang::ASTContext* Context;
-};
-
-class FindKernelDeclConsumer : public clang::ASTConsumer {
-public:
-    explicit FindKernelDeclConsumer(clang::ASTContext* Context)
-        : Visitor(Context)
-    {
+    if (std::optional<int64_t> max = member.metadata.getInteger("maxWorkGroupSize")) {
+        if (*max <= 0)
+            fail();
+        kernel.kMaxWorkGroupSize = static_cast<unsigned>(*max);
     }
 
-    virtual void HandleTranslationUnit(clang::ASTContext& Context)
-    {
-        Visitor.TraverseDecl(Context.getTranslationUnitDecl());
-    }
+    return kernel;
+}
 
-private:
-    FindKernelDeclVisitor Visitor;
+/// A kernel of a device library, linked into executables that launch it
+struct LibraryKernel {
+    Kernel kernel;
+    std::string libraryPath;
+    /// Optimized bitcode of the kernel and the helpers it calls, mapped from the library
+    llvm::StringRef bitcode;
 };
 
-class FindKernelDeclAction : public clang::ASTFrontendAction {
-public:
-    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
-        clang::CompilerInstance& Compiler, llvm::StringRef InFile)
-    {
-        return std::make_unique<FindKernelDeclConsumer>(&Compiler.getASTContext());
-    }
+/// The device libraries given with `-l` or as inputs, and their kernels by name
+struct DeviceLibraries {
+    std::vector<std::unique_ptr<openclc::DeviceLibrary>> libraries;
+    std::vector<std::string> paths;
+    llvm::StringMap<LibraryKernel> kernels;
+    /// Hash of the library indexes. Host sources declare the library kernels they launch, so it is part of their stamp keys.
+    std::string key;
 };
 
-/// Populatates global `KernelDecls` with Kernels found in the input source code
-std::string ExtractDeviceCode(llvm::LLVMContext& ctx, std::string& fileContents, std::string& fileName)
+/// Written into device libraries, which are only read by the same compiler since bitcode isn't stable across LLVM versions
+std::string DeviceLibraryProducer()
 {
-    assert(fileContents.size() > 0 && "Empty fileContents passed to `ExtractDeviceCode`.");
+    return fmt::format("openclc {} LLVM {}", OPENCLC_VERSION, LLVM_VERSION_STRING);
+}
 
-    clang::CompilerInstance clangInstance;
+/// Whether an input is a device library rather than a source file
+bool IsDeviceLibraryInput(llvm::StringRef fileName)
+{
+    return fileName.ends_with(".oclclib");
+}
 
-    llvm::MemoryBufferRef membufref = llvm::MemoryBufferRef(llvm::StringRef(fileContents), llvm::StringRef(fileName));
-    clang::FrontendInputFile clSrcFile(membufref, clang::InputKind(clang::Language::OpenCL));
+/// Whether an input is an object file, e.g. from `-c`, which is passed on to the host linker as is
+bool IsObjectInput(llvm::StringRef fileName)
+{
+    return fileName.ends_with(".o") || fileName.ends_with(".obj");
+}
 
-    // warnings to disable
-    clangInstance.getDiagnosticOpts().Warnings.push_back("no-unsafe-buffer-usage");
+/// Whether an object input was compiled from C++, judged by its mangled symbols, so that it's linked by the C++ compiler
+bool IsCXXObject(const std::string& fileName)
+{
+    llvm::Expected<llvm::object::OwningBinary<llvm::object::ObjectFile>> object = llvm::object::ObjectFile::createObjectFile(fileName);
+    if (!object) {
+        llvm::consumeError(object.takeError());
+        return false;
+    }
+    for (const llvm::object::SymbolRef& symbol : object->getBinary()->symbols()) {
+        llvm::Expected<llvm::StringRef> name = symbol.getName();
+        if (!name) {
+            llvm::consumeError(name.takeError());
+            continue;
+        }
+        // Mach-O prefixes every symbol with an underscore, MSVC mangled names start with `?`
+        llvm::StringRef mangled = name->starts_with("__Z") ? name->drop_front() : *name;
+        if (mangled.starts_with("_Z") || mangled.starts_with("?") || mangled.contains("__gxx_personality"))
+            return true;
+    }
+    return false;
+}
 
-    // diagnostics
-    std::string log;
-    llvm::raw_string_ostream diagnosticsStream(log);
-    clangInstance.createDiagnostics(
-        new clang::DeviceFrontendDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts()),
-        true);
+/// Path of `-l<name>`, the first `lib<name>.oclclib` or `<name>.oclclib` in the `-L` directories and then the working directory
+std::string FindDeviceLibrary(const std::string& name)
+{
+    std::vector<std::string> dirs(LibraryDirs.begin(), LibraryDirs.end());
+    dirs.push_back(".");
+    for (const std::string& dir : dirs) {
+        for (const std::string& candidate : { "lib" + name + ".oclclib", name + ".oclclib" }) {
+            std::filesystem::path path = std::filesystem::path(dir) / candidate;
+            if (std::filesystem::is_regular_file(path))
+                return path.string();
+        }
+    }
 
-    // input
-    clangInstance.getFrontendOpts().Inputs.push_back(clSrcFile);
+    PrintError("Device library `-l{}` not found in {}\n", name, fmt::join(dirs, ", "));
+    std::exit(1);
+}
 
-    // target
-    clangInstance.getTargetOpts().Triple = "spirv64-unknown-unknown";
-    clangInstance.setTarget(clang::TargetInfo::CreateTargetInfo(clangInstance.getDiagnostics(), std::make_shared<clang::TargetOptions>(clangInstance.getTargetOpts())));
-
-    // instance options
-    clangInstance.createFileManager();
-    clangInstance.createSourceManager(clangInstance.getFileManager());
-
-    // language options, copied from CLSPV
-    clangInstance.getLangOpts().C99 = true;
-    clangInstance.getLangOpts().RTTI = false;
-    clangInstance.getLangOpts().RTTIData = false;
-    clangInstance.getLangOpts().MathErrno = false;
-    clangInstance.getLangOpts().Optimize = false;
-    clangInstance.getLangOpts().NoBuiltin = true;
-    clangInstance.getLangOpts().ModulesSearchAll = false;
-    clangInstance.getLangOpts().SinglePrecisionConstants = true;
-    clangInstance.getLangOpts().DeclareOpenCLBuiltins = true;
-    clangInstance.getLangOpts().NativeHalfType = true; // enabled by default
-    clangInstance.getLangOpts().NativeHalfArgsAndReturns = true; // enabled by default
-
-    clang::Language lang;
-    clang::LangStandard::Kind langStd;
-
-    if (fileName.ends_with(".cl") || fileName.ends_with(".ocl")) {
-        lang = clang::Language::OpenCL;
-        switch (CLStd) {
-        case CL_STD_100:
-            langStd = clang::LangStandard::lang_opencl10;
-            break;
-        case CL_STD_110:
-            langStd = clang::LangStandard::lang_opencl11;
-            break;
-        case CL_STD_120:
-            langStd = clang::LangStandard::lang_opencl12;
-            break;
-        case CL_STD_200:
-            langStd = clang::LangStandard::lang_opencl20;
-            break;
-        case CL_STD_300:
-            langStd = clang::LangStandard::lang_opencl30;
-            break;
+/// The device libraries, read once
+///
+/// `.oclclib` inputs come first, then `-l` libraries in order. Like archives given to a linker, a kernel of an earlier library
+/// shadows kernels of the same name in later ones. Exits on libraries that can't be read or were built by another compiler.
+const DeviceLibraries& LoadedDeviceLibraries()
+{
+    static const DeviceLibraries loaded = [] {
+        DeviceLibraries loaded;
+        for (const std::string& input : InputFilenames) {
+            if (IsDeviceLibraryInput(input))
+                loaded.paths.push_back(input);
         }
-    } else {
-        fmt::print(err, "Invalid file extension supplied. Use `.cl` or `.ocl`. Note that only C source code is allowed.\n");
-        std::exit(1);
-    }
+        for (const std::string& name : Libraries)
+            loaded.paths.push_back(FindDeviceLibrary(name));
+
+        std::vector<llvm::StringRef> indexes;
+        for (const std::string& path : loaded.paths) {
+            std::string error;
+            std::unique_ptr<openclc::DeviceLibrary> library = openclc::DeviceLibrary::open(path, error);
+            if (!library) {
+                PrintError("Failed to read device library `{}`: {}\n", path, error);
+                std::exit(1);
+            }
+            if (library->producer() != DeviceLibraryProducer()) {
+                PrintError("Device library `{}` was built by {}, rebuild it with {}\n", path, library->producer().str(), DeviceLibraryProducer());
+                std::exit(1);
+            }
 
-    std::vector<std::string> includes;
-    clang::LangOptions::setLangDefaults(
-        clangInstance.getLangOpts(),
-        lang,
-        llvm::Triple { "spirv64-unknown-unknown" },
-        includes,
-        langStd);
+            for (const openclc::DeviceLibrary::Member& member : library->members())
+                loaded.kernels.try_emplace(member.name, LibraryKernel { KernelFromLibraryMember(member, path), path, member.bitcode });
+            indexes.push_back(library->index());
+            loaded.libraries.push_back(std::move(library));
+        }
+        loaded.key = openclc::SpvCache::hash(indexes);
+        return loaded;
+    }();
+    return loaded;
+}
 
-    clangInstance.getPreprocessorOpts().addMacroDef("__SPIRV__");
+/// `length` bytes of the source at `offset` are replaced by `text` in the generated host source
+struct SourceReplacement {
+    std::size_t offset;
+    std::size_t length;
+    std::string text;
+    /// Name of the launched kernel, the name of the instance for template kernels
+    std::string kernel;
+    /// The launch is in the body of a `#define`, where the name may be a macro parameter
+    bool inMacroDefinition;
+    /// Template kernel and its arguments as written at the launch, with whitespace normalized. Empty for other kernels.
+    std::string templateName;
+    std::string templateArgs;
+    /// Block size of the launch, if it is spelled with integer literals
+    std::optional<WorkGroupSize> blockSize;
+};
 
-    for (auto define : Defines) {
-        clangInstance.getPreprocessorOpts().addMacroDef(define);
+/// Drops whitespace from template arguments, except a single space between two words
+std::string NormalizeTemplateArguments(llvm::StringRef args)
+{
+    std::string normalized;
+    bool pendingSpace = false;
+    for (char c : args.trim()) {
+        if (llvm::isSpace(c)) {
+            pendingSpace = true;
+            continue;
+        }
+        if (pendingSpace && !normalized.empty() && (llvm::isAlnum(normalized.back()) || normalized.back() == '_') && (llvm::isAlnum(c) || c == '_'))
+            normalized.push_back(' ');
+        normalized.push_back(c);
+        pendingSpace = false;
     }
+    return normalized;
+}
 
-    clangInstance.getHeaderSearchOpts().UseStandardSystemIncludes = false;
-    clangInstance.getHeaderSearchOpts().UseStandardCXXIncludes = false;
+/// Name of the kernel and stub of a template kernel instance, e.g. `scale_T_float_2c4` for `scale<float, 4>`
+///
+/// Letters and digits of the arguments are kept and every other character is written as `_` and its hex code, so distinct
+/// argument lists get distinct C identifiers.
+std::string TemplateInstanceName(llvm::StringRef templateName, llvm::StringRef templateArgs)
+{
+    std::string name = templateName.str() + "_T_";
+    for (char c : templateArgs) {
+        if (llvm::isAlnum(c))
+            name.push_back(c);
+        else
+            name.append(fmt::format("_{:02x}", static_cast<unsigned char>(c)));
+    }
+    return name;
+}
 
-    for (auto include : Includes) {
-        clangInstance.getHeaderSearchOpts().AddPath(include, clang::frontend::After, false, false);
+/// The block size of a launch parameter written as a `dim3` of integer literals, e.g. `(dim3){ 16, 16 }` or `{ 256 }`
+///
+/// Launches are only lexed, so sizes held in variables or built from macros aren't known.
+std::optional<WorkGroupSize> ConstantBlockSize(llvm::StringRef param)
+{
+    param = param.trim();
+    if (param.consume_front("(")) {
+        param = param.ltrim();
+        if (!param.consume_front("dim3") || !param.ltrim().starts_with(")"))
+            return std::nullopt;
+        param = param.ltrim().drop_front();
+    } else {
+        param.consume_front("dim3");
     }
+    param = param.trim();
+    if (!param.consume_front("{") || !param.consume_back("}"))
+        return std::nullopt;
+
+    llvm::SmallVector<llvm::StringRef, 3> dims;
+    param.split(dims, ',');
+    if (dims.size() > 1 && dims.back().trim().empty())
+        dims.pop_back();
+    if (dims.size() > 3)
+        return std::nullopt;
+
+    // Zero sized y and z dimensions make the launch one or two dimensional, the same as a size of 1
+    WorkGroupSize size { 1, 1, 1 };
+    for (std::size_t i = 0; i < dims.size(); i++) {
+        llvm::StringRef dim = dims[i].trim();
+        if (!dim.consume_back("u"))
+            dim.consume_back("U");
+        unsigned value;
+        if (dim.getAsInteger(0, value) || (value == 0 && i == 0))
+            return std::nullopt;
+        size[i] = std::max(value, 1u);
+    }
+    return size;
+}
 
-    clangInstance.ExecuteAction(*std::make_unique<FindKernelDeclAction>());
+/// Finds the edits that transform kernel invocations to regular function calls, in source order
+///
+/// `k<<<gd, bd[, shmem[, queue]]>>>(args...)` becomes `k(gd, bd, shmem, queue, args...)`, with `shmem` and `queue` defaulting to `0`.
+/// Dynamic local memory isn't supported, so `shmem` must be a literal `0`.
+/// Launch parameters can be any balanced expression, e.g. `<<<(dim3) { n / 256 }, blk>>>`. Template kernels are launched as
+/// `k<args><<<...>>>(...)`, which calls the stub named by `TemplateInstanceName`.
+///
+/// The source is lexed once by a raw `clang::Lexer`, so comments and string literals are skipped and the cost is linear in the file size.
+/// Only the launch configurations are copied, the edits are applied while the host source is written out.
+/// `sources` must be null terminated, as the contents of a `llvm::MemoryBuffer` are. Invalid launches are reported and give `std::nullopt`.
+std::optional<std::vector<SourceReplacement>> FindKernelInvocations(llvm::StringRef sources, const std::string& fileName)
+{
+    openclc::TimeRegion region("Scan launches", fileName);
+
+    clang::LangOptions langOpts;
+    langOpts.CUDA = true; // lex `<<<` and `>>>` as single tokens
+    clang::Lexer lexer(clang::SourceLocation(), langOpts, sources.data(), sources.data(), sources.data() + sources.size());
+
+    struct LexedToken {
+        clang::Token tok;
+        std::size_t begin;
+        std::size_t end;
+    };
+    auto lex = [&](LexedToken& t) {
+        bool atEof = lexer.LexFromRawLexer(t.tok);
+        t.end = lexer.getBufferLocation() - sources.data();
+        t.begin = t.end - t.tok.getLength();
+        return !atEof || t.tok.isNot(clang::tok::eof);
+    };
+    auto fail = [&](std::size_t offset, llvm::StringRef message) {
+        std::size_t line = std::count(sources.begin(), sources.begin() + offset, '\n') + 1;
+        PrintError("{}:{}: invalid kernel launch: {}\n", fileName, line, message);
+        return std::nullopt;
+    };
+
+    std::vector<SourceReplacement> replacements;
+
+    LexedToken prev {};
+    prev.tok.startToken();
+    LexedToken cur {};
+    bool inDirective = false;
+    while (lex(cur)) {
+        if (cur.tok.isAtStartOfLine())
+            inDirective = cur.tok.is(clang::tok::hash);
+        if (cur.tok.isNot(clang::tok::lesslessless) || !prev.tok.isOneOf(clang::tok::raw_identifier, clang::tok::greater, clang::tok::greatergreater)) {
+            prev = cur;
+            continue;
+        }
 
-    clang::DiagnosticConsumer* const consumer = clangInstance.getDiagnostics().getClient();
-    consumer->finish();
+        // Walk back over the template arguments to the kernel name, characters suffice since arguments rarely hold `<` or `>` of their own
+        std::size_t nameBegin = prev.begin;
+        std::string kernel, templateName, templateArgs;
+        if (prev.tok.is(clang::tok::raw_identifier)) {
+            kernel = prev.tok.getRawIdentifier().str();
+        } else {
+            std::size_t argsEnd = prev.end - 1;
+            std::size_t argsBegin = argsEnd;
+            for (int depth = 1; depth > 0;) {
+                if (argsBegin == 0)
+                    return fail(prev.begin, "unbalanced `<` and `>` before `<<<`");
+                char c = sources[--argsBegin];
+                depth += c == '>' ? 1 : c == '<' ? -1 : 0;
+            }
+            std::size_t nameEnd = sources.take_front(argsBegin).rtrim().size();
+            nameBegin = nameEnd;
+            while (nameBegin > 0 && (llvm::isAlnum(sources[nameBegin - 1]) || sources[nameBegin - 1] == '_'))
+                nameBegin--;
+            if (nameBegin == nameEnd)
+                return fail(argsBegin, "expected a template kernel name before `<`");
+
+            templateName = sources.slice(nameBegin, nameEnd).str();
+            templateArgs = NormalizeTemplateArguments(sources.slice(argsBegin + 1, argsEnd));
+            kernel = TemplateInstanceName(templateName, templateArgs);
+        }
 
-    if ((consumer->getNumWarnings() > 0) || (consumer->getNumErrors() > 0))
-        fmt::print(err, "{}", log);
-    if (consumer->getNumErrors() > 0)
-        std::exit(1);
+        // Split the launch parameters on top level commas
+        std::vector<llvm::StringRef> launchParams;
+        std::size_t paramBegin = cur.end;
+        int depth = 0;
+        while (true) {
+            if (!lex(cur))
+                return fail(prev.begin, fmt::format("`{}<<<` is never closed by `>>>`", kernel));
+
+            if (depth == 0 && (cur.tok.is(clang::tok::comma) || cur.tok.is(clang::tok::greatergreatergreater))) {
+                launchParams.push_back(sources.slice(paramBegin, cur.begin).trim());
+                if (launchParams.back().empty())
+                    return fail(cur.begin, "empty launch parameter");
+                if (cur.tok.is(clang::tok::greatergreatergreater))
+                    break;
+                paramBegin = cur.end;
+            } else if (cur.tok.isOneOf(clang::tok::l_paren, clang::tok::l_square, clang::tok::l_brace)) {
+                depth++;
+            } else if (cur.tok.isOneOf(clang::tok::r_paren, clang::tok::r_square, clang::tok::r_brace)) {
+                if (--depth < 0)
+                    return fail(cur.begin, "unbalanced brackets in launch parameters");
+            }
+        }
 
-    std::string deviceCode;
-    for (Kernel kDecl : KernelDecls) {
-        std::size_t start = kDecl.beginSourceOffset(fileContents);
-        std::size_t end = kDecl.endSourceOffset(fileContents);
-        deviceCode.append(fileContents.substr(start, end - start + 1));
-    }
+        if (launchParams.size() < 2 || launchParams.size() > 4)
+            return fail(prev.begin, fmt::format("expected 2 to 4 launch parameters, got {}", launchParams.size()));
+        // Kernels can't take `__local` buffers, so dynamic local memory has nothing to go to. Launches in macro definitions
+        // are left to the stub's check, their parameters are only known where the macro is used.
+        unsigned shmem = 0;
+        if (launchParams.size() > 2 && !inDirective && (launchParams[2].rtrim("uUlL").getAsInteger(0, shmem) || shmem != 0))
+            return fail(prev.begin, fmt::format("`{}` is launched with `{}` bytes of dynamic local memory, which is not supported, pass `0`", kernel, launchParams[2]));
+
+        LexedToken lparen {};
+        if (!lex(lparen) || lparen.tok.isNot(clang::tok::l_paren))
+            return fail(cur.end, "expected `(` after `>>>`");
+
+        // Peek past `(` to avoid a trailing comma for kernels without arguments
+        LexedToken next {};
+        bool hasArgs = lex(next) && next.tok.isNot(clang::tok::r_paren);
+
+        // Template launches replace the name too, `k<args>` by the instance stub
+        SourceReplacement& launch = templateName.empty()
+            ? replacements.emplace_back(SourceReplacement { prev.end, lparen.end - prev.end, "(", kernel, inDirective })
+            : replacements.emplace_back(SourceReplacement { nameBegin, lparen.end - nameBegin, kernel + "(", kernel, inDirective, templateName, templateArgs });
+        for (std::size_t i = 0; i < 4; i++) {
+            if (i > 0)
+                launch.text.append(", ");
+            if (i < launchParams.size())
+                launch.text.append(launchParams[i]);
+            else
+                launch.text.push_back('0');
+        }
+        if (hasArgs)
+            launch.text.append(", ");
+        launch.blockSize = ConstantBlockSize(launchParams[1]);
 
-    if (deviceCode.size() == 0) {
-        fmt::print(err, "openclc error (fatal): No device code found!\n");
-        std::exit(1);
+        prev = next;
+        if (next.tok.isAtStartOfLine())
+            inDirective = next.tok.is(clang::tok::hash);
     }
-    if (Verbose)
-        fmt::print("Debug: Found Device Code '{}'\n", deviceCode);
 
-    return deviceCode;
+    return replacements;
 }
 
-/// Transforms kernel invocations to regular function calls
-std::string transformKernelInvocations(std::string sources)
+/// Maps an input file, it is only ever viewed through `StringRef`s from there on. Null if it can't be read.
+std::unique_ptr<llvm::MemoryBuffer> ReadInputFile(const std::string& fileName)
 {
-    std::regex matchKernelInvocation(R"(([\d\w]+)\s?<<<\s*([\d\w]+)\s*,\s*([\d\w]+)\s*>>>\s?\()");
-    return std::regex_replace(sources, matchKernelInvocation, "$1($2, $3, ");
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> inFile = llvm::MemoryBuffer::getFile(fileName);
+    if (!inFile) {
+        PrintError("Failed to read `{}`: {}\n", fileName, inFile.getError().message());
+        return nullptr;
+    }
+    return std::move(*inFile);
 }
 
-/// Generate invocation code from a `Kernel` struct
-std::string GenerateKernelInvocation(Kernel k)
+/// A template kernel instantiated for a launch
+struct TemplateInstance {
+    /// Name of the instance's kernel and stub, from `TemplateInstanceName`
+    std::string name;
+    std::string templateName;
+    std::string templateArgs;
+};
+
+/// The kernels launched by the host code of all source inputs
+struct LaunchedKernelNames {
+    /// In order of first launch
+    std::vector<std::string> names;
+    llvm::StringSet<> set;
+    /// Instances of template kernels, in order of first launch
+    std::vector<TemplateInstance> instances;
+    /// Block size of every launch of each kernel, see `InferWorkGroupSizes`
+    llvm::StringMap<std::vector<std::optional<WorkGroupSize>>> blockSizes;
+    /// Kernels may be launched where openclc can't see, by a macro definition, by other objects with `-c` or by object inputs
+    bool unknown = false;
+    /// Hash of the sorted names and their block sizes. Kernels of one file are compiled based on launches in others, so it is part of the stamp keys.
+    std::string key;
+};
+
+/// Lexes the launch sites of every source input, once, exiting on inputs that can't be read or hold invalid launches
+const LaunchedKernelNames& LaunchedKernels()
+{
+    static const LaunchedKernelNames launched = [] {
+        LaunchedKernelNames launched;
+        launched.unknown = CompileOnly;
+        for (const std::string& fileName : InputFilenames) {
+            // Objects were compiled with `-c`, their launches aren't recorded
+            launched.unknown |= IsObjectInput(fileName);
+            if (IsDeviceLibraryInput(fileName) || IsObjectInput(fileName))
+                continue;
+            std::unique_ptr<llvm::MemoryBuffer> inFile = ReadInputFile(fileName);
+            std::optional<std::vector<SourceReplacement>> launches = inFile ? FindKernelInvocations(inFile->getBuffer(), fileName) : std::nullopt;
+            if (!launches)
+                std::exit(1);
+            for (SourceReplacement& launch : *launches) {
+                launched.unknown |= launch.inMacroDefinition;
+                launched.blockSizes[launch.kernel].push_back(launch.blockSize);
+                if (!launched.set.insert(launch.kernel).second)
+                    continue;
+                if (!launch.templateName.empty())
+                    launched.instances.push_back(TemplateInstance { launch.kernel, std::move(launch.templateName), std::move(launch.templateArgs) });
+                launched.names.push_back(std::move(launch.kernel));
+            }
+        }
+
+        std::vector<std::string> sorted;
+        for (const std::string& name : launched.names) {
+            sorted.push_back(name);
+            for (const std::optional<WorkGroupSize>& size : launched.blockSizes[name])
+                sorted.back().append(" " + WorkGroupSizeString(size));
+        }
+        llvm::sort(sorted);
+        sorted.push_back(launched.unknown ? "unknown" : "");
+        launched.key = openclc::SpvCache::hash(std::vector<llvm::StringRef>(sorted.begin(), sorted.end()));
+        return launched;
+    }();
+    return launched;
+}
+
+/// Whether a kernel is compiled and given a stub
+///
+/// Kernels no input launches are dropped unless marked `__attribute__((used))`, e.g. to be launched from a file openclc doesn't see.
+/// Template kernels never are, their instances are.
+bool IsKernelLive(const Kernel& kernel)
+{
+    const LaunchedKernelNames& launched = LaunchedKernels();
+    return !kernel.kTemplate && (kernel.kUsed || launched.unknown || launched.set.contains(kernel.kName));
+}
+
+/// Fills in the work-group sizes of a kernel from its launch sites, for drivers to size registers and unroll loops by
+///
+/// When every launch of a kernel spells out the same block size and no launch can be hidden, by a macro or from code openclc doesn't see,
+/// that size is required. Otherwise the size of the first constant launch, or `__launch_bounds__` as a one dimensional block, is a hint.
+/// Sizes written in the source with `reqd_work_group_size` or `work_group_size_hint` always win, and launches that contradict them
+/// or the bounds are errors, which give false.
+bool InferWorkGroupSizes(Kernel& kernel)
+{
+    const LaunchedKernelNames& launched = LaunchedKernels();
+    auto it = launched.blockSizes.find(kernel.kName);
+    llvm::ArrayRef<std::optional<WorkGroupSize>> sizes;
+    // Library kernels are launched by the applications linking them, not by the library sources
+    if (it != launched.blockSizes.end() && !BuildLibrary)
+        sizes = it->second;
+
+    for (const std::optional<WorkGroupSize>& size : sizes) {
+        if (size && kernel.kReqdWorkGroupSize && *size != *kernel.kReqdWorkGroupSize) {
+            PrintError("Kernel `{}` requires a block of {}, but is launched with {}\n", kernel.kName, WorkGroupSizeString(kernel.kReqdWorkGroupSize), WorkGroupSizeString(size));
+            return false;
+        }
+        if (size && kernel.kMaxWorkGroupSize && (*size)[0] * (*size)[1] * (*size)[2] > kernel.kMaxWorkGroupSize) {
+            PrintError("Kernel `{}` is launched with a block of {}, more than its `__launch_bounds__({})`\n", kernel.kName, WorkGroupSizeString(size), kernel.kMaxWorkGroupSize);
+            return false;
+        }
+    }
+
+    auto constant = llvm::find_if(sizes, [](const std::optional<WorkGroupSize>& size) { return size.has_value(); });
+    bool hidden = kernel.kUsed || launched.unknown;
+    if (!kernel.kReqdWorkGroupSize && !hidden && constant != sizes.end() && llvm::all_equal(sizes))
+        kernel.kReqdWorkGroupSize = *constant;
+    else if (!kernel.kReqdWorkGroupSize && !kernel.kWorkGroupSizeHint && constant != sizes.end())
+        kernel.kWorkGroupSizeHint = *constant;
+    if (!kernel.kReqdWorkGroupSize && !kernel.kWorkGroupSizeHint && kernel.kMaxWorkGroupSize)
+        kernel.kWorkGroupSizeHint = WorkGroupSize { kernel.kMaxWorkGroupSize, 1, 1 };
+    return true;
+}
+
+/// Part of a kernel's cache key for the work-group sizes `AttachWorkGroupSizes` adds to its code
+std::string WorkGroupSizeKey(const Kernel& kernel)
+{
+    return fmt::format("{} {}", WorkGroupSizeString(kernel.kReqdWorkGroupSize), WorkGroupSizeString(kernel.kWorkGroupSizeHint));
+}
+
+/// Drops the `__launch_bounds__` annotations of a kernel once `KernelFromDecl` has read them, so CodeGen doesn't emit them as global annotations
+void DropLaunchBounds(clang::FunctionDecl* FD)
+{
+    if (!FD->hasAttrs())
+        return;
+    llvm::erase_if(FD->getAttrs(), [](clang::Attr* attr) {
+        auto* annotate = llvm::dyn_cast<clang::AnnotateAttr>(attr);
+        return annotate && annotate->getAnnotation() == openclc::LaunchBoundsAnnotation;
+    });
+}
+
+/// Gives a kernel the `reqd_work_group_size` and `work_group_size_hint` metadata of its sizes, unless clang did from the attributes
+///
+/// The SPIR-V translator lowers them to the `LocalSize` and `LocalSizeHint` execution modes.
+void AttachWorkGroupSizes(llvm::Module& M, const Kernel& kernel)
+{
+    llvm::Function* F = M.getFunction(kernel.kName);
+    if (!F)
+        return;
+
+    auto attach = [&](llvm::StringRef kind, const std::optional<WorkGroupSize>& size) {
+        if (!size || F->getMetadata(kind))
+            return;
+        llvm::Type* i32 = llvm::Type::getInt32Ty(M.getContext());
+        llvm::Metadata* dims[] = {
+            llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(i32, (*size)[0])),
+            llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(i32, (*size)[1])),
+            llvm::ConstantAsMetadata::get(llvm::ConstantInt::get(i32, (*size)[2])),
+        };
+        F->setMetadata(kind, llvm::MDNode::get(M.getContext(), dims));
+    };
+    attach("reqd_work_group_size", kernel.kReqdWorkGroupSize);
+    attach("work_group_size_hint", kernel.kWorkGroupSizeHint);
+}
+
+/// Notes the kernels of a file that `IsKernelLive` drops
+void ReportDeadKernels(const std::vector<Kernel>& KernelDecls, const std::string& fileName)
+{
+    if (!Verbose)
+        return;
+    for (const Kernel& kDecl : KernelDecls) {
+        if (!kDecl.kTemplate && !IsKernelLive(kDecl))
+            Print("Debug: Dropping kernel `{}` of `{}`, it is never launched\n", kDecl.kName, fileName);
+    }
+}
+
+/// Macros expanded in each file, as offsets of the expansions in source order
+using MacroExpansions = llvm::DenseMap<clang::FileID, std::vector<std::pair<unsigned, const clang::MacroInfo*>>>;
+
+/// Records where macros are expanded, so the definitions used by device code can be part of kernel cache keys
+class MacroExpansionRecorder : public clang::PPCallbacks {
+public:
+    MacroExpansionRecorder(clang::SourceManager& SM, MacroExpansions& Expansions)
+        : SM(SM)
+        , Expansions(Expansions)
+    {
+    }
+
+    void MacroExpands(const clang::Token& MacroNameTok, const clang::MacroDefinition& MD, clang::SourceRange Range, const clang::MacroArgs* Args) override
+    {
+        const clang::MacroInfo* MI = MD.getMacroInfo();
+        if (!MI || MI->isBuiltinMacro())
+            return;
+        auto [file, offset] = SM.getDecomposedExpansionLoc(Range.getBegin());
+        Expansions[file].emplace_back(offset, MI);
+    }
+
+private:
+    clang::SourceManager& SM;
+    MacroExpansions& Expansions;
+};
+
+/// The definition of a function or program scope variable that device code refers to, or null
+clang::Decl* ReferencedDefinition(clang::ValueDecl* D)
+{
+    if (auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D))
+        return FD->getDefinition();
+    if (auto* VD = llvm::dyn_cast<clang::VarDecl>(D); VD && VD->isFileVarDecl())
+        return VD->getDefinition() ? VD->getDefinition() : VD->getActingDefinition();
+    return nullptr;
+}
+
+/// Finds the struct, union, enum and typedef definitions that declarations use, directly or through other types
+///
+/// The definitions are part of the kernel cache keys, so changing a struct in a header changes the key of every kernel using it.
+/// Definitions from the PCH are covered by the device compilation key and are left out.
+class TypeDefinitionCollector : public clang::RecursiveASTVisitor<TypeDefinitionCollector> {
+public:
+    TypeDefinitionCollector(clang::SourceManager& SM)
+        : SM(SM)
+    {
+    }
+
+    /// Definitions the declarations in `decls` use, in the order they are found
+    std::vector<clang::Decl*> collect(llvm::ArrayRef<clang::Decl*> decls)
+    {
+        Seen.clear();
+        Definitions.clear();
+        for (clang::Decl* D : decls)
+            TraverseDecl(D);
+        return std::move(Definitions);
+    }
+
+    bool VisitValueDecl(clang::ValueDecl* D)
+    {
+        addType(D->getType());
+        return true;
+    }
+
+    bool VisitExpr(clang::Expr* E)
+    {
+        addType(E->getType());
+        return true;
+    }
+
+    bool VisitTypeLoc(clang::TypeLoc TL)
+    {
+        addType(TL.getType());
+        return true;
+    }
+
+    /// Enumerators are `int` in C, so their enum isn't found through the type
+    bool VisitDeclRefExpr(clang::DeclRefExpr* E)
+    {
+        if (auto* ECD = llvm::dyn_cast<clang::EnumConstantDecl>(E->getDecl()))
+            addDefinition(llvm::cast<clang::EnumDecl>(ECD->getDeclContext()));
+        return true;
+    }
+
+private:
+    /// Adds `D` unless it was added before or comes from the PCH, returns whether it was added
+    bool addDefinition(clang::Decl* D)
+    {
+        if (D->getLocation().isInvalid() || SM.isLoadedSourceLocation(D->getLocation()) || !Seen.insert(D).second)
+            return false;
+        Definitions.push_back(D);
+        return true;
+    }
+
+    void addType(clang::QualType T)
+    {
+        while (!T.isNull()) {
+            const clang::Type* type = T.getTypePtr();
+            if (auto* TT = llvm::dyn_cast<clang::TypedefType>(type)) {
+                if (!addDefinition(TT->getDecl()))
+                    return;
+                T = TT->getDecl()->getUnderlyingType();
+            } else if (auto* TT = llvm::dyn_cast<clang::TagType>(type)) {
+                clang::TagDecl* definition = TT->getDecl()->getDefinition();
+                if (!definition || !addDefinition(definition))
+                    return;
+                if (auto* RD = llvm::dyn_cast<clang::RecordDecl>(definition)) {
+                    for (clang::FieldDecl* field : RD->fields())
+                        addType(field->getType());
+                }
+                return;
+            } else if (auto* PT = llvm::dyn_cast<clang::PointerType>(type)) {
+                T = PT->getPointeeType();
+            } else if (auto* RT = llvm::dyn_cast<clang::ReferenceType>(type)) {
+                T = RT->getPointeeType();
+            } else if (auto* AT = llvm::dyn_cast<clang::ArrayType>(type)) {
+                T = AT->getElementType();
+            } else if (auto* FT = llvm::dyn_cast<clang::FunctionProtoType>(type)) {
+                for (clang::QualType param : FT->param_types())
+                    addType(param);
+                T = FT->getReturnType();
+            } else {
+                // Sugar like `struct S` or `__typeof__`, canonical types desugar to themselves
+                clang::QualType desugared = type->getLocallyUnqualifiedSingleStepDesugaredType();
+                if (desugared.getTypePtr() == type)
+                    return;
+                T = desugared;
+            }
+        }
+    }
+
+    clang::SourceManager& SM;
+    llvm::SmallPtrSet<clang::Decl*, 8> Seen;
+    std::vector<clang::Decl*> Definitions;
+};
+
+/// Finds the device code a kernel uses: the functions it calls and the program scope variables it reads, directly or through them
+///
+/// Types need no tracking for code generation, CodeGen lowers the ones the closure uses. `hash` covers their definitions. Host code no kernel reaches is never part of a closure, so its
+/// OpenCL C errors stay hidden and it isn't code generated.
+class DeviceClosureCollector : public clang::RecursiveASTVisitor<DeviceClosureCollector> {
+public:
+    DeviceClosureCollector(clang::ASTContext& Context, const MacroExpansions& Expansions, llvm::function_ref<bool(clang::Decl*)> IsDeviceLibraryDecl)
+        : Context(Context)
+        , Expansions(Expansions)
+        , IsDeviceLibraryDecl(IsDeviceLibraryDecl)
+    {
+    }
+
+    /// Definitions the kernel uses, in the order they are found. Device library declarations are always emitted and are left out.
+    std::vector<clang::Decl*> collect(clang::FunctionDecl* Kernel)
+    {
+        Seen.clear();
+        Closure.clear();
+        Worklist = { Kernel };
+        Seen.insert(Kernel);
+        while (!Worklist.empty()) {
+            clang::Decl* D = Worklist.pop_back_val();
+            if (auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D))
+                TraverseStmt(FD->getBody());
+            else if (auto* VD = llvm::dyn_cast<clang::VarDecl>(D))
+                TraverseStmt(VD->getInit());
+        }
+        return std::move(Closure);
+    }
+
+    bool VisitDeclRefExpr(clang::DeclRefExpr* E)
+    {
+        clang::Decl* definition = ReferencedDefinition(E->getDecl());
+        if (!definition || IsDeviceLibraryDecl(definition) || !Seen.insert(definition).second)
+            return true;
+
+        Worklist.push_back(definition);
+        Closure.push_back(definition);
+        return true;
+    }
+
+    /// Hash of the source of `Kernel` and `closure`, of the type definitions they use and of the definitions of the macros expanded in them
+    std::string hash(clang::FunctionDecl* Kernel, llvm::ArrayRef<clang::Decl*> closure)
+    {
+        clang::SourceManager& SM = Context.getSourceManager();
+        std::vector<llvm::StringRef> parts;
+        std::deque<std::string> printedDecls;
+        llvm::SetVector<const clang::MacroInfo*> macros;
+        std::vector<clang::Decl*> decls = { Kernel };
+        llvm::append_range(decls, closure);
+        llvm::append_range(decls, TypeDefinitionCollector(SM).collect(decls));
+        for (clang::Decl* D : decls) {
+            if (D->getBeginLoc().isInvalid() || D->getEndLoc().isInvalid())
+                continue;
+            clang::SourceLocation endLoc = SM.getExpansionLoc(D->getEndLoc());
+            auto [file, begin] = SM.getDecomposedLoc(SM.getExpansionLoc(D->getBeginLoc()));
+            auto [endFile, end] = SM.getDecomposedLoc(endLoc);
+            if (file != endFile) {
+                // e.g. a body finished by an #include. Printed, the declaration has its macros expanded already.
+                llvm::raw_string_ostream os(printedDecls.emplace_back());
+                D->print(os, Context.getPrintingPolicy());
+                parts.push_back(os.str());
+                continue;
+            }
+            end += clang::Lexer::MeasureTokenLength(endLoc, SM, Context.getLangOpts());
+            parts.push_back(SM.getBufferData(file).slice(begin, end));
+
+            auto expansions = Expansions.find(file);
+            if (expansions == Expansions.end())
+                continue;
+            auto it = llvm::lower_bound(expansions->second, std::make_pair(begin, (const clang::MacroInfo*)nullptr));
+            for (; it != expansions->second.end() && it->first < end; ++it)
+                macros.insert(it->second);
+        }
+
+        // Macros from the PCH are covered by the device compilation key
+        for (const clang::MacroInfo* MI : macros) {
+            if (MI->getDefinitionLoc().isValid() && !SM.isLoadedSourceLocation(MI->getDefinitionLoc()))
+                parts.push_back(clang::Lexer::getSourceText(clang::CharSourceRange::getTokenRange(MI->getDefinitionLoc(), MI->getDefinitionEndLoc()), SM, Context.getLangOpts()));
+        }
+        return openclc::SpvCache::hash(parts);
+    }
+
+private:
+    clang::ASTContext& Context;
+    const MacroExpansions& Expansions;
+    llvm::function_ref<bool(clang::Decl*)> IsDeviceLibraryDecl;
+    llvm::SmallPtrSet<clang::Decl*, 8> Seen;
+    llvm::SmallVector<clang::Decl*> Worklist;
+    std::vector<clang::Decl*> Closure;
+};
+
+/// Finds whether a kernel or the device code it uses refers to a program scope variable that isn't constant
+///
+/// Such variables are shared by all kernels of a program, so the kernels using them can't be compiled to modules of their own.
+class WritableGlobalFinder : public clang::RecursiveASTVisitor<WritableGlobalFinder> {
+public:
+    bool find(clang::FunctionDecl* Kernel, llvm::ArrayRef<clang::Decl*> closure)
+    {
+        // Visitors stop the traversal by returning false
+        if (!TraverseStmt(Kernel->getBody()))
+            return true;
+        for (clang::Decl* D : closure) {
+            if (auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D); FD && !TraverseStmt(FD->getBody()))
+                return true;
+            if (auto* VD = llvm::dyn_cast<clang::VarDecl>(D); VD && !TraverseStmt(VD->getInit()))
+                return true;
+        }
+        return false;
+    }
+
+    bool VisitDeclRefExpr(clang::DeclRefExpr* E)
+    {
+        auto* VD = llvm::dyn_cast<clang::VarDecl>(E->getDecl());
+        return !VD || !IsWritableGlobal(VD);
+    }
+
+    /// `static` variables of functions are program scope variables too
+    bool VisitVarDecl(clang::VarDecl* VD) { return !IsWritableGlobal(VD); }
+
+private:
+    static bool IsWritableGlobal(const clang::VarDecl* VD)
+    {
+        clang::LangAS addressSpace = VD->getType().getAddressSpace();
+        return VD->hasGlobalStorage() && !VD->getType().isConstQualified() && addressSpace != clang::LangAS::opencl_constant && addressSpace != clang::LangAS::opencl_local;
+    }
+};
+
+/// Finds the definitions host code refers to, which stay in the host source even if kernels use them too
+class HostReferenceCollector : public clang::RecursiveASTVisitor<HostReferenceCollector> {
+public:
+    bool VisitDeclRefExpr(clang::DeclRefExpr* E)
+    {
+        if (clang::Decl* definition = ReferencedDefinition(E->getDecl()))
+            Referenced.insert(definition);
+        return true;
+    }
+
+    llvm::SmallPtrSet<clang::Decl*, 32> Referenced;
+};
+
+/// Finds the `spec_const` declarations in a kernel and the functions it calls, `std::nullopt` if one can't be set from the host
+class SpecConstantCollector : public clang::RecursiveASTVisitor<SpecConstantCollector> {
+public:
+    SpecConstantCollector(clang::ASTContext& Context)
+        : Context(Context)
+    {
+    }
+
+    std::optional<std::vector<SpecConstant>> collect(clang::FunctionDecl* Kernel, llvm::ArrayRef<clang::Decl*> closure)
+    {
+        KernelName = Kernel->getNameAsString();
+        SpecConsts.clear();
+        // Visitors stop the traversal by returning false
+        bool valid = TraverseStmt(Kernel->getBody());
+        for (clang::Decl* D : closure) {
+            if (auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D); FD && valid)
+                valid = TraverseStmt(FD->getBody());
+        }
+        if (!valid)
+            return std::nullopt;
+        return std::move(SpecConsts);
+    }
+
+    bool VisitVarDecl(clang::VarDecl* VD)
+    {
+        auto* call = llvm::dyn_cast_or_null<clang::CallExpr>(VD->getInit() ? VD->getInit()->IgnoreParenImpCasts() : nullptr);
+        clang::FunctionDecl* callee = call ? call->getDirectCallee() : nullptr;
+        if (!callee || !callee->getIdentifier() || callee->getName() != "__spirv_SpecConstant" || call->getNumArgs() != 2)
+            return true;
+
+        std::string name = VD->getNameAsString();
+        std::optional<llvm::APSInt> id = call->getArg(0)->getIntegerConstantExpr(Context);
+        if (!id || id->isNegative()) {
+            PrintError("Specialization constant `{}` in kernel `{}` needs a constant, non negative id\n", name, KernelName);
+            return false;
+        }
+        if (!call->getArg(1)->isEvaluatable(Context)) {
+            PrintError("Specialization constant `{}` in kernel `{}` needs a constant default value\n", name, KernelName);
+            return false;
+        }
+
+        const auto* type = call->getType()->getAs<clang::BuiltinType>();
+        const char* hostType = type ? HostType(type->getKind()) : nullptr;
+        if (!hostType) {
+            PrintError("Specialization constant `{}` in kernel `{}` has type `{}`, only bool, integer, float and double are supported\n",
+                name, KernelName, call->getType().getAsString());
+            return false;
+        }
+
+        auto previous = llvm::find_if(SpecConsts, [&](const SpecConstant& sc) { return sc.name == name; });
+        if (previous != SpecConsts.end()) {
+            if (previous->id != id->getZExtValue()) {
+                PrintError("Specialization constant `{}` is declared with ids {} and {} in kernel `{}`\n", name, previous->id, id->getZExtValue(), KernelName);
+                return false;
+            }
+            return true;
+        }
+
+        // OpenCL takes boolean specialization constants as a single byte
+        SpecConsts.push_back(SpecConstant {
+            .name = name,
+            .id = static_cast<unsigned>(id->getZExtValue()),
+            .hostType = hostType,
+            .storageType = type->getKind() == clang::BuiltinType::Bool ? "cl_uchar" : hostType,
+        });
+        return true;
+    }
+
+private:
+    static const char* HostType(clang::BuiltinType::Kind kind)
+    {
+        switch (kind) {
+        case clang::BuiltinType::Bool:
+            return "bool";
+        case clang::BuiltinType::Char_S:
+        case clang::BuiltinType::SChar:
+            return "cl_char";
+        case clang::BuiltinType::Char_U:
+        case clang::BuiltinType::UChar:
+            return "cl_uchar";
+        case clang::BuiltinType::Short:
+            return "cl_short";
+        case clang::BuiltinType::UShort:
+            return "cl_ushort";
+        case clang::BuiltinType::Int:
+            return "cl_int";
+        case clang::BuiltinType::UInt:
+            return "cl_uint";
+        case clang::BuiltinType::Long:
+            return "cl_long";
+        case clang::BuiltinType::ULong:
+            return "cl_ulong";
+        case clang::BuiltinType::Float:
+            return "cl_float";
+        case clang::BuiltinType::Double:
+            return "cl_double";
+        default:
+            return nullptr;
+        }
+    }
+
+    clang::ASTContext& Context;
+    std::string KernelName;
+    std::vector<SpecConstant> SpecConsts;
+};
+
+/// Collects kernels from a parse of a whole host + device file and feeds only device code to CodeGen
+///
+/// Host code is parsed as OpenCL C too, so it is full of errors. Those are told apart from kernel errors by location once the
+/// kernels are known, and CodeGen reports to its own `DiagnosticsEngine` so host errors can't stop the device module from being emitted.
+class DeviceFrontendConsumer : public clang::ASTConsumer {
+public:
+    DeviceFrontendConsumer(clang::CompilerInstance& Compiler, llvm::LLVMContext& Ctx, llvm::StringRef ModuleName, llvm::raw_ostream& DiagOS,
+        const MacroExpansions& Expansions, const llvm::StringSet<>& TemplateKernels, std::size_t SourceSize,
+        std::vector<Kernel>& KernelDecls, std::unique_ptr<llvm::Module>& Module, llvm::function_ref<bool(const Kernel&)> ShouldEmit)
+        : Compiler(Compiler)
+        , Expansions(Expansions)
+        , TemplateKernels(TemplateKernels)
+        , SourceSize(SourceSize)
+        , KernelDecls(KernelDecls)
+        , Module(Module)
+        , ShouldEmit(ShouldEmit)
+    {
+        clang::DiagnosticsEngine& diags = Compiler.getDiagnostics();
+        CodeGenDiags = new clang::DiagnosticsEngine(diags.getDiagnosticIDs(), &diags.getDiagnosticOptions(),
+            new clang::TextDiagnosticPrinter(DiagOS, &diags.getDiagnosticOptions()), /*ShouldOwnClient=*/true);
+        CodeGenDiags->setSourceManager(&Compiler.getSourceManager());
+
+        CodeGen.reset(clang::CreateLLVMCodeGen(*CodeGenDiags, ModuleName, &Compiler.getVirtualFileSystem(),
+            Compiler.getHeaderSearchOpts(), Compiler.getPreprocessorOpts(), Compiler.getCodeGenOpts(), Ctx));
+
+        // A prelude that can't be found is reported by `DevicePreludeHeaders`, and then matches no file here
+        llvm::sys::fs::UniqueID preludeID;
+        if (!DevicePrelude.empty() && !llvm::sys::fs::getUniqueID(std::string(DevicePrelude), preludeID))
+            PreludeID = preludeID;
+    }
+
+    void Initialize(clang::ASTContext& Context) override
+    {
+        CodeGenDiags->getClient()->BeginSourceFile(Context.getLangOpts(), &Compiler.getPreprocessor());
+        CodeGen->Initialize(Context);
+    }
+
+    bool HandleTopLevelDecl(clang::DeclGroupRef DG) override
+    {
+        for (clang::Decl* D : DG) {
+            auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D);
+            if (FD && IsKernelDefinition(FD)) {
+                KernelFunctionDecls.push_back(FD);
+            } else if (auto* FTD = llvm::dyn_cast<clang::FunctionTemplateDecl>(D); FTD && IsTemplateKernelDefinition(FTD)) {
+                KernelFunctionDecls.push_back(FTD->getTemplatedDecl());
+            } else if (auto* TAD = llvm::dyn_cast<clang::TypeAliasDecl>(D); TAD && TAD->getName().starts_with(InstancePrefix)) {
+                InstanceAliases.push_back(TAD);
+            } else if (IsDeviceLibraryDecl(D)) {
+                CodeGen->HandleTopLevelDecl(clang::DeclGroupRef(D));
+            } else if (Compiler.getSourceManager().isInMainFile(D->getLocation()) && !(FD && FD->isTemplateInstantiation())) {
+                MainFileDecls.push_back(D);
+                // `int a = 0, b = 1;` can't lose one of its variables to the device
+                if (!DG.isSingleDecl())
+                    GroupedDecls.insert(D);
+            }
+        }
+        return true;
+    }
+
+    void HandleTranslationUnit(clang::ASTContext& Context) override
+    {
+        clang::SourceManager& SM = Compiler.getSourceManager();
+        DeviceClosureCollector closures(Context, Expansions, [&](clang::Decl* D) { return IsDeviceLibraryDecl(D); });
+        // Template kernels are followed by their instances, which take their place in the host source
+        std::vector<clang::FunctionDecl*> kernelFunctions;
+        std::vector<std::vector<clang::Decl*>> kernelClosures;
+        llvm::SmallPtrSet<clang::Decl*, 32> deviceDecls;
+        auto addKernel = [&](clang::FunctionDecl* FD, std::optional<Kernel> kernel) {
+            if (!kernel || (!kernel->kTemplate && !InferWorkGroupSizes(*kernel)))
+                return false;
+            DropLaunchBounds(FD);
+            kernelFunctions.push_back(FD);
+            kernelClosures.push_back(kernel->kTemplate ? std::vector<clang::Decl*>() : closures.collect(FD));
+            kernel->kSharesGlobals = !kernel->kTemplate && WritableGlobalFinder().find(FD, kernelClosures.back());
+            kernel->sourceHash = openclc::SpvCache::hash({ kernel->kName, WorkGroupSizeKey(*kernel), closures.hash(FD, kernelClosures.back()) });
+            deviceDecls.insert(kernelClosures.back().begin(), kernelClosures.back().end());
+            KernelDecls.push_back(std::move(*kernel));
+            return true;
+        };
+        // Kernels that can't be compiled leave `Module` null, like errors in device code
+        for (clang::FunctionDecl* FD : KernelFunctionDecls) {
+            clang::FunctionTemplateDecl* FTD = FD->getDescribedFunctionTemplate();
+            if (!FTD) {
+                if (!addKernel(FD, KernelFromDecl(Context, FD)))
+                    return;
+                continue;
+            }
+
+            std::optional<Kernel> pattern = KernelFromDecl(Context, FD);
+            if (!pattern)
+                return;
+            pattern->beginSourceOffset = SM.getFileOffset(SM.getExpansionLoc(FTD->getBeginLoc()));
+            pattern->kTemplate = true;
+            addKernel(FD, pattern);
+            for (clang::TypeAliasDecl* TAD : InstanceAliases) {
+                clang::FunctionDecl* instance = InstanceOf(TAD);
+                if (!instance || instance->getPrimaryTemplate() != FTD)
+                    continue;
+                Compiler.getSema().InstantiateFunctionDefinition(TAD->getLocation(), instance, /*Recursive=*/true, /*DefinitionRequired=*/true, /*AtEndOfTU=*/true);
+                if (!instance->hasBody())
+                    continue;
+
+                std::optional<Kernel> kernel = KernelFromDecl(Context, instance);
+                if (!kernel)
+                    return;
+                kernel->kName = TAD->getName().drop_front(InstancePrefix.size()).str();
+                kernel->beginSourceOffset = pattern->beginSourceOffset;
+                kernel->endSourceOffset = pattern->endSourceOffset;
+                if (!addKernel(instance, std::move(kernel)))
+                    return;
+            }
+        }
+
+        // Definitions only kernels use leave the host source with them
+        HostReferenceCollector host;
+        for (clang::Decl* D : MainFileDecls) {
+            if (!deviceDecls.contains(D))
+                host.TraverseDecl(D);
+        }
+        for (std::size_t i = 0; i < KernelDecls.size(); i++) {
+            for (clang::Decl* D : kernelClosures[i]) {
+                if (!host.Referenced.contains(D)) {
+                    if (std::optional<std::pair<std::size_t, std::size_t>> range = DeviceOnlyRange(D))
+                        KernelDecls[i].deviceOnlyRanges.push_back(*range);
+                }
+            }
+        }
+
+        // Only diagnostics from kernels, the device code they use and the device prelude concern the device frontend
+        std::vector<clang::SourceRange> deviceRanges;
+        for (clang::FunctionDecl* FD : KernelFunctionDecls)
+            deviceRanges.emplace_back(SM.getExpansionLoc(FD->getBeginLoc()), SM.getExpansionLoc(FD->getEndLoc()));
+        // Template instances are declared after the end of the file
+        if (!InstanceAliases.empty())
+            deviceRanges.emplace_back(SM.getLocForStartOfFile(SM.getMainFileID()).getLocWithOffset(SourceSize), SM.getLocForEndOfFile(SM.getMainFileID()));
+        for (clang::Decl* D : deviceDecls)
+            deviceRanges.emplace_back(SM.getExpansionLoc(D->getBeginLoc()), SM.getExpansionLoc(D->getEndLoc()));
+        auto* printer = static_cast<clang::DeviceFrontendDiagnosticPrinter*>(Compiler.getDiagnostics().getClient());
+        printer->emitDeferred([&](const clang::StoredDiagnostic& diag) {
+            if (!diag.getLocation().isValid())
+                return true;
+            clang::SourceLocation loc = SM.getExpansionLoc(diag.getLocation());
+            if (IsPreludeLocation(loc))
+                return true;
+            return llvm::any_of(deviceRanges, [&](clang::SourceRange range) {
+                return SM.isPointWithin(loc, range.getBegin(), range.getEnd());
+            });
+        });
+        if (printer->getNumErrors() > 0)
+            return;
+
+        // CodeGen only defines what it is handed, anything else the kernels use would be left an unresolved import
+        SpecConstantCollector specConsts(Context);
+        llvm::SmallPtrSet<clang::Decl*, 32> emitted;
+        std::vector<std::pair<std::string, std::string>> instanceFunctions;
+        for (std::size_t i = 0; i < kernelFunctions.size(); i++) {
+            if (KernelDecls[i].kTemplate) {
+                ShouldEmit(KernelDecls[i]);
+                continue;
+            }
+            std::optional<std::vector<SpecConstant>> kernelSpecConsts = specConsts.collect(kernelFunctions[i], kernelClosures[i]);
+            if (!kernelSpecConsts)
+                return;
+            KernelDecls[i].kSpecConsts = std::move(*kernelSpecConsts);
+            if (!ShouldEmit(KernelDecls[i]))
+                continue;
+            // Helpers with internal linkage are deferred to `HandleTranslationUnit`, and counted for the file instead
+            openclc::TimeRegion region("Kernel codegen", CodeGen->GetModule()->getModuleIdentifier(), KernelDecls[i].kName);
+            for (clang::Decl* D : kernelClosures[i]) {
+                if (emitted.insert(D).second)
+                    CodeGen->HandleTopLevelDecl(clang::DeclGroupRef(D));
+            }
+            if (!emitted.insert(kernelFunctions[i]).second)
+                continue;
+            CodeGen->HandleTopLevelDecl(clang::DeclGroupRef(kernelFunctions[i]));
+
+            // Instances are emitted on first use like any implicit instantiation, their kernel is the only use
+            if (kernelFunctions[i]->isTemplateInstantiation()) {
+                clang::GlobalDecl GD(kernelFunctions[i]);
+                CodeGen->GetAddrOfGlobal(GD, /*isForDefinition=*/false);
+                instanceFunctions.emplace_back(KernelDecls[i].kName, CodeGen->GetMangledName(GD).str());
+            }
+        }
+        CodeGen->HandleTranslationUnit(Context);
+        CodeGenDiags->getClient()->EndSourceFile();
+
+        if (CodeGenDiags->hasErrorOccurred())
+            return;
+        Module.reset(CodeGen->ReleaseModule());
+        for (const auto& [name, mangledName] : instanceFunctions)
+            EmitInstanceKernel(*Module, name, mangledName);
+        for (const Kernel& kernel : KernelDecls) {
+            if (!kernel.kTemplate)
+                AttachWorkGroupSizes(*Module, kernel);
+        }
+    }
+
+private:
+    /// Prefix of the aliases `DeviceFrontend` declares template instances with, followed by the instance name
+    static constexpr llvm::StringLiteral InstancePrefix = "__openclc_instance_";
+
+    /// The template specialization named by `using __openclc_instance_<name> = decltype(k<args>);`
+    static clang::FunctionDecl* InstanceOf(clang::TypeAliasDecl* TAD)
+    {
+        const auto* type = TAD->getUnderlyingType()->getAs<clang::DecltypeType>();
+        auto* ref = type ? llvm::dyn_cast<clang::DeclRefExpr>(type->getUnderlyingExpr()->IgnoreParens()) : nullptr;
+        return ref ? llvm::dyn_cast<clang::FunctionDecl>(ref->getDecl()) : nullptr;
+    }
+
+    /// Defines the kernel `name` that calls the template instance `mangledName` with its arguments, for the inliner to fold
+    static void EmitInstanceKernel(llvm::Module& M, const std::string& name, const std::string& mangledName)
+    {
+        llvm::Function* instance = M.getFunction(mangledName);
+        if (!instance || instance->isDeclaration())
+            return;
+
+        llvm::Function* kernel = llvm::Function::Create(instance->getFunctionType(), llvm::GlobalValue::ExternalLinkage, name, M);
+        kernel->setCallingConv(llvm::CallingConv::SPIR_KERNEL);
+        kernel->setAttributes(instance->getAttributes());
+
+        llvm::IRBuilder<> builder(llvm::BasicBlock::Create(M.getContext(), "entry", kernel));
+        std::vector<llvm::Value*> args;
+        for (llvm::Argument& arg : kernel->args())
+            args.push_back(&arg);
+        builder.CreateCall(instance, args)->setCallingConv(instance->getCallingConv());
+        builder.CreateRetVoid();
+    }
+
+    bool IsKernelDefinition(clang::FunctionDecl* FD)
+    {
+        clang::FullSourceLoc location = FD->getASTContext().getFullLoc(FD->getBeginLoc());
+        return location.isValid() && !location.isInSystemHeader() && !FD->isFromASTFile()
+            && Compiler.getSourceManager().isInMainFile(FD->getBeginLoc())
+            && FD->doesThisDeclarationHaveABody()
+            && FD->getFunctionType()->getCallConv() == clang::CallingConv::CC_OpenCLKernel;
+    }
+
+    /// Function templates `BlankTemplateKernelKeywords` found written as kernels
+    bool IsTemplateKernelDefinition(clang::FunctionTemplateDecl* FTD)
+    {
+        return TemplateKernels.contains(FTD->getName()) && Compiler.getSourceManager().isInMainFile(FTD->getBeginLoc())
+            && FTD->getTemplatedDecl()->doesThisDeclarationHaveABody();
+    }
+
+    /// Declarations from `opencl-c.h`, `openclc-device.h` and the device prelude, as opposed to host code
+    bool IsDeviceLibraryDecl(clang::Decl* D)
+    {
+        if (D->isFromASTFile())
+            return true;
+
+        clang::SourceManager& SM = Compiler.getSourceManager();
+        clang::SourceLocation loc = SM.getExpansionLoc(D->getLocation());
+        if (!loc.isValid() || SM.isInMainFile(loc))
+            return false;
+
+        llvm::StringRef file = SM.getFilename(loc);
+        return file.ends_with("opencl-c.h") || file.ends_with("openclc-device.h") || IsPreludeLocation(loc);
+    }
+
+    /// Bytes of the main file to cut from the host source for a definition only device code uses, through the `;` after variables
+    ///
+    /// Kernels are cut on their own. Definitions written by macros or sharing a declaration with others stay in the host source.
+    std::optional<std::pair<std::size_t, std::size_t>> DeviceOnlyRange(clang::Decl* D)
+    {
+        clang::SourceManager& SM = Compiler.getSourceManager();
+        auto* FD = llvm::dyn_cast<clang::FunctionDecl>(D);
+        if ((FD && FD->getFunctionType()->getCallConv() == clang::CallingConv::CC_OpenCLKernel) || GroupedDecls.contains(D)
+            || !D->getBeginLoc().isFileID() || !D->getEndLoc().isFileID() || !SM.isInMainFile(D->getBeginLoc()))
+            return std::nullopt;
+
+        clang::SourceLocation end = D->getEndLoc();
+        if (!FD) {
+            std::optional<clang::Token> semi = clang::Lexer::findNextToken(end, SM, Compiler.getLangOpts());
+            if (!semi || !semi->is(clang::tok::semi))
+                return std::nullopt;
+            end = semi->getLocation();
+        } else if (!FD->doesThisDeclarationHaveABody()) {
+            return std::nullopt;
+        }
+        return std::make_pair(std::size_t(SM.getFileOffset(D->getBeginLoc())), std::size_t(SM.getFileOffset(end)));
+    }
+
+    bool IsPreludeLocation(clang::SourceLocation loc)
+    {
+        if (!PreludeID || !loc.isFileID())
+            return false;
+
+        clang::OptionalFileEntryRef file = Compiler.getSourceManager().getFileEntryRefForID(Compiler.getSourceManager().getFileID(loc));
+        return file && file->getUniqueID() == *PreludeID;
+    }
+
+    clang::CompilerInstance& Compiler;
+    const MacroExpansions& Expansions;
+    const llvm::StringSet<>& TemplateKernels;
+    /// Size of the input, `DeviceFrontend` declares template instances past it
+    std::size_t SourceSize;
+    std::vector<Kernel>& KernelDecls;
+    std::unique_ptr<llvm::Module>& Module;
+    llvm::function_ref<bool(const Kernel&)> ShouldEmit;
+    /// File of `--device-prelude`, resolved once rather than for every declaration and diagnostic
+    std::optional<llvm::sys::fs::UniqueID> PreludeID;
+
+    llvm::IntrusiveRefCntPtr<clang::DiagnosticsEngine> CodeGenDiags;
+    std::unique_ptr<clang::CodeGenerator> CodeGen;
+    std::vector<clang::FunctionDecl*> KernelFunctionDecls;
+    std::vector<clang::TypeAliasDecl*> InstanceAliases;
+    /// Top level declarations of the main file that aren't kernels, host code or device code the kernels use
+    std::vector<clang::Decl*> MainFileDecls;
+    llvm::SmallPtrSet<clang::Decl*, 8> GroupedDecls;
+};
+
+class DeviceFrontendAction : public clang::ASTFrontendAction {
+public:
+    DeviceFrontendAction(llvm::LLVMContext& Ctx, llvm::raw_ostream& DiagOS, const llvm::StringSet<>& TemplateKernels, std::size_t SourceSize,
+        std::vector<Kernel>& KernelDecls, std::unique_ptr<llvm::Module>& Module, llvm::function_ref<bool(const Kernel&)> ShouldEmit)
+        : Ctx(Ctx)
+        , DiagOS(DiagOS)
+        , TemplateKernels(TemplateKernels)
+        , SourceSize(SourceSize)
+        , KernelDecls(KernelDecls)
+        , Module(Module)
+        , ShouldEmit(ShouldEmit)
+    {
+    }
+
+    virtual bool BeginSourceFileAction(clang::CompilerInstance& Compiler) override
+    {
+        // Host headers aren't available to the device frontend, skip them silently
+        Compiler.getPreprocessor().SetSuppressIncludeNotFoundError(true);
+        Compiler.getPreprocessor().addPPCallbacks(std::make_unique<MacroExpansionRecorder>(Compiler.getSourceManager(), Expansions));
+        return true;
+    }
+
+    virtual std::unique_ptr<clang::ASTConsumer> CreateASTConsumer(
+        clang::CompilerInstance& Compiler, llvm::StringRef InFile) override
+    {
+        return std::make_unique<DeviceFrontendConsumer>(Compiler, Ctx, InFile, DiagOS, Expansions, TemplateKernels, SourceSize, KernelDecls, Module, ShouldEmit);
+    }
+
+private:
+    llvm::LLVMContext& Ctx;
+    llvm::raw_ostream& DiagOS;
+    const llvm::StringSet<>& TemplateKernels;
+    std::size_t SourceSize;
+    MacroExpansions Expansions;
+    std::vector<Kernel>& KernelDecls;
+    std::unique_ptr<llvm::Module>& Module;
+    llvm::function_ref<bool(const Kernel&)> ShouldEmit;
+};
+
+/// Finds the template kernels of a `.clpp` source, which C++ for OpenCL rejects, and returns their names
+///
+/// Their `kernel` keyword is overwritten with spaces in `deviceSource`, a copy of `sources`, so they parse as function templates
+/// and every offset still matches the input.
+llvm::StringSet<> BlankTemplateKernelKeywords(llvm::StringRef sources, std::string& deviceSource)
+{
+    clang::LangOptions langOpts;
+    langOpts.CPlusPlus = true;
+    clang::Lexer lexer(clang::SourceLocation(), langOpts, sources.data(), sources.data(), sources.data() + sources.size());
+
+    clang::Token tok;
+    std::size_t begin = 0;
+    auto lex = [&] {
+        lexer.LexFromRawLexer(tok);
+        begin = lexer.getBufferLocation() - sources.data() - tok.getLength();
+        return tok.isNot(clang::tok::eof);
+    };
+    auto isIdentifier = [&](llvm::StringRef name) { return tok.is(clang::tok::raw_identifier) && tok.getRawIdentifier() == name; };
+
+    llvm::StringSet<> names;
+    while (lex()) {
+        if (!isIdentifier("template") || !lex() || tok.isNot(clang::tok::less))
+            continue;
+        for (int depth = 1; depth > 0 && lex();)
+            depth += tok.is(clang::tok::less) ? 1 : tok.is(clang::tok::greater) ? -1 : tok.is(clang::tok::greatergreater) ? -2 : 0;
+
+        // The declaration up to its parameter list, the name is the last identifier before it
+        std::optional<std::pair<std::size_t, std::size_t>> keyword;
+        llvm::StringRef name;
+        while (lex() && !tok.isOneOf(clang::tok::l_paren, clang::tok::l_brace, clang::tok::r_brace, clang::tok::semi)) {
+            if (isIdentifier("kernel") || isIdentifier("__kernel")) {
+                keyword = std::make_pair(begin, std::size_t(tok.getLength()));
+            } else if (isIdentifier("__attribute__")) {
+                int depth = 0;
+                while (lex()) {
+                    depth += tok.is(clang::tok::l_paren) ? 1 : tok.is(clang::tok::r_paren) ? -1 : 0;
+                    if (depth == 0)
+                        break;
+                }
+            } else if (tok.is(clang::tok::raw_identifier)) {
+                name = tok.getRawIdentifier();
+            }
+        }
+        if (keyword && tok.is(clang::tok::l_paren) && !name.empty()) {
+            deviceSource.replace(keyword->first, keyword->second, keyword->second, ' ');
+            names.insert(name);
+        }
+    }
+    return names;
+}
+
+/// Parses a host + device source file once, populating `KernelDecls` with its kernels and returning their LLVM module
+///
+/// Only kernels accepted by `shouldEmit` are code generated, the rest are still added to `KernelDecls`. Template kernels of `.clpp`
+/// files are added too, each followed by its launched instances.
+/// The headers the file includes are appended to `dependencies`.
+/// Compilation errors are reported with helpful messages and give a null module.
+///
+/// Credit: https://github.com/google/clspv/blob/2776a72da17dfffdd1680eeaff26a8bebdaa60f7/lib/Compiler.cpp#L1079
+std::unique_ptr<llvm::Module> DeviceFrontend(
+    llvm::LLVMContext& ctx,
+    std::vector<Kernel>& KernelDecls,
+    llvm::StringRef fileContents,
+    const std::string& fileName,
+    std::vector<std::string>& dependencies,
+    llvm::function_ref<bool(const Kernel&)> shouldEmit = [](const Kernel&) { return true; })
+{
+    assert(fileContents.size() > 0 && "Empty fileContents passed to `DeviceFrontend`.");
+    openclc::TimeRegion region("Device frontend", fileName);
+
+    clang::CompilerInstance clangInstance;
+
+    // C++ for OpenCL has no template kernels. They are parsed as function templates, and the instances the inputs launch
+    // are named after the end of the file for the frontend to instantiate and wrap in kernels.
+    std::string deviceSource;
+    llvm::StringSet<> templateKernels;
+    if (IsCXXInput(fileName)) {
+        deviceSource = fileContents.str();
+        templateKernels = BlankTemplateKernelKeywords(fileContents, deviceSource);
+        deviceSource.push_back('\n');
+        for (const TemplateInstance& instance : LaunchedKernels().instances) {
+            if (templateKernels.contains(instance.templateName))
+                deviceSource += fmt::format("using __openclc_instance_{} = decltype({}<{}>);\n", instance.name, instance.templateName, instance.templateArgs);
+        }
+    }
+
+    llvm::MemoryBufferRef membufref = llvm::MemoryBufferRef(IsCXXInput(fileName) ? llvm::StringRef(deviceSource) : fileContents, llvm::StringRef(fileName));
+    clang::FrontendInputFile clSrcFile(membufref, clang::InputKind(IsCXXInput(fileName) ? clang::Language::OpenCLCXX : clang::Language::OpenCL));
+
+    // warnings to disable
+    clangInstance.getDiagnosticOpts().Warnings.push_back("no-unsafe-buffer-usage");
+    for (const std::string& warning : Warnings) {
+        clangInstance.getDiagnosticOpts().Warnings.push_back(warning);
+    }
+
+    // diagnostics, deferred until the kernels are known so host code errors can be dropped
+    std::string log;
+    llvm::raw_string_ostream diagnosticsStream(log);
+    auto* printer = new clang::DeviceFrontendDiagnosticPrinter(diagnosticsStream, &clangInstance.getDiagnosticOpts());
+    printer->setDeferred(true);
+    clangInstance.createDiagnostics(printer, true);
+    clangInstance.getDiagnostics().setEnableAllWarnings(Wall);
+    clangInstance.getDiagnostics().setWarningsAsErrors(Werror);
+    clangInstance.getDiagnostics().setErrorLimit(0);
+
+    // input
+    clangInstance.getFrontendOpts().Inputs.push_back(clSrcFile);
+
+    ConfigureDeviceCompilerInstance(clangInstance, fileName);
+
+    clangInstance.getHeaderSearchOpts().UseStandardSystemIncludes = false;
+    clangInstance.getHeaderSearchOpts().UseStandardCXXIncludes = false;
+
+    // builtin and prelude headers
+    if (NoPCH) {
+        clangInstance.getPreprocessorOpts().Includes.push_back("opencl-c.h");
+        clangInstance.getPreprocessorOpts().Includes.push_back("openclc-device.h");
+        if (!DevicePrelude.empty())
+            clangInstance.getPreprocessorOpts().Includes.push_back(std::filesystem::absolute(std::string(DevicePrelude)).string());
+    } else {
+        clangInstance.getPreprocessorOpts().ImplicitPCHInclude = DevicePCH(fileName);
+        if (clangInstance.getPreprocessorOpts().ImplicitPCHInclude.empty())
+            return nullptr;
+    }
+
+    auto dependencyCollector = std::make_shared<DeviceDependencyCollector>();
+    clangInstance.addDependencyCollector(dependencyCollector);
+
+    std::unique_ptr<llvm::Module> mod;
+    DeviceFrontendAction action(ctx, diagnosticsStream, templateKernels, fileContents.size(), KernelDecls, mod, shouldEmit);
+    clangInstance.ExecuteAction(action);
+
+    llvm::ArrayRef<std::string> headers = dependencyCollector->getDependencies();
+    dependencies.insert(dependencies.end(), headers.begin(), headers.end());
+    if (!NoPCH) // hidden behind the PCH
+        llvm::append_range(dependencies, DevicePreludeHeaders(fileName).paths);
+
+    clang::DiagnosticConsumer* const consumer = clangInstance.getDiagnostics().getClient();
+    consumer->finish();
+
+    if ((consumer->getNumWarnings() > 0) || (consumer->getNumErrors() > 0) || !mod)
+        PrintError("{}", log);
+    if (consumer->getNumErrors() > 0 || !mod)
+        return nullptr;
+
+    // Host code may only launch library kernels, or with `-c` kernels of other objects
+    if (KernelDecls.size() == 0 && LoadedDeviceLibraries().kernels.empty() && !CompileOnly) {
+        PrintError("openclc error (fatal): No device code found!\n");
+        return nullptr;
+    }
+
+    return mod;
+}
+
+/// The specialization constants of a file's live kernels, one per id in order of first use, `std::nullopt` if an id has two types
+std::optional<std::vector<const SpecConstant*>> FileSpecConstants(const std::vector<Kernel>& KernelDecls)
+{
+    std::vector<const SpecConstant*> specConsts;
+    for (const Kernel& kDecl : KernelDecls) {
+        if (!IsKernelLive(kDecl))
+            continue;
+        for (const SpecConstant& sc : kDecl.kSpecConsts) {
+            auto previous = llvm::find_if(specConsts, [&](const SpecConstant* other) { return other->id == sc.id; });
+            if (previous == specConsts.end()) {
+                specConsts.push_back(&sc);
+            } else if ((*previous)->storageType != sc.storageType) {
+                PrintError("Specialization constant id {} is used for both `{}` and `{}`, which have different types\n", sc.id, (*previous)->name, sc.name);
+                return std::nullopt;
+            }
+        }
+    }
+    return specConsts;
+}
+
+/// Writes the host code shared by every kernel stub of a file, once ahead of the host code and after the `__openclc_spv_variants` table
+///
+/// Files without specialization constants build their program once. Otherwise the file keeps the values set so far
+/// and the runtime builds one program per distinct set of values.
+/// With `shared`, `__openclc_build_prog` and the specialization constants are visible to the other generated sources of the
+/// executable, which declare them with `WriteLinkedPreambleDeclarations`.
+void WriteKernelInvocationPreamble(llvm::ArrayRef<const SpecConstant*> specConsts, llvm::raw_ostream& outFile, bool shared = false)
+{
+    llvm::StringRef storage = shared ? "OCLC_SPV_HIDDEN " : "static ";
+    if (specConsts.empty()) {
+        outFile << R"(
+static cl_program __openclc_prog = NULL;
+static bool __openclc_prog_built = false;
+
+)" << storage << R"(int __openclc_build_prog(cl_program* prog)
+{
+    if (!__openclc_prog_built) {
+        const OclcSpvVariant* spv = oclcSelectSpvVariant(__openclc_spv_variants, sizeof(__openclc_spv_variants) / sizeof(__openclc_spv_variants[0]));
+        if (spv == NULL) {
+            return 1;
+        }
+        int err = oclcBuildSpv(spv->begin, (size_t)(spv->end - spv->begin), &__openclc_prog);
+        if (err != 0) {
+            return 1;
+        }
+        __openclc_prog_built = true;
+    }
+    *prog = __openclc_prog;
+    return 0;
+}
+)";
+        return;
+    }
+
+    outFile << "\n";
+    for (const SpecConstant* sc : specConsts)
+        outFile << fmt::format("{}{} __openclc_spec_value_{};\n", storage, sc->storageType, sc->id);
+
+    outFile << fmt::format("\n{}OclcSpecConst __openclc_spec_consts[{}] = {{\n", storage, specConsts.size());
+    for (const SpecConstant* sc : specConsts)
+        outFile << fmt::format("    {{ {}, sizeof({}), NULL }},\n", sc->id, sc->storageType);
+    outFile << fmt::format(R"(}};
+
+{}int __openclc_build_prog(cl_program* prog)
+{{
+    const OclcSpvVariant* spv = oclcSelectSpvVariant(__openclc_spv_variants, sizeof(__openclc_spv_variants) / sizeof(__openclc_spv_variants[0]));
+    if (spv == NULL) {{
+        return 1;
+    }}
+    return oclcBuildSpecializedSpv(spv->begin, (size_t)(spv->end - spv->begin), __openclc_spec_consts, {}, prog);
+}}
+)",
+        storage, specConsts.size());
+}
+
+/// Declares what the stubs of a file need from the preamble of the link unit, in place of `WriteKernelInvocationPreamble`
+///
+/// `specConsts` are the constants of the whole program, only those of `KernelDecls` are declared.
+void WriteLinkedPreambleDeclarations(const std::vector<Kernel>& KernelDecls, llvm::ArrayRef<const SpecConstant*> specConsts, llvm::raw_ostream& outFile)
+{
+    outFile << "\nextern OCLC_SPV_HIDDEN int __openclc_build_prog(cl_program* prog);\n";
+    if (specConsts.empty())
+        return;
+
+    llvm::SmallSet<unsigned, 8> declared;
+    for (const Kernel& kDecl : KernelDecls) {
+        if (!IsKernelLive(kDecl))
+            continue;
+        for (const SpecConstant& sc : kDecl.kSpecConsts) {
+            if (declared.insert(sc.id).second)
+                outFile << fmt::format("extern OCLC_SPV_HIDDEN {} __openclc_spec_value_{};\n", sc.storageType, sc.id);
+        }
+    }
+    outFile << "extern OCLC_SPV_HIDDEN OclcSpecConst __openclc_spec_consts[];\n";
+}
+
+/// Generate the setters of a kernel's specialization constants
+///
+/// `specConsts` are the file's constants passed to `WriteKernelInvocationPreamble`, written earlier in the same file.
+/// The values are shared by every thread and read by `oclcBuildSpecializedSpv` under the same lock.
+void GenerateSpecConstantSetters(const Kernel& kDecl, llvm::ArrayRef<const SpecConstant*> specConsts, llvm::raw_ostream& outFile)
+{
+    for (const SpecConstant& sc : kDecl.kSpecConsts) {
+        std::size_t index = llvm::find_if(specConsts, [&](const SpecConstant* other) { return other->id == sc.id; }) - specConsts.begin();
+        outFile << fmt::format(R"(void {}_set_{}({} value)
+{{
+    oclcLockSpecConsts();
+    __openclc_spec_value_{} = value;
+    __openclc_spec_consts[{}].value = &__openclc_spec_value_{};
+    oclcUnlockSpecConsts();
+}}
+
+)",
+            kDecl.kName, sc.name, sc.hostType, sc.id, index, sc.id);
+    }
+}
+
+/// Declares the stub and setters of a kernel whose definitions are generated in another file
+void GenerateKernelDeclarations(const Kernel& kDecl, llvm::raw_ostream& outFile)
+{
+    for (const SpecConstant& sc : kDecl.kSpecConsts)
+        outFile << fmt::format("void {}_set_{}({} value);\n", kDecl.kName, sc.name, sc.hostType);
+    outFile << kDecl.toString() << ";\n";
+}
+
+/// Generate invocation code from a `Kernel` struct
+///
+/// Relies on `WriteKernelInvocationPreamble` having been written earlier in the same file.
+void GenerateKernelInvocation(const Kernel& kDecl, llvm::raw_ostream& outFile)
+{
+    outFile << kDecl.toString() << "\n{";
+    outFile << fmt::format(R"(
+    cl_program prog;
+    if (__openclc_build_prog(&prog) != 0) {{
+        return 1;
+    }}
+
+    if (shmem != 0) {{
+        fprintf(stderr, "Kernel `{}` launched with %zu bytes of dynamic local memory, which is not supported\n", shmem);
+        oclcCrash();
+        return 1;
+    }}
+
+    cl_int err;
+    cl_kernel kernel = clCreateKernel(prog, "{}", &err);
+    CL_CHECK(err)
+)",
+        kDecl.kName, kDecl.kName);
+
+    for (std::size_t i = 0; i < kDecl.kParams.size(); i++) {
+        const std::string& paramName = kDecl.kParams[i];
+        const std::string& paramType = kDecl.kParamTypes[i];
+        bool typeIsPointer = paramType.find("*") != std::string::npos;
+        if (typeIsPointer) {
+            outFile << fmt::format(R"(
+    err = clSetKernelArg(kernel, {}, sizeof(cl_mem), (cl_mem*)&{});
+    CL_CHECK(err)
+)",
+                i, paramName);
+        } else {
+            outFile << fmt::format(R"(
+    err = clSetKernelArg(kernel, {}, sizeof({}), &{});
+    CL_CHECK(err)
+)",
+                i, paramType, paramName);
+        }
+    }
+
+    outFile << R"(
+    cl_uint work_dim;
+    if (oclcValidateWorkDims(gd, bd, &work_dim) != 0) {
+        return 1;
+    }
+)";
+
+    // The device code was compiled for these sizes, launching with others is undefined
+    if (kDecl.kReqdWorkGroupSize) {
+        const WorkGroupSize& size = *kDecl.kReqdWorkGroupSize;
+        outFile << fmt::format(R"(
+    if (bd.x != {1} || (bd.y ? bd.y : 1) != {2} || (bd.z ? bd.z : 1) != {3}) {{
+        fprintf(stderr, "Kernel `{0}` requires a block of {1}x{2}x{3}, but was launched with %dx%dx%d\n", bd.x, bd.y, bd.z);
+        oclcCrash();
+        return 1;
+    }}
+)",
+            kDecl.kName, size[0], size[1], size[2]);
+    }
+    if (kDecl.kMaxWorkGroupSize) {
+        outFile << fmt::format(R"(
+    if ((size_t)bd.x * (bd.y ? bd.y : 1) * (bd.z ? bd.z : 1) > {1}) {{
+        fprintf(stderr, "Kernel `{0}` allows blocks of at most {1} work-items by its __launch_bounds__, but was launched with %dx%dx%d\n", bd.x, bd.y, bd.z);
+        oclcCrash();
+        return 1;
+    }}
+)",
+            kDecl.kName, kDecl.kMaxWorkGroupSize);
+    }
+
+    outFile << R"(
+    const size_t global_work_offset = 0;
+    const size_t global_work_size[3] = { (size_t)gd.x * bd.x, (size_t)gd.y * bd.y, (size_t)gd.z * bd.z };
+    const size_t local_work_size[3] = { (size_t)bd.x, (size_t)bd.y, (size_t)bd.z };
+
+    err = clEnqueueNDRangeKernel(queue ? queue : oclcQueue(), kernel, work_dim, &global_work_offset, global_work_size, local_work_size, 0, NULL, NULL);
+    CL_CHECK(err)
+
+    return 0;
+}
+)";
+}
+
+std::filesystem::path GetRuntimeSourcesDir()
+{
+    char exePath[200];
+#ifdef _WIN32
+    DWORD _err = GetModuleFileName(nullptr, exePath, sizeof(exePath));
+    if (_err == 0) {
+        PrintError("GetModuleFileName failed with code {}\n", GetLastError());
+        std::exit(1);
+    }
+#elif __APPLE__
+    uint32_t exePathSize = sizeof(exePath);
+    int _err = _NSGetExecutablePath(exePath, &exePathSize);
+    if (_err == -1) {
+        PrintError("_NSGetExecutablePath failed\n");
+        std::exit(1);
+    }
+#else
+    int _err = readlink("/proc/self/exe", exePath, sizeof(exePath));
+    if (_err == -1) {
+        PrintError("readlink(\"/proc/self/exe\") failed with exit code {}\n", _err);
+        std::exit(1);
+    }
+#endif
+
+    std::filesystem::path runtimeSourcesDir(exePath);
+
+    if (std::filesystem::is_symlink(runtimeSourcesDir)) {
+        runtimeSourcesDir = std::filesystem::read_symlink(runtimeSourcesDir);
+    }
+
+    runtimeSourcesDir.remove_filename();
+
+    return runtimeSourcesDir;
+}
+
+static void PrintVersion(llvm::raw_ostream& ros)
+{
+    ros << OPENCLC_VERSION << "\n";
+}
+
+/// Runs the spirv-opt passes of `variant` over `spv` in place, returns false if one fails
+///
+/// With `-v` every pass runs on its own, to report its time and how much it grew or shrank the module.
+bool OptimizeSpv(std::vector<uint32_t>& spv, const SpvVariant& variant, const std::string& fileName)
+{
+    const std::vector<std::string>& flags = variant.spvOptFlags;
+    if (flags.empty())
+        return true;
+    openclc::TimeRegion region("spirv-opt", fileName);
+
+    // The result is validated by the caller, validating the translator's output as well would only double the cost
+    spvtools::OptimizerOptions options;
+    options.set_run_validator(false);
+
+    auto createOptimizer = [&] {
+        auto opt = std::make_unique<spvtools::Optimizer>(openclc::SpvTargetEnv(variant.version));
+        opt->SetMessageConsumer(optimizerMessageConsumer);
+        opt->SetValidateAfterAll(SpvValidateEachPass);
+        return opt;
+    };
+    std::unique_ptr<spvtools::Optimizer> opt = createOptimizer();
+    if (!opt->RegisterPassesFromFlags(flags, /*preserve_interface=*/true)) {
+        PrintError("Unknown spirv-opt pass in `--spv-opt={}`\n", variant.spvOpt);
+        return false;
+    }
+
+    // One optimizer per pass, falling back to a single run if a pass can't be recreated from its name
+    std::vector<const char*> passNames = opt->GetPassNames();
+    std::vector<std::unique_ptr<spvtools::Optimizer>> passes;
+    if (Verbose) {
+        for (const char* passName : passNames) {
+            passes.push_back(createOptimizer());
+            if (!passes.back()->RegisterPassFromFlag(fmt::format("--{}", passName), /*preserve_interface=*/true)) {
+                passes.clear();
+                break;
+            }
+        }
+    }
+    if (passes.empty()) {
+        std::size_t sizeBefore = spv.size() * sizeof(uint32_t);
+        auto start = std::chrono::steady_clock::now();
+        if (!opt->Run(spv.data(), spv.size(), &spv, options)) {
+            PrintError("Optimization Passes for `{}` failed\n", fileName);
+            return false;
+        }
+        if (Verbose) {
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            Print("Debug: spirv-opt `{}` SPIR-V {}: {} passes in {:.3f} ms, {} -> {} bytes\n", fileName, variant.versionString(), passNames.size(), elapsed.count(), sizeBefore, spv.size() * sizeof(uint32_t));
+        }
+        return true;
+    }
+
+    // Collected first so reports of files compiled in parallel don't interleave
+    std::string report = fmt::format("Debug: spirv-opt passes for `{}` SPIR-V {}:\n", fileName, variant.versionString());
+    for (std::size_t i = 0; i < passes.size(); i++) {
+        std::size_t sizeBefore = spv.size() * sizeof(uint32_t);
+        auto start = std::chrono::steady_clock::now();
+        if (!passes[i]->Run(spv.data(), spv.size(), &spv, options)) {
+            PrintError("Optimization Pass `{}` for `{}` failed\n", passNames[i], fileName);
+            return false;
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::ptrdiff_t delta = std::ptrdiff_t(spv.size() * sizeof(uint32_t)) - std::ptrdiff_t(sizeBefore);
+        report += fmt::format("    {:<36} {:>10.3f} ms {:>+10} bytes\n", passNames[i], elapsed.count(), delta);
+    }
+    Print("{}", report);
+    return true;
+}
+
+/// Lowers `mod` to the SPIR-V of `variant` with llvm-spirv, then runs the variant's spirv-opt passes over the result
+///
+/// Failures are reported and give `std::nullopt`.
+std::optional<std::vector<uint32_t>> TranslateModule(llvm::Module& mod, const SpvVariant& variant, const std::string& fileName)
+{
+    // Compile device code in LLVM IR to SPIR-V
+    std::vector<uint32_t> optSPV;
+    std::string llvmSpirvCompilationErrors;
+    {
+        openclc::TimeRegion region("SPIR-V translation", fileName);
+        if (!openclc::WriteSpv(mod, variant.version, optSPV, llvmSpirvCompilationErrors)) {
+            PrintError("{}\n", llvmSpirvCompilationErrors);
+            return std::nullopt;
+        }
+    }
+
+    if (!OptimizeSpv(optSPV, variant, fileName))
+        return std::nullopt;
+
+    // Validate once, after all passes
+    openclc::TimeRegion region("SPIR-V validation", fileName);
+    spvtools::SpirvTools tools(openclc::SpvTargetEnv(variant.version));
+    tools.SetMessageConsumer(optimizerMessageConsumer);
+    if (!tools.Validate(optSPV)) {
+        PrintError("Generated SPIR-V {} for `{}` failed validation\n", variant.versionString(), fileName);
+        return std::nullopt;
+    }
+
+    return optSPV;
+}
+
+/// Lowers `mod` to the SPIR-V of every `SpvVariants()` entry, in order
+///
+/// The translator rewrites the module as it lowers it, so all but the last variant lower a clone.
+std::optional<std::vector<std::vector<uint32_t>>> TranslateVariants(llvm::Module& mod, const std::string& fileName)
+{
+    const std::vector<SpvVariant>& variants = SpvVariants();
+    std::vector<std::vector<uint32_t>> spvs;
+    for (std::size_t i = 0; i < variants.size(); i++) {
+        std::unique_ptr<llvm::Module> clone = i + 1 < variants.size() ? llvm::CloneModule(mod) : nullptr;
+        std::optional<std::vector<uint32_t>> spv = TranslateModule(clone ? *clone : mod, variants[i], fileName);
+        if (!spv)
+            return std::nullopt;
+        spvs.push_back(std::move(*spv));
+    }
+    return spvs;
+}
+
+/// Whether `--emit` asks for `kind`
+bool Emits(EmitKind kind)
+{
+    return llvm::is_contained(Emit, kind);
+}
+
+/// Path the `--emit` files of `unit` share, e.g. `./openclc-tmp/vec_add.1f3a09c2.add` for kernel `add` of `./openclc-tmp/vec_add.1f3a09c2.c`
+std::string EmitBasePath(const std::string& outFilePath, llvm::StringRef unit = {})
+{
+    std::string base = std::filesystem::path(outFilePath).replace_extension().string();
+    return unit.empty() ? base : base + "." + unit.str();
+}
+
+/// Writes the LLVM stages `--emit` asks for of `mod` to `<base>.ll` and `<base>.bc`, returns false if one can't be written
+bool EmitModuleFiles(const llvm::Module& mod, const std::string& base)
+{
+    std::string error;
+    for (auto [kind, extension] : { std::pair(EMIT_LLVM_IR, ".ll"), std::pair(EMIT_LLVM_BC, ".bc") }) {
+        if (Emits(kind) && !openclc::WriteModuleFile(mod, base + extension, kind == EMIT_LLVM_BC, error)) {
+            PrintError("{}\n", error);
+            return false;
+        }
+    }
+    return true;
+}
+
+/// Writes the SPIR-V stages `--emit` asks for of the variants `spvs` to `<base>.spv` and `<base>.spvasm`, with the
+/// variant's index before the extension for variants after the first, like `SpvBlobPath`. Returns false if one can't be written.
+bool EmitSpvFiles(llvm::ArrayRef<std::vector<uint32_t>> spvs, const std::string& base)
+{
+    const std::vector<SpvVariant>& variants = SpvVariants();
+    std::string error;
+    for (std::size_t i = 0; i < spvs.size(); i++) {
+        std::string variantBase = i == 0 ? base : fmt::format("{}.{}", base, i);
+        for (auto [kind, extension] : { std::pair(EMIT_SPIRV, ".spv"), std::pair(EMIT_SPIRV_ASM, ".spvasm") }) {
+            if (Emits(kind) && !openclc::WriteSpvFile(spvs[i], openclc::SpvTargetEnv(variants[i].version), variantBase + extension, kind == EMIT_SPIRV_ASM, error)) {
+                PrintError("{}\n", error);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/// Heading of the `--emit` summary of the SPIR-V compiled from `fileName`
+std::string SpvSummaryHeader(const std::string& fileName)
+{
+    return fmt::format("SPIR-V summary for `{}`:\n    {:<32} {:>6} {:>12} {:>9} {:>7} {:>7} {:>8} {:>10}\n",
+        fileName, "Kernel", "SPIR-V", "Instructions", "Functions", "Loads", "Stores", "Barriers", "Bytes");
+}
+
+/// Rows of the `--emit` summary for the SPIR-V variants `spvs` of `name`, one per variant
+std::string SpvSummaryRows(const std::string& name, llvm::ArrayRef<std::vector<uint32_t>> spvs)
+{
+    const std::vector<SpvVariant>& variants = SpvVariants();
+    std::string rows;
+    for (std::size_t i = 0; i < spvs.size(); i++) {
+        openclc::SpvStatistics stats = openclc::CountSpvInstructions(spvs[i]);
+        rows += fmt::format("    {:<32} {:>6} {:>12} {:>9} {:>7} {:>7} {:>8} {:>10}\n",
+            name, variants[i].versionString(), stats.instructions, stats.functions, stats.loads, stats.stores, stats.barriers, stats.bytes);
+    }
+    return rows;
+}
+
+/// Streams the remarks of the LLVM passes run in `ctx` to `<base>.opt.yaml`, if `--emit` asks for them and the passes run
+///
+/// Returns false if the file can't be opened.
+bool OpenOptRemarks(openclc::OptimizationRemarksFile& remarks, llvm::LLVMContext& ctx, const std::string& base)
+{
+    if (!Emits(EMIT_OPT_REMARKS) || DeviceOptLevel() == 0)
+        return true;
+    std::string error;
+    if (!remarks.open(ctx, base + ".opt.yaml", OptRemarksFilter, error)) {
+        PrintError("Failed to write optimization remarks to `{}.opt.yaml`: {}\n", base, error);
+        return false;
+    }
+    return true;
+}
+
+/// Optimizes `mod`, then lowers it to the SPIR-V of every `SpvVariants()` entry, in order
+///
+/// With `emitBase` the stages `--emit` asks for are written to files starting with it. Failures are reported and give `std::nullopt`.
+std::optional<std::vector<std::vector<uint32_t>>> ModuleToSpv(llvm::Module& mod, const std::string& fileName, const std::string& emitBase = {})
+{
+    if (unsigned optLevel = DeviceOptLevel(); optLevel > 0) {
+        openclc::TimeRegion region("LLVM optimization", fileName);
+        openclc::OptimizeModule(mod, optLevel);
+    }
+    if (!emitBase.empty() && !EmitModuleFiles(mod, emitBase))
+        return std::nullopt;
+
+    std::optional<std::vector<std::vector<uint32_t>>> spvs = TranslateVariants(mod, fileName);
+    if (spvs && !emitBase.empty() && !EmitSpvFiles(*spvs, emitBase))
+        return std::nullopt;
+    return spvs;
+}
+
+/// Replaces every helper with an identical one, e.g. the same helper linked in from several files, with LLVM's MergeFunctions
+///
+/// Kernels are left alone since they are created by name. The pass skips `available_externally` definitions, so kernels are
+/// hidden from it as such while it runs.
+void DeduplicateFunctions(llvm::Module& mod)
+{
+    openclc::TimeRegion region("Deduplicate functions", mod.getModuleIdentifier());
+    std::vector<std::pair<llvm::Function*, llvm::GlobalValue::LinkageTypes>> kernels;
+    for (llvm::Function& f : mod.functions()) {
+        if (!f.isDeclaration() && f.getCallingConv() == llvm::CallingConv::SPIR_KERNEL) {
+            kernels.emplace_back(&f, f.getLinkage());
+            f.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        }
+    }
+
+    llvm::ModuleAnalysisManager MAM;
+    llvm::MergeFunctionsPass().run(mod, MAM);
+
+    for (auto [f, linkage] : kernels)
+        f->setLinkage(linkage);
+}
+
+/// Clones the kernels `isKept` accepts out of `mod`
+///
+/// Other kernels are dropped rather than left as declarations, so each clone lowers to a self contained SPIR-V module.
+/// Each clone keeps private copies of the helper functions and constant tables it uses, so the linked clones never export
+/// the same symbol. Program scope variables that can be written are kept as they are, so they must only be used by kernels
+/// of a single clone, see `Kernel::kSharesGlobals`.
+std::unique_ptr<llvm::Module> SplitKernelModule(const llvm::Module& mod, llvm::function_ref<bool(llvm::StringRef)> isKept)
+{
+    llvm::ValueToValueMapTy vmap;
+    std::unique_ptr<llvm::Module> kernelMod = llvm::CloneModule(mod, vmap, [&](const llvm::GlobalValue* gv) {
+        auto* fn = llvm::dyn_cast<llvm::Function>(gv);
+        return !fn || fn->getCallingConv() != llvm::CallingConv::SPIR_KERNEL || isKept(fn->getName());
+    });
+
+    for (llvm::Function& f : llvm::make_early_inc_range(kernelMod->functions())) {
+        if (f.getCallingConv() == llvm::CallingConv::SPIR_KERNEL) {
+            if (f.isDeclaration() && f.use_empty())
+                f.eraseFromParent();
+        } else if (!f.isDeclaration()) {
+            f.setLinkage(llvm::GlobalValue::InternalLinkage);
+        }
+    }
+    for (llvm::GlobalVariable& gv : kernelMod->globals()) {
+        if (!gv.isDeclaration() && gv.isConstant() && !gv.getName().starts_with("llvm."))
+            gv.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+    // Drop the helpers and variables the kept kernels don't use, repeating since erasing a user can leave what it uses unused
+    bool erased = true;
+    while (erased) {
+        erased = false;
+        for (llvm::Function& f : llvm::make_early_inc_range(kernelMod->functions())) {
+            if (f.hasLocalLinkage() && f.use_empty()) {
+                f.eraseFromParent();
+                erased = true;
+            }
+        }
+        for (llvm::GlobalVariable& gv : llvm::make_early_inc_range(kernelMod->globals())) {
+            if (gv.use_empty() && !gv.getName().starts_with("llvm.")) {
+                gv.eraseFromParent();
+                erased = true;
+            }
+        }
+    }
+
+    return kernelMod;
+}
+
+/// Clones the single kernel `kName` out of `mod`, see above
+std::unique_ptr<llvm::Module> SplitKernelModule(const llvm::Module& mod, llvm::StringRef kName)
+{
+    return SplitKernelModule(mod, [&](llvm::StringRef name) { return name == kName; });
+}
+
+/// Hash of the LLVM IR of kernel `kName` of `mod` and the helpers and variables it uses, as printed without debug information
+///
+/// Kernels of the same source compiled against different struct layouts, typedefs or `-D` values differ in it, while copies of the
+/// same kernel from different files don't, since names and types in the IR come from the source.
+std::string KernelIRFingerprint(const llvm::Module& mod, llvm::StringRef kName)
+{
+    std::unique_ptr<llvm::Module> kernelMod = SplitKernelModule(mod, kName);
+    kernelMod->setModuleIdentifier("");
+    kernelMod->setSourceFileName("");
+    llvm::StripDebugInfo(*kernelMod);
+
+    std::string ir;
+    llvm::raw_string_ostream os(ir);
+    kernelMod->print(os, nullptr);
+    return openclc::SpvCache::hash({ os.str() });
+}
+
+/// Key of a kernel's optimized SPIR-V of one variant in `SpvCache`
+///
+/// Covers everything that changes the generated SPIR-V: the source of the kernel and the device code it uses, the language of the file,
+/// the device compilation flags and the variant.
+std::string KernelCacheKey(const Kernel& kernel, const SpvVariant& variant, const std::string& fileName)
+{
+    std::vector<std::string> parts = DeviceCompilationKey(fileName);
+    parts.push_back(SpvVariantKey(variant));
+
+    parts.push_back(kernel.sourceHash);
+    return openclc::SpvCache::hash(std::vector<llvm::StringRef>(parts.begin(), parts.end()));
+}
+
+/// Compiles a file's device code to optimized SPIR-V one kernel at a time, reusing kernels found in `cache` if there is one
+///
+/// Kernels that miss in any variant are code generated together in the single frontend pass, then split, lowered and stored individually.
+/// Kernels sharing writable program scope variables are never cached, they are lowered together as one module that defines the variables.
+/// All kernels are finally linked back into one module per variant with the SPIR-V linker.
+/// `--emit` compiles this way without a cache, so the files it writes for each kernel are the ones linked into `outFilePath`'s SPIR-V.
+/// Failures are reported and give `std::nullopt`.
+std::optional<std::vector<std::vector<uint32_t>>> CompileDeviceCodePerKernel(llvm::LLVMContext& ctx, std::vector<Kernel>& KernelDecls, llvm::StringRef fileContents, const std::string& fileName,
+    const std::string& outFilePath, std::vector<std::string>& dependencies, openclc::SpvCache* cache)
+{
+    const std::vector<SpvVariant>& variants = SpvVariants();
+
+    // Kernel `k` in variant `v` is at `k * variants.size() + v`
+    std::vector<std::string> keys;
+    std::vector<std::vector<uint32_t>> kernelSpvs;
+    std::vector<std::size_t> misses;
+    llvm::StringSet<> sharingKernels;
+
+    // Kernels are looked up as the frontend finds them, so only misses are code generated
+    std::unique_ptr<llvm::Module> mod = DeviceFrontend(ctx, KernelDecls, fileContents, fileName, dependencies, [&](const Kernel& kernel) {
+        if (!IsKernelLive(kernel) || kernel.kSharesGlobals) {
+            keys.resize(keys.size() + variants.size());
+            kernelSpvs.resize(kernelSpvs.size() + variants.size());
+            if (IsKernelLive(kernel))
+                sharingKernels.insert(kernel.kName);
+            return IsKernelLive(kernel);
+        }
+
+        bool hit = true;
+        for (const SpvVariant& variant : variants) {
+            keys.push_back(KernelCacheKey(kernel, variant, fileName));
+            kernelSpvs.emplace_back();
+            hit = hit && cache && cache->lookup(keys.back(), kernelSpvs.back());
+        }
+        if (hit)
+            return false;
+
+        misses.push_back(keys.size() / variants.size() - 1);
+        return true;
+    });
+    if (!mod)
+        return std::nullopt;
+
+    std::size_t liveKernels = llvm::count_if(KernelDecls, IsKernelLive);
+    if (liveKernels == 0)
+        return std::vector<std::vector<uint32_t>>();
+    if (Verbose && cache)
+        Print("Debug: SPIR-V cache hits for `{}`: {}/{}\n", fileName, liveKernels - misses.size() - sharingKernels.size(), liveKernels);
+
+    openclc::OptimizationRemarksFile remarks;
+    if (!OpenOptRemarks(remarks, ctx, EmitBasePath(outFilePath)))
+        return std::nullopt;
+    for (std::size_t k : misses) {
+        openclc::TimeRegion region("Kernel backend", fileName, KernelDecls[k].kName);
+        std::unique_ptr<llvm::Module> kernelMod = SplitKernelModule(*mod, KernelDecls[k].kName);
+        std::optional<std::vector<std::vector<uint32_t>>> spvs = ModuleToSpv(*kernelMod, fileName, Emit.empty() ? std::string() : EmitBasePath(outFilePath, KernelDecls[k].kName));
+        if (!spvs)
+            return std::nullopt;
+        for (std::size_t v = 0; v < variants.size(); v++) {
+            std::size_t i = k * variants.size() + v;
+            kernelSpvs[i] = std::move((*spvs)[v]);
+            if (cache)
+                cache->store(keys[i], kernelSpvs[i]);
+        }
+    }
+
+    std::optional<std::vector<std::vector<uint32_t>>> sharingSpvs;
+    if (!sharingKernels.empty()) {
+        openclc::TimeRegion region("Kernel backend", fileName, "(sharing globals)");
+        std::unique_ptr<llvm::Module> sharingMod = SplitKernelModule(*mod, [&](llvm::StringRef name) { return sharingKernels.contains(name); });
+        sharingSpvs = ModuleToSpv(*sharingMod, fileName, Emit.empty() ? std::string() : EmitBasePath(outFilePath, "sharing-globals"));
+        if (!sharingSpvs)
+            return std::nullopt;
+    }
+    auto isSplit = [&](const Kernel& kernel) { return IsKernelLive(kernel) && !kernel.kSharesGlobals; };
+
+    std::string summary;
+    if (!Emit.empty()) {
+        summary = SpvSummaryHeader(fileName);
+        for (std::size_t k = 0; k < KernelDecls.size(); k++) {
+            if (isSplit(KernelDecls[k]))
+                summary += SpvSummaryRows(KernelDecls[k].kName, llvm::ArrayRef(kernelSpvs).slice(k * variants.size(), variants.size()));
+        }
+        if (sharingSpvs)
+            summary += SpvSummaryRows("(sharing globals)", *sharingSpvs);
+    }
+
+    std::vector<std::vector<uint32_t>> linkedSpvs;
+    for (std::size_t v = 0; v < variants.size(); v++) {
+        std::vector<std::vector<uint32_t>> variantSpvs;
+        for (std::size_t k = 0; k < KernelDecls.size(); k++) {
+            if (isSplit(KernelDecls[k]))
+                variantSpvs.push_back(std::move(kernelSpvs[k * variants.size() + v]));
+        }
+        if (sharingSpvs)
+            variantSpvs.push_back(std::move((*sharingSpvs)[v]));
+
+        openclc::TimeRegion region("SPIR-V link", fileName);
+        spvtools::Context linkContext(openclc::SpvTargetEnv(variants[v].version));
+        linkContext.SetMessageConsumer(optimizerMessageConsumer);
+        std::vector<uint32_t>& linkedSpv = linkedSpvs.emplace_back();
+        if (spvtools::Link(linkContext, variantSpvs, &linkedSpv) != SPV_SUCCESS) {
+            PrintError("Linking the SPIR-V {} of the kernels of `{}` failed\n", variants[v].versionString(), fileName);
+            return std::nullopt;
+        }
+    }
+
+    // Printed at once so summaries of files compiled in parallel don't interleave
+    if (!Emit.empty())
+        Print("{}{}", summary, SpvSummaryRows("(linked)", linkedSpvs));
+
+    return linkedSpvs;
+}
+
+/// Escapes `str` for use inside a double quoted C or assembler string literal
+std::string EscapeStringLiteral(llvm::StringRef str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/// Assembler name of the embedded SPIR-V variant `index` of the generated host source `outFileName`
+///
+/// Generated sources share a directory and are named after the path of their input, so their names are unique. The hash
+/// keeps the symbol unique after characters that can't appear in a symbol are replaced.
+std::string SpvBlobSymbol(llvm::StringRef outFileName, std::size_t index)
+{
+    std::string symbol = "__openclc_spv_";
+    for (char c : llvm::sys::path::stem(outFileName))
+        symbol += llvm::isAlnum(c) ? c : '_';
+    symbol += '_';
+    symbol += openclc::SpvCache::hash({ outFileName }).substr(0, 8);
+    symbol += fmt::format("_{}", index);
+    return symbol;
+}
+
+/// Where the SPIR-V variant `index` of the generated host source `outFilePath` is written, `<name>.spv` for the first
+/// variant and `<name>.<index>.spv` for the others
+std::filesystem::path SpvBlobPath(const std::string& outFilePath, std::size_t index)
+{
+    return std::filesystem::path(outFilePath).replace_extension(index == 0 ? ".spv" : fmt::format(".{}.spv", index));
+}
+
+/// Writes the raw words of `spv` to `path` for `OCLC_INCBIN`, returns false if it can't be written
+bool WriteSpvBlob(const std::string& path, llvm::ArrayRef<uint32_t> spv)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    if (ec) {
+        PrintError("Failed to open `{}`: {}\n", path, ec.message());
+        return false;
+    }
+    os.write(reinterpret_cast<const char*>(spv.data()), spv.size() * sizeof(uint32_t));
+    os.close();
+    if (os.has_error()) {
+        PrintError("Failed to write `{}`: {}\n", path, os.error().message());
+        os.clear_error();
+        return false;
+    }
+    return true;
+}
+
+/// A host source generated in `./openclc-tmp` and the files it was generated from
+struct GeneratedSource {
+    std::string path;
+    /// The input file first, then the headers it includes
+    std::vector<std::string> dependencies;
+    /// SPIR-V files the source embeds with `OCLC_INCBIN`, none if it only launches library kernels
+    std::vector<std::string> spvBlobs;
+};
+
+/// File next to a generated host source, recording the key it was generated with and how many SPIR-V files it embeds on the
+/// first line, then its dependencies, one per line
+std::string DependencyStampPath(const std::string& outFilePath)
+{
+    return outFilePath + ".deps";
+}
+
+/// Fills the dependencies and SPIR-V files of `generated` from its stamp if it was generated with `key` and no dependency changed since
+///
+/// Returns false if the host source has to be generated again.
+bool GeneratedSourceIsUpToDate(GeneratedSource& generated, llvm::StringRef key)
+{
+    llvm::sys::fs::file_status outStatus;
+    if (llvm::sys::fs::status(generated.path, outStatus))
+        return false;
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> stamp = llvm::MemoryBuffer::getFile(DependencyStampPath(generated.path));
+    if (!stamp)
+        return false;
+
+    llvm::SmallVector<llvm::StringRef> lines;
+    (*stamp)->getBuffer().split(lines, '\n', /*MaxSplit=*/-1, /*KeepEmpty=*/false);
+    if (lines.empty())
+        return false;
+    auto [stampKey, blobCount] = lines[0].split(' ');
+    std::size_t blobs;
+    if (stampKey != key || blobCount.getAsInteger(10, blobs))
+        return false;
+
+    std::vector<std::string> spvBlobs;
+    for (std::size_t i = 0; i < blobs; i++) {
+        spvBlobs.push_back(SpvBlobPath(generated.path, i).string());
+        if (!std::filesystem::exists(spvBlobs.back()))
+            return false;
+    }
+
+    std::vector<std::string> dependencies;
+    for (llvm::StringRef dependency : llvm::ArrayRef(lines).drop_front()) {
+        llvm::sys::fs::file_status status;
+        if (llvm::sys::fs::status(dependency, status) || status.getLastModificationTime() > outStatus.getLastModificationTime())
+            return false;
+        dependencies.push_back(dependency.str());
+    }
+
+    generated.dependencies = std::move(dependencies);
+    generated.spvBlobs = std::move(spvBlobs);
+    return true;
+}
+
+/// Writes the stamp `GeneratedSourceIsUpToDate` checks, once `generated` is complete
+void WriteDependencyStamp(const GeneratedSource& generated, llvm::StringRef key)
 {
-    std::stringstream outFile;
-    outFile << R"(
-#include "openclc_rt.h"
-#include <stdbool.h>
-#include <stdio.h>
+    std::ofstream stamp(DependencyStampPath(generated.path));
+    stamp << key.str() << " " << generated.spvBlobs.size() << "\n";
+    for (const std::string& dependency : generated.dependencies)
+        stamp << dependency << "\n";
+}
 
-static cl_program prog = NULL;
-static bool prog_built = false;
-)";
+/// Name of the host source generated from `fileName` in `./openclc-tmp`, exits on inputs that aren't OpenCL C or C++ for OpenCL
+///
+/// The name is the input's stem and a hash of its absolute path, e.g. `vec_add.1f3a09c2.c`, so inputs of the same name in
+/// different directories don't overwrite each other's sources, SPIR-V and objects.
+std::string GeneratedSourceName(const std::string& fileName)
+{
+    std::filesystem::path input(fileName);
+    std::string extension = input.extension().string();
+    if (extension == ".clpp") {
+        extension = ".cpp";
+    } else if (extension == ".cl" || extension == ".ocl") {
+        extension = ".c";
+    } else {
+        PrintError("Wrong File Extension for file, {}", input.filename().string());
+        std::exit(1);
+    }
+    std::string path = std::filesystem::absolute(input).lexically_normal().string();
+    return fmt::format("{}.{}{}", input.stem().string(), openclc::SpvCache::hash({ path }).substr(0, 8), extension);
+}
 
-    for (Kernel kDecl : KernelDecls) {
-        outFile << kDecl.toString() << "\n{\n";
-        outFile << R"(
-    if (!prog_built) {
-        int err = oclcBuildSpv(__spv_bin, sizeof(__spv_bin), &prog);
-        if (err != 0) {
-            return 1;
+/// Writes the SPIR-V variants embedded by the host source `outFilePath` next to it, and the `__openclc_spv_variants` table
+/// that embeds them to `outFile`. Returns false if a variant can't be written.
+bool WriteSpvVariants(const std::string& outFilePath, llvm::ArrayRef<std::vector<uint32_t>> spvs, llvm::raw_ostream& outFile)
+{
+    // The SPIR-V variants are written out as is and pulled into the host object by the assembler, the runtime picks one per device
+    openclc::TimeRegion region("Embed SPIR-V", outFilePath);
+    const std::vector<SpvVariant>& variants = SpvVariants();
+    std::string variantTable = "static const OclcSpvVariant __openclc_spv_variants[] = {\n";
+    for (std::size_t i = 0; i < variants.size(); i++) {
+        std::filesystem::path spvPath = std::filesystem::absolute(SpvBlobPath(outFilePath, i));
+        if (!WriteSpvBlob(spvPath.string(), spvs[i]))
+            return false;
+        outFile << fmt::format("OCLC_INCBIN(__spv_bin_{}, \"{}\", \"{}\");\n",
+            i, SpvBlobSymbol(llvm::sys::path::filename(outFilePath), i), EscapeStringLiteral(EscapeStringLiteral(spvPath.generic_string())));
+        variantTable += fmt::format("    {{ {:#010x}, __spv_bin_{}, __spv_bin_{}_end }},\n", static_cast<uint32_t>(variants[i].version), i, i);
+    }
+    outFile << variantTable << "};\n";
+    return true;
+}
+
+/// Streams the host source of an input to `outFilePath`
+///
+/// `writePreamble` writes what the stubs need after the runtime include, then the input follows with launches rewritten and kernels
+/// replaced by their stubs. Kernels in `declaredOnly` have their stubs generated in another file and are only declared, kernels
+/// `IsKernelLive` drops are left out. The device code only kernels use is left out too.
+/// Returns false if the source or what `writePreamble` writes can't be written.
+bool WriteHostSource(const std::string& outFilePath, llvm::StringRef fileContents, llvm::ArrayRef<SourceReplacement> launches,
+    const std::vector<Kernel>& KernelDecls, llvm::ArrayRef<const SpecConstant*> specConsts, llvm::function_ref<bool(llvm::raw_ostream&)> writePreamble,
+    const llvm::StringSet<>& declaredOnly = {})
+{
+    openclc::TimeRegion region("Host source", outFilePath);
+    std::error_code ec;
+    llvm::raw_fd_ostream postProcessedOutFile(outFilePath, ec);
+    if (ec) {
+        PrintError("Failed to open `{}`: {}\n", outFilePath, ec.message());
+        return false;
+    }
+    // Generated code keeps C linkage when the host source is C++, so stubs link across C and C++ host sources
+    postProcessedOutFile << "#include \"openclc_rt.h\"\n#include <stdbool.h>\n#include <stdio.h>\n\nOCLC_EXTERN_C_BEGIN\n";
+    if (!writePreamble(postProcessedOutFile))
+        return false;
+    postProcessedOutFile << "OCLC_EXTERN_C_END\n";
+
+    std::vector<std::pair<std::size_t, std::size_t>> deviceOnly;
+    for (const Kernel& kDecl : KernelDecls)
+        llvm::append_range(deviceOnly, kDecl.deviceOnlyRanges);
+    llvm::sort(deviceOnly);
+    deviceOnly.erase(std::unique(deviceOnly.begin(), deviceOnly.end()), deviceOnly.end());
+
+    // Kernels, device code and launches are all in source order, so the host source is streamed out in a single pass
+    std::size_t offset = 0;
+    auto launch = launches.begin();
+    auto deviceCode = deviceOnly.begin();
+    auto copyUntil = [&](std::size_t end) {
+        for (; launch != launches.end() && launch->offset < end; ++launch) {
+            postProcessedOutFile << fileContents.slice(offset, launch->offset) << launch->text;
+            offset = launch->offset + launch->length;
+        }
+        postProcessedOutFile << fileContents.slice(offset, end);
+        offset = std::max(offset, end);
+    };
+    // Launches inside device code leave with it
+    auto skipTo = [&](std::size_t end) {
+        offset = std::max(offset, end);
+        while (launch != launches.end() && launch->offset < offset)
+            ++launch;
+    };
+    auto writeUntil = [&](std::size_t end) {
+        for (; deviceCode != deviceOnly.end() && deviceCode->first < end; ++deviceCode) {
+            copyUntil(deviceCode->first);
+            skipTo(deviceCode->second + 1);
+        }
+        copyUntil(end);
+    };
+    for (const Kernel& kDecl : KernelDecls) {
+        writeUntil(kDecl.beginSourceOffset);
+        if (!IsKernelLive(kDecl)) {
+            // dropped along with its body
+        } else if (declaredOnly.contains(kDecl.kName)) {
+            postProcessedOutFile << "OCLC_EXTERN_C_BEGIN\n";
+            GenerateKernelDeclarations(kDecl, postProcessedOutFile);
+            postProcessedOutFile << "OCLC_EXTERN_C_END\n";
         } else {
-            prog_built = true;
+            postProcessedOutFile << "OCLC_EXTERN_C_BEGIN\n";
+            GenerateSpecConstantSetters(kDecl, specConsts, postProcessedOutFile);
+            GenerateKernelInvocation(kDecl, postProcessedOutFile);
+            postProcessedOutFile << "OCLC_EXTERN_C_END\n";
         }
+        skipTo(kDecl.endSourceOffset + 1); // continue after the kernel's closing brace
     }
+    writeUntil(fileContents.size());
 
-    cl_int err;
-)";
+    postProcessedOutFile.close();
+    if (postProcessedOutFile.has_error()) {
+        PrintError("Failed to write `{}`: {}\n", outFilePath, postProcessedOutFile.error().message());
+        postProcessedOutFile.clear_error();
+        return false;
+    }
+    return true;
+}
 
-        outFile << fmt::format(R"(
-    cl_kernel kernel = clCreateKernel(prog, "{}", &err);
-    CL_CHECK(err)
+/// `fileName` followed by the headers it includes, without duplicates
+std::vector<std::string> InputDependencies(const std::string& fileName, llvm::ArrayRef<std::string> headers)
+{
+    std::vector<std::string> dependencies;
+    llvm::StringSet<> seen;
+    for (const std::string& dependency : llvm::concat<const std::string>(llvm::ArrayRef(fileName), headers)) {
+        if (seen.insert(dependency).second)
+            dependencies.push_back(dependency);
+    }
+    return dependencies;
+}
 
-)",
-            kDecl.kName);
-
-        for (int i = 0; i < kDecl.kParams.size(); i++) {
-            std::string paramName = kDecl.kParams[i];
-            std::string paramType = kDecl.kParamTypes[i];
-            bool typeIsPointer = paramType.find("*") != std::string::npos;
-            if (typeIsPointer) {
-                outFile << fmt::format(R"(
-    err = clSetKernelArg(kernel, {}, sizeof(cl_mem), (cl_mem*)&{}); 
-    CL_CHECK(err)
-)",
-                    i, paramName);
-            } else {
-                outFile << fmt::format(R"(
-    err = clSetKernelArg(kernel, {}, sizeof({}), {});
-    CL_CHECK(err)
-    )",
-                    i, paramType, paramName);
-            }
+/// Declares the stubs of the library kernels `launches` calls, which are generated in the library or link unit
+///
+/// Launches in macro definitions may name any kernel, so files with one declare every library kernel.
+void DeclareLibraryKernels(llvm::ArrayRef<SourceReplacement> launches, llvm::raw_ostream& outFile)
+{
+    std::vector<llvm::StringRef> names;
+    if (llvm::any_of(launches, [](const SourceReplacement& launch) { return launch.inMacroDefinition; })) {
+        for (const std::unique_ptr<openclc::DeviceLibrary>& library : LoadedDeviceLibraries().libraries) {
+            for (const openclc::DeviceLibrary::Member& member : library->members())
+                names.push_back(member.name);
         }
+    } else {
+        for (const SourceReplacement& launch : launches)
+            names.push_back(launch.kernel);
     }
 
-    outFile << R"(
-    cl_uint work_dim;
-    if (oclcValidateWorkDims(gd, bd, &work_dim) != 0) {
-        return 1;
+    const llvm::StringMap<LibraryKernel>& kernels = LoadedDeviceLibraries().kernels;
+    llvm::StringSet<> declared;
+    for (llvm::StringRef name : names) {
+        auto kernel = kernels.find(name);
+        if (kernel == kernels.end() || !declared.insert(name).second)
+            continue;
+        GenerateKernelDeclarations(kernel->second.kernel, outFile);
     }
+}
 
-    const size_t global_work_offset = 0;
-    const size_t global_work_size[3] = { gd.x * bd.x, gd.y * bd.y, gd.z * bd.z };
-    const size_t local_work_size[3] = { bd.x, bd.y, bd.z };
+/// Returns false if an input defines a kernel a device library provides too, since both would get a stub of the same name
+bool RejectLibraryKernelDefinitions(const std::vector<Kernel>& KernelDecls, const std::string& fileName)
+{
+    const llvm::StringMap<LibraryKernel>& kernels = LoadedDeviceLibraries().kernels;
+    for (const Kernel& kDecl : KernelDecls) {
+        if (auto kernel = kernels.find(kDecl.kName); kernel != kernels.end() && !kDecl.kTemplate) {
+            PrintError("Kernel `{}` is defined in both `{}` and the device library `{}`\n", kDecl.kName, fileName, kernel->second.libraryPath);
+            return false;
+        }
+    }
+    return true;
+}
 
-    err = clEnqueueNDRangeKernel(oclcQueue(), kernel, work_dim, &global_work_offset, global_work_size, local_work_size, 0, NULL, NULL);
-    CL_CHECK(err)
+/// The library kernels the inputs launch, in order of first launch, or all of them if `LaunchedKernels` can't tell
+std::vector<const LibraryKernel*> LaunchedLibraryKernels()
+{
+    const DeviceLibraries& libraries = LoadedDeviceLibraries();
+    std::vector<llvm::StringRef> names;
+    if (LaunchedKernels().unknown) {
+        for (const std::unique_ptr<openclc::DeviceLibrary>& library : libraries.libraries) {
+            for (const openclc::DeviceLibrary::Member& member : library->members())
+                names.push_back(member.name);
+        }
+    } else {
+        names.assign(LaunchedKernels().names.begin(), LaunchedKernels().names.end());
+    }
 
-    return 0;
+    std::vector<const LibraryKernel*> launched;
+    llvm::SmallPtrSet<const LibraryKernel*, 16> seen;
+    for (llvm::StringRef name : names) {
+        if (auto kernel = libraries.kernels.find(name); kernel != libraries.kernels.end() && seen.insert(&kernel->second).second)
+            launched.push_back(&kernel->second);
+    }
+    return launched;
 }
-)";
-    return outFile.str();
+
+/// Reads the bitcode of a library kernel into `ctx`, null if it doesn't parse
+std::unique_ptr<llvm::Module> LoadLibraryKernel(llvm::LLVMContext& ctx, const LibraryKernel& kernel)
+{
+    llvm::Expected<std::unique_ptr<llvm::Module>> mod = llvm::parseBitcodeFile(llvm::MemoryBufferRef(kernel.bitcode, kernel.kernel.kName), ctx);
+    if (!mod) {
+        PrintError("Failed to read kernel `{}` from device library `{}`: {}\n", kernel.kernel.kName, kernel.libraryPath, llvm::toString(mod.takeError()));
+        return nullptr;
+    }
+    return std::move(*mod);
 }
 
-std::filesystem::path GetRuntimeSourcesDir()
+/// Generate the setters and stubs of kernels that aren't defined in any input, after the preamble of a link or library unit
+void GenerateKernelStubs(const std::vector<Kernel>& KernelDecls, llvm::ArrayRef<const SpecConstant*> specConsts, llvm::raw_ostream& outFile)
 {
-    char exePath[200];
-#ifdef _WIN32
-    DWORD _err = GetModuleFileName(nullptr, exePath, sizeof(exePath));
-    if (_err == 0) {
-        fmt::print(err, "GetModuleFileName failed with code {}\n", GetLastError());
-        std::exit(1);
+    for (const Kernel& kDecl : KernelDecls) {
+        outFile << "\n";
+        GenerateSpecConstantSetters(kDecl, specConsts, outFile);
+        GenerateKernelInvocation(kDecl, outFile);
     }
-#elif __APPLE__
-    uint32_t exePathSize = sizeof(exePath);
-    int _err = _NSGetExecutablePath(exePath, &exePathSize);
-    if (_err == -1) {
-        fmt::print(err, "_NSGetExecutablePath failed\n");
+}
+
+/// The library unit, a generated source holding the stubs, SPIR-V and program of the library kernels the inputs launch
+static constexpr llvm::StringLiteral LibraryUnitPath = "./openclc-tmp/__openclc_libraries.c";
+
+/// Links the library kernels `launched` into the library unit, unless it is up to date
+///
+/// Library kernels are already optimized, so they are only linked and lowered to SPIR-V. Helpers that several of them
+/// carry a copy of are kept once. Failures are reported and give `std::nullopt`.
+std::optional<GeneratedSource> CompileLibraryKernels(llvm::ArrayRef<const LibraryKernel*> launched)
+{
+    const DeviceLibraries& libraries = LoadedDeviceLibraries();
+    GeneratedSource generated { LibraryUnitPath.str(), {} };
+
+    std::vector<std::string> keyParts = { DeviceLibraryProducer(), libraries.key };
+    for (const SpvVariant& variant : SpvVariants())
+        keyParts.push_back(SpvVariantKey(variant));
+    for (const LibraryKernel* kernel : launched)
+        keyParts.push_back(kernel->kernel.kName);
+    std::string key = openclc::SpvCache::hash(std::vector<llvm::StringRef>(keyParts.begin(), keyParts.end()));
+    if (GeneratedSourceIsUpToDate(generated, key)) {
+        if (Verbose)
+            Print("Debug: `{}` is up to date\n", generated.path);
+        return generated;
+    }
+    std::filesystem::remove(DependencyStampPath(generated.path));
+
+    llvm::LLVMContext ctx;
+    std::unique_ptr<llvm::Module> linked;
+    std::vector<Kernel> KernelDecls;
+    for (const LibraryKernel* kernel : launched) {
+        std::unique_ptr<llvm::Module> mod = LoadLibraryKernel(ctx, *kernel);
+        if (!mod)
+            return std::nullopt;
+        if (!linked) {
+            linked = std::move(mod);
+        } else if (llvm::Linker::linkModules(*linked, std::move(mod))) {
+            PrintError("Linking kernel `{}` of device library `{}` failed\n", kernel->kernel.kName, kernel->libraryPath);
+            return std::nullopt;
+        }
+        KernelDecls.push_back(kernel->kernel);
+        if (!llvm::is_contained(generated.dependencies, kernel->libraryPath))
+            generated.dependencies.push_back(kernel->libraryPath);
+    }
+    DeduplicateFunctions(*linked);
+    if (Verbose)
+        Print("Debug: Linked {} of {} library kernels\n", launched.size(), libraries.kernels.size());
+
+    std::optional<std::vector<std::vector<uint32_t>>> optSPVs = TranslateVariants(*linked, generated.path);
+    std::optional<std::vector<const SpecConstant*>> specConsts = FileSpecConstants(KernelDecls);
+    if (!optSPVs || !specConsts)
+        return std::nullopt;
+    bool written = WriteHostSource(generated.path, "", {}, {}, *specConsts, [&](llvm::raw_ostream& out) {
+        if (!WriteSpvVariants(generated.path, *optSPVs, out))
+            return false;
+        WriteKernelInvocationPreamble(*specConsts, out);
+        GenerateKernelStubs(KernelDecls, *specConsts, out);
+        return true;
+    });
+    if (!written)
+        return std::nullopt;
+    for (std::size_t i = 0; i < SpvVariants().size(); i++)
+        generated.spvBlobs.push_back(SpvBlobPath(generated.path, i).string());
+
+    WriteDependencyStamp(generated, key);
+    return generated;
+}
+
+/// Compiles the kernels of `fileNames` into the device library `-o`, for `--device-library`
+///
+/// Every kernel is split into a module of its own with the helpers it calls and optimized at the `-O` level, so executables only
+/// read, link and lower the kernels they launch. Host code in the inputs is ignored. The headers the inputs include are appended to `dependencies`.
+void BuildDeviceLibrary(llvm::ArrayRef<std::string> fileNames, std::vector<std::string>& dependencies)
+{
+    std::vector<Kernel> kernels;
+    std::vector<std::string> bitcodes;
+    llvm::StringMap<std::string> kernelFiles;
+
+    for (const std::string& fileName : fileNames) {
+        llvm::LLVMContext ctx;
+        std::vector<Kernel> KernelDecls;
+        std::vector<std::string> headers;
+        std::unique_ptr<llvm::MemoryBuffer> inFile = ReadInputFile(fileName);
+        std::unique_ptr<llvm::Module> mod = inFile ? DeviceFrontend(ctx, KernelDecls, inFile->getBuffer(), fileName, headers) : nullptr;
+        if (!mod)
+            std::exit(1);
+        llvm::append_range(dependencies, InputDependencies(fileName, headers));
+
+        for (Kernel& kernel : KernelDecls) {
+            if (kernel.kTemplate)
+                continue;
+            auto [previous, inserted] = kernelFiles.try_emplace(kernel.kName, fileName);
+            if (!inserted) {
+                PrintError("Kernel `{}` is defined in both `{}` and `{}`\n", kernel.kName, previous->second, fileName);
+                std::exit(1);
+            }
+
+            std::unique_ptr<llvm::Module> kernelMod = SplitKernelModule(*mod, kernel.kName);
+            if (unsigned optLevel = DeviceOptLevel(); optLevel > 0)
+                openclc::OptimizeModule(*kernelMod, optLevel);
+
+            std::string& bitcode = bitcodes.emplace_back();
+            llvm::raw_string_ostream os(bitcode);
+            llvm::WriteBitcodeToFile(*kernelMod, os);
+            os.flush();
+            kernels.push_back(std::move(kernel));
+        }
+    }
+
+    std::vector<openclc::DeviceLibrary::Member> members;
+    for (std::size_t i = 0; i < kernels.size(); i++)
+        members.push_back({ kernels[i].kName, KernelLibraryMetadata(kernels[i]), bitcodes[i] });
+
+    std::string error;
+    if (!openclc::DeviceLibrary::write(OutputFileName, DeviceLibraryProducer(), members, error)) {
+        PrintError("Failed to write device library `{}`: {}\n", std::string(OutputFileName), error);
         std::exit(1);
     }
-#else
-    int _err = readlink("/proc/self/exe", exePath, sizeof(exePath));
-    if (_err == -1) {
-        fmt::print(err, "readlink(\"/proc/self/exe\") failed with exit code {}\n", _err);
+    if (Verbose)
+        Print("Debug: Wrote {} kernels to device library `{}`\n", kernels.size(), std::string(OutputFileName));
+}
+
+/// The link unit of `--device-link`, a generated source holding the SPIR-V and program shared by all inputs
+static constexpr llvm::StringLiteral DeviceLinkSourcePath = "./openclc-tmp/__openclc_device_link.c";
+
+/// Compiles the device code of all inputs into one program, for `--device-link`
+///
+/// The modules of all files are linked into one, so the whole program is optimized together and identical helpers are kept once.
+/// Kernels that compile to the same IR in several files are compiled and given a stub once, a different definition of the same kernel is an error.
+/// Launched library kernels are linked in as well, their stubs are generated in the link unit.
+/// The stubs of every file share the `__openclc_build_prog` of the link unit, which comes last in the returned sources.
+/// All device code is compiled again on every run, the SPIR-V cache and `-j` don't apply. Failures are reported and give `std::nullopt`.
+std::optional<std::vector<GeneratedSource>> CompileFilesLinked(llvm::ArrayRef<std::string> fileNames)
+{
+    struct LinkedInput {
+        std::unique_ptr<llvm::MemoryBuffer> contents;
+        std::vector<SourceReplacement> launches;
+        std::vector<Kernel> KernelDecls;
+        /// Kernels an earlier input defines the same way, along with their stubs
+        llvm::StringSet<> duplicateKernels;
+    };
+
+    llvm::LLVMContext ctx;
+    std::unique_ptr<llvm::Module> linked;
+    std::vector<LinkedInput> inputs(fileNames.size());
+    std::vector<GeneratedSource> generatedSources;
+    std::vector<Kernel> allKernels;
+    // kernel name -> file defining it and `KernelIRFingerprint`
+    llvm::StringMap<std::pair<std::string, std::string>> kernelDefinitions;
+
+    for (std::size_t i = 0; i < fileNames.size(); i++) {
+        const std::string& fileName = fileNames[i];
+        LinkedInput& input = inputs[i];
+        input.contents = ReadInputFile(fileName);
+        if (!input.contents)
+            return std::nullopt;
+        llvm::StringRef fileContents = input.contents->getBuffer();
+        std::optional<std::vector<SourceReplacement>> launches = FindKernelInvocations(fileContents, fileName);
+        if (!launches)
+            return std::nullopt;
+        input.launches = std::move(*launches);
+
+        std::vector<std::string> headers;
+        std::unique_ptr<llvm::Module> mod = DeviceFrontend(ctx, input.KernelDecls, fileContents, fileName, headers, IsKernelLive);
+        if (!mod || !RejectLibraryKernelDefinitions(input.KernelDecls, fileName))
+            return std::nullopt;
+        generatedSources.push_back({ fmt::format("./openclc-tmp/{}", GeneratedSourceName(fileName)), InputDependencies(fileName, headers) });
+        ReportDeadKernels(input.KernelDecls, fileName);
+
+        for (const Kernel& kernel : input.KernelDecls) {
+            if (!IsKernelLive(kernel))
+                continue;
+            std::string fingerprint = KernelIRFingerprint(*mod, kernel.kName);
+            auto [definition, inserted] = kernelDefinitions.try_emplace(kernel.kName, fileName, fingerprint);
+            if (inserted) {
+                allKernels.push_back(kernel);
+                continue;
+            }
+            if (definition->second.second != fingerprint) {
+                PrintError("Kernel `{}` is defined differently in `{}` and `{}`, or compiled against different types or macros\n", kernel.kName, definition->second.first, fileName);
+                return std::nullopt;
+            }
+            mod->getFunction(kernel.kName)->deleteBody();
+            input.duplicateKernels.insert(kernel.kName);
+        }
+
+        // Like a C linker, `static` helpers and variables are renamed if they clash, the others resolve the declarations of other files
+        if (!linked) {
+            linked = std::move(mod);
+        } else if (llvm::Linker::linkModules(*linked, std::move(mod))) {
+            PrintError("Linking the device code of `{}` failed\n", fileName);
+            return std::nullopt;
+        }
+    }
+
+    GeneratedSource linkUnit { DeviceLinkSourcePath.str(), {} };
+    std::vector<Kernel> libraryKernels;
+    for (const LibraryKernel* kernel : LaunchedLibraryKernels()) {
+        std::unique_ptr<llvm::Module> mod = LoadLibraryKernel(ctx, *kernel);
+        if (!mod)
+            return std::nullopt;
+        if (llvm::Linker::linkModules(*linked, std::move(mod))) {
+            PrintError("Linking kernel `{}` of device library `{}` failed\n", kernel->kernel.kName, kernel->libraryPath);
+            return std::nullopt;
+        }
+        libraryKernels.push_back(kernel->kernel);
+        allKernels.push_back(kernel->kernel);
+        if (!llvm::is_contained(linkUnit.dependencies, kernel->libraryPath))
+            linkUnit.dependencies.push_back(kernel->libraryPath);
+    }
+
+    // Only kernels are called from the host, once everything is resolved
+    for (llvm::Function& f : linked->functions()) {
+        if (!f.isDeclaration() && f.getCallingConv() != llvm::CallingConv::SPIR_KERNEL)
+            f.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+    for (llvm::GlobalVariable& gv : linked->globals()) {
+        if (!gv.isDeclaration() && !gv.getName().starts_with("llvm."))
+            gv.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+
+    std::optional<std::vector<const SpecConstant*>> specConsts = FileSpecConstants(allKernels);
+    if (!specConsts)
+        return std::nullopt;
+    for (std::size_t i = 0; i < fileNames.size(); i++) {
+        const std::string& outFilePath = generatedSources[i].path;
+        // Stamps vouch for sources generated on their own, which these aren't
+        std::filesystem::remove(DependencyStampPath(outFilePath));
+
+        LinkedInput& input = inputs[i];
+        bool written = WriteHostSource(outFilePath, input.contents->getBuffer(), input.launches, input.KernelDecls, *specConsts, [&](llvm::raw_ostream& out) {
+            WriteLinkedPreambleDeclarations(input.KernelDecls, *specConsts, out);
+            DeclareLibraryKernels(input.launches, out);
+            return true;
+        }, input.duplicateKernels);
+        if (!written)
+            return std::nullopt;
+    }
+
+    // Nothing is launched, so there is no program to build
+    if (allKernels.empty())
+        return generatedSources;
+
+    DeduplicateFunctions(*linked);
+    if (Verbose)
+        Print("Debug: Linked the device code of {} files, {} kernels\n", fileNames.size(), allKernels.size());
+
+    // The kernels are optimized together, so `--emit` writes the linked module as a whole
+    openclc::OptimizationRemarksFile remarks;
+    if (!OpenOptRemarks(remarks, ctx, EmitBasePath(linkUnit.path)))
+        return std::nullopt;
+    std::optional<std::vector<std::vector<uint32_t>>> optSPVs = ModuleToSpv(*linked, DeviceLinkSourcePath.str(), Emit.empty() ? std::string() : EmitBasePath(linkUnit.path));
+    if (!optSPVs)
+        return std::nullopt;
+    if (!Emit.empty())
+        Print("{}{}", SpvSummaryHeader(linkUnit.path), SpvSummaryRows("(linked)", *optSPVs));
+
+    for (std::size_t i = 0; i < SpvVariants().size(); i++)
+        linkUnit.spvBlobs.push_back(SpvBlobPath(linkUnit.path, i).string());
+    bool written = WriteHostSource(linkUnit.path, "", {}, {}, *specConsts, [&](llvm::raw_ostream& out) {
+        if (!WriteSpvVariants(linkUnit.path, *optSPVs, out))
+            return false;
+        WriteKernelInvocationPreamble(*specConsts, out, /*shared=*/true);
+        GenerateKernelStubs(libraryKernels, *specConsts, out);
+        return true;
+    });
+    if (!written)
+        return std::nullopt;
+
+    generatedSources.push_back(std::move(linkUnit));
+    return generatedSources;
+}
+
+/// Runs the whole device pipeline for one input file, unless its generated host source is up to date
+///
+/// Each call owns its `llvm::LLVMContext` and kernel list, so calls for different files may run concurrently. Nothing here exits,
+/// failures are reported and give `std::nullopt` for the caller to stop after the files compiled alongside.
+std::optional<GeneratedSource> CompileFile(const std::string& fileName, openclc::SpvCache* cache)
+{
+    // Write the new contents to ./openclc-tmp/<input_file>.[c,cc,cxx,cpp]
+    GeneratedSource generated { fmt::format("./openclc-tmp/{}", GeneratedSourceName(fileName)), {} };
+    const std::string& outFilePath = generated.path;
+
+    std::vector<std::string> keyParts = DeviceCompilationKey(fileName);
+    for (const SpvVariant& variant : SpvVariants())
+        keyParts.push_back(SpvVariantKey(variant));
+    keyParts.push_back(LoadedDeviceLibraries().key);
+    keyParts.push_back(LaunchedKernels().key);
+    // Sources generated without `--emit` left no files of their stages behind
+    if (!Emit.empty()) {
+        std::string emitKey = "emit";
+        for (EmitKind kind : Emit)
+            emitKey += fmt::format(" {}", static_cast<int>(kind));
+        keyParts.push_back(emitKey + " " + OptRemarksFilter);
+    }
+    std::string key = openclc::SpvCache::hash(std::vector<llvm::StringRef>(keyParts.begin(), keyParts.end()));
+    if (GeneratedSourceIsUpToDate(generated, key)) {
+        if (Verbose)
+            Print("Debug: `{}` is up to date\n", outFilePath);
+        return generated;
+    }
+    // A stale stamp must not vouch for a half written source
+    std::filesystem::remove(DependencyStampPath(outFilePath));
+
+    llvm::LLVMContext ctx;
+    std::vector<Kernel> KernelDecls;
+
+    std::unique_ptr<llvm::MemoryBuffer> inFile = ReadInputFile(fileName);
+    if (!inFile)
+        return std::nullopt;
+    llvm::StringRef fileContents = inFile->getBuffer();
+
+    // Find Cuda style kernel invocations, they are rewritten to standard c function calls in the host source
+    std::optional<std::vector<SourceReplacement>> launches = FindKernelInvocations(fileContents, fileName);
+    if (!launches)
+        return std::nullopt;
+
+    // Find the kernels and compile them to SPIR-V. Launches are host code, so the frontend sees them as is.
+    std::vector<std::string> headers;
+    std::optional<std::vector<std::vector<uint32_t>>> optSPVs;
+    if (cache || !Emit.empty()) {
+        optSPVs = CompileDeviceCodePerKernel(ctx, KernelDecls, fileContents, fileName, outFilePath, headers, Emit.empty() ? cache : nullptr);
+    } else if (std::unique_ptr<llvm::Module> mod = DeviceFrontend(ctx, KernelDecls, fileContents, fileName, headers, IsKernelLive)) {
+        optSPVs = llvm::any_of(KernelDecls, IsKernelLive) ? ModuleToSpv(*mod, fileName) : std::vector<std::vector<uint32_t>>();
+    }
+    if (!optSPVs || !RejectLibraryKernelDefinitions(KernelDecls, fileName))
+        return std::nullopt;
+    generated.dependencies = InputDependencies(fileName, headers);
+    ReportDeadKernels(KernelDecls, fileName);
+
+    // Files that only launch library kernels, or whose kernels are all dropped, embed no SPIR-V of their own
+    bool hasDeviceCode = llvm::any_of(KernelDecls, IsKernelLive);
+    std::optional<std::vector<const SpecConstant*>> specConsts = FileSpecConstants(KernelDecls);
+    if (!specConsts)
+        return std::nullopt;
+    bool written = WriteHostSource(outFilePath, fileContents, *launches, KernelDecls, *specConsts, [&](llvm::raw_ostream& out) {
+        if (hasDeviceCode) {
+            if (!WriteSpvVariants(outFilePath, *optSPVs, out))
+                return false;
+            WriteKernelInvocationPreamble(*specConsts, out);
+        }
+        DeclareLibraryKernels(*launches, out);
+        return true;
+    });
+    if (!written)
+        return std::nullopt;
+    if (hasDeviceCode) {
+        for (std::size_t i = 0; i < SpvVariants().size(); i++)
+            generated.spvBlobs.push_back(SpvBlobPath(outFilePath, i).string());
+    }
+
+    WriteDependencyStamp(generated, key);
+    return generated;
+}
+
+/// Escapes a path for the target or prerequisite list of a Makefile rule
+std::string EscapeMakefilePath(llvm::StringRef path)
+{
+    std::string escaped;
+    escaped.reserve(path.size());
+    for (char c : path) {
+        if (c == ' ' || c == '#')
+            escaped += '\\';
+        else if (c == '$')
+            escaped += '$';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/// Writes a Makefile style depfile to `path`, saying `target` depends on `dependencies`
+void WriteDepFile(const std::string& path, llvm::StringRef target, llvm::ArrayRef<std::string> dependencies)
+{
+    std::error_code ec;
+    llvm::raw_fd_ostream os(path, ec);
+    if (ec) {
+        PrintError("Failed to open `{}`: {}\n", path, ec.message());
         std::exit(1);
     }
-#endif
 
-    std::filesystem::path runtimeSourcesDir(exePath);
+    os << EscapeMakefilePath(target) << ":";
+    for (const std::string& dependency : dependencies)
+        os << " \\\n  " << EscapeMakefilePath(dependency);
+    os << "\n";
+}
 
-    if (std::filesystem::is_symlink(runtimeSourcesDir)) {
-        runtimeSourcesDir = std::filesystem::read_symlink(runtimeSourcesDir);
+/// Whether `output` was linked by `invocation`, recorded in `stampPath`, and is newer than all of `inputs`
+bool HostOutputIsUpToDate(const std::string& output, const std::string& stampPath, llvm::StringRef invocation, llvm::ArrayRef<std::string> inputs)
+{
+    llvm::sys::fs::file_status outStatus;
+    if (llvm::sys::fs::status(output, outStatus))
+        return false;
+
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> stamp = llvm::MemoryBuffer::getFile(stampPath);
+    if (!stamp || (*stamp)->getBuffer() != invocation)
+        return false;
+
+    return llvm::all_of(inputs, [&](const std::string& input) {
+        llvm::sys::fs::file_status status;
+        return !llvm::sys::fs::status(input, status) && status.getLastModificationTime() <= outStatus.getLastModificationTime();
+    });
+}
+
+/// Stamp in `./openclc-tmp` recording the host command that last wrote `output`, `kind` tells objects and executables apart
+std::string HostStampPath(const std::string& output, llvm::StringRef kind)
+{
+    return fmt::format("./openclc-tmp/{}.{}", openclc::SpvCache::hash({ std::filesystem::absolute(output).string() }).substr(0, 16), kind);
+}
+
+/// Runs the host compiler `invocation` that writes `output` from `inputs`, unless the same invocation wrote it after every input changed
+///
+/// Returns false if the host compiler failed. Calls for different outputs may run concurrently.
+bool RunHostCompiler(const std::string& output, llvm::StringRef kind, const std::string& invocation, llvm::ArrayRef<std::string> inputs)
+{
+    std::string stampPath = HostStampPath(output, kind);
+    if (HostOutputIsUpToDate(output, stampPath, invocation, inputs)) {
+        if (Verbose)
+            Print("Debug: `{}` is up to date\n", output);
+        return true;
     }
+    std::filesystem::remove(stampPath);
 
-    runtimeSourcesDir.remove_filename();
+    if (Verbose)
+        Print("Debug: Host compiler invocation '{}'\n", invocation);
+    openclc::TimeRegion region(kind == "link" ? "Host link" : "Host compile", output);
+    if (std::system(invocation.c_str()) != 0)
+        return false;
+
+    std::ofstream stamp(stampPath);
+    stamp << invocation;
+    return true;
+}
 
-    return runtimeSourcesDir;
+/// Flags the generated sources are compiled with: the runtime headers, `-I`, `-D` and `-g`
+const std::string& HostCompilerFlags()
+{
+    static const std::string flags = [] {
+        std::string flags = fmt::format("-I{}", GetRuntimeSourcesDir().string());
+        for (const std::string& include : Includes)
+            flags.append(" -I" + include);
+        for (const std::string& define : Defines)
+            flags.append(" -D" + define);
+        if (Debug)
+            flags.append(" -g");
+        return flags;
+    }();
+    return flags;
 }
 
-static void PrintVersion(llvm::raw_ostream& ros)
+/// Host compiler of a generated source, `--cxxbin` for the `.cpp` ones of `.clpp` inputs
+std::string HostCompiler(llvm::StringRef generatedPath)
 {
-    ros << OPENCLC_VERSION << "\n";
+    return generatedPath.ends_with(".cpp") ? std::string(CXXBin) : std::string(CCBin);
 }
 
-int main(int argc, const char** argv)
+/// Path of `openclc_rt.c` compiled into a static library, built the first time this host compiler, archiver and `-g` are used
+///
+/// The library is kept in `--cache-dir`, where it is evicted like the SPIR-V, or in `./openclc-tmp` without one, under a
+/// name hashed from the runtime sources and the tools. It is built under a unique name and renamed into place, so concurrent openclc processes can share it.
+/// Returns an empty path if it couldn't be built.
+std::string RuntimeLibrary()
 {
-    cli::SetVersionPrinter(PrintVersion);
-    cli::HideUnrelatedOptions(OpenCLCOptions);
-    cli::ParseCommandLineOptions(argc, argv, "OpenCL Compiler");
+    std::filesystem::path runtimeSourceDir = GetRuntimeSourcesDir();
+    std::string runtimeSource = (runtimeSourceDir / "openclc_rt.c").string();
+    std::unique_ptr<llvm::MemoryBuffer> source = ReadInputFile(runtimeSource);
+    std::unique_ptr<llvm::MemoryBuffer> header = ReadInputFile((runtimeSourceDir / "openclc_rt.h").string());
+    if (!source || !header)
+        return "";
+
+    std::string flags = fmt::format("-I{}{}", runtimeSourceDir.string(), Debug ? " -g" : "");
+    std::string key = openclc::SpvCache::hash({ DeviceLibraryProducer(), CCBin, ARBin, flags, source->getBuffer(), header->getBuffer() });
+    std::filesystem::path dir = CacheDir.empty() ? std::filesystem::path("./openclc-tmp") : std::filesystem::path(std::string(CacheDir));
+    std::string library = (dir / fmt::format("libopenclc_rt-{}.a", key.substr(0, 16))).string();
+    std::error_code ec;
+    if (std::filesystem::exists(library)) {
+        if (Verbose)
+            Print("Debug: Using the runtime library `{}`\n", library);
+        // Marks the library as recently used for `SpvCache::evict`
+        std::filesystem::last_write_time(library, std::filesystem::file_time_type::clock::now(), ec);
+        return library;
+    }
 
-    llvm::LLVMContext ctx;
+    // Temporaries end in `.tmp`, so the cache cleans up after interrupted builds
+    std::filesystem::create_directories(dir, ec);
+    llvm::SmallString<256> unique;
+    llvm::sys::fs::createUniquePath(library + ".%%%%%%%%", unique, /*MakeAbsolute=*/false);
+    std::string object = unique.str().str() + ".o.tmp";
+    std::string archive = unique.str().str() + ".a.tmp";
+
+    std::string compile = fmt::format("{} -c {} {} -o {}", std::string(CCBin), runtimeSource, flags, object);
+    std::string archiveInvocation = fmt::format("{} rcs {} {}", std::string(ARBin), archive, object);
+    if (Verbose)
+        Print("Debug: Building the runtime library with '{}' and '{}'\n", compile, archiveInvocation);
+    openclc::TimeRegion region("Runtime library", library);
+    bool built = std::system(compile.c_str()) == 0 && std::system(archiveInvocation.c_str()) == 0;
+    std::filesystem::remove(object, ec);
+    if (built)
+        std::filesystem::rename(archive, library, ec);
+    if (!built || ec) {
+        std::filesystem::remove(archive, ec);
+        return "";
+    }
+    return library;
+}
+
+/// Runs an invocation on the parsed command line, in process or in a child of `--daemon`
+int Compile()
+{
+    if (InputFilenames.empty()) {
+        PrintError("No input files\n");
+        return 1;
+    }
+
+    SpvVariants(); // exits on malformed variants before any work is done
+
+    std::vector<std::string> sourceFiles;
+    std::vector<std::string> objectFiles;
+    for (const std::string& input : InputFilenames) {
+        if (IsObjectInput(input))
+            objectFiles.push_back(input);
+        else if (!IsDeviceLibraryInput(input))
+            sourceFiles.push_back(input);
+    }
+    if (sourceFiles.empty() && (objectFiles.empty() || BuildLibrary || CompileOnly)) {
+        PrintError("No source files given, device libraries and objects are only linked into an executable\n");
+        std::exit(1);
+    }
+    if (CompileOnly) {
+        if (DeviceLink || BuildLibrary) {
+            PrintError("`-c` compiles every input on its own, it can't be combined with --device-link or --device-library\n");
+            std::exit(1);
+        }
+        if (!objectFiles.empty()) {
+            PrintError("`-c` compiles sources, objects are only linked\n");
+            std::exit(1);
+        }
+        if (sourceFiles.size() > 1 && (OutputFileName.getNumOccurrences() || !DepFileName.empty())) {
+            PrintError("`-o` and `-MF` name a single output, they can't be used with `-c` and several inputs\n");
+            std::exit(1);
+        }
+    }
+    LoadedDeviceLibraries(); // exits on unreadable libraries before any work is done
+    // The files' compiles share these and only report their own errors, so they are computed before any compile starts
+    LaunchedKernels(); // exits on unreadable inputs and invalid launches
+    for (const std::string& input : sourceFiles) {
+        GeneratedSourceName(input); // exits on inputs that aren't OpenCL C or C++ for OpenCL
+        DevicePreludeHeaders(input); // exits on a prelude that doesn't preprocess
+    }
+
+    std::filesystem::create_directory("./openclc-tmp");
+
+    if (BuildLibrary) {
+        std::vector<std::string> dependencies;
+        BuildDeviceLibrary(sourceFiles, dependencies);
+        if (DepFile || !DepFileName.empty())
+            WriteDepFile(DepFileName.empty() ? OutputFileName + ".d" : std::string(DepFileName), OutputFileName, dependencies);
+        return 0;
+    }
 
-    std::vector<std::string> hostCompilerInputFiles;
+    std::unique_ptr<openclc::SpvCache> cache;
+    if (!CacheDir.empty()) {
+        cache = std::make_unique<openclc::SpvCache>(std::string(CacheDir), std::uintmax_t(CacheMaxSize) * 1024 * 1024);
+        if (Verbose)
+            Print("Debug: Using SPIR-V cache at '{}'\n", std::string(CacheDir));
+    }
+
+    std::filesystem::path runtimeSourceDir = GetRuntimeSourcesDir();
+    std::string runtimeSource = (runtimeSourceDir / "openclc_rt.c").string();
+    std::string runtimeHeader = (runtimeSourceDir / "openclc_rt.h").string();
+    HostCompilerFlags(); // computed once, before the host compiles that share it start
+
+    // Generated sources are compiled to objects as soon as they are written, while the device compiles of other files go on.
+    // The host compiler runs out of process, so its threads are only waiting.
+    llvm::ThreadPool hostPool(llvm::hardware_concurrency(Jobs));
+    std::atomic<bool> hostFailed = false;
+    std::shared_future<std::string> runtimeLibrary;
+    if (!CompileOnly)
+        runtimeLibrary = hostPool.async([] {
+            openclc::TimeTraceThread traceThread;
+            return RuntimeLibrary();
+        });
+
+    // With `-c` the objects are the outputs, named like a C compiler names them. Otherwise they are linked from `./openclc-tmp`.
+    auto hostObjectPath = [](const GeneratedSource& generated, const std::string& input) {
+        if (!CompileOnly)
+            return generated.path + ".o";
+        if (OutputFileName.getNumOccurrences())
+            return std::string(OutputFileName);
+        return std::filesystem::path(input).filename().replace_extension(".o").string();
+    };
+    auto compileHostObject = [&hostPool, &hostFailed, &runtimeHeader](const GeneratedSource& generated, const std::string& object) {
+        hostPool.async([&hostFailed, &runtimeHeader, generated, object] {
+            openclc::TimeTraceThread traceThread;
+            std::vector<std::string> inputs = { generated.path, runtimeHeader };
+            llvm::append_range(inputs, generated.spvBlobs);
+            std::string invocation = fmt::format("{} -c {} {} -o {}", HostCompiler(generated.path), generated.path, HostCompilerFlags(), object);
+            if (!RunHostCompiler(object, "obj", invocation, inputs))
+                hostFailed = true;
+        });
+    };
+
+    // Slots are indexed by input position so the host linker sees the same order for any `-j`
+    std::vector<GeneratedSource> generatedSources(sourceFiles.size());
+    // Host compiles already started are finished before failing, they may be writing objects
+    auto fail = [&hostPool] {
+        hostPool.wait();
+        return 1;
+    };
 
     // For each file
     //     Read the contents manually
     //     Get the KernelDecls and compile the sources to spv
     //     Replace the decl in the source with a cpu function that invokes the kernel
-    for (std::string fileName : InputFilenames) {
-        // Read file contents
-        std::ifstream inFileStream(fileName);
-        std::size_t fSize = std::filesystem::file_size(fileName);
-        std::string fileContents(fSize, '\0');
-        inFileStream.read(&fileContents[0], fSize);
-
-        // Transform Cuda kernel declarations to standard c function calls
-        fileContents = transformKernelInvocations(fileContents);
-
-        // Get Device Code
-        std::string deviceCode = ExtractDeviceCode(ctx, fileContents, fileName);
-
-        // Compile device sources
-        std::unique_ptr<llvm::Module> mod = SourceToModule(ctx, deviceCode, fileName);
-
-        // Compile device code in LLVM IR to SPIR-V
-        membuf mbuf;
-        std::ostream os(&mbuf);
-        SPIRV::TranslatorOpts translatorOptions(SpvVersion);
-        std::string llvmSpirvCompilationErrors;
-        bool success = llvm::writeSpirv(&*mod, translatorOptions, os, llvmSpirvCompilationErrors);
-        if (!success) {
-            fmt::print(err, "{}\n", llvmSpirvCompilationErrors);
-            return 1;
+    //     Hand the generated source to the host compiler
+    if (DeviceLink) {
+        std::optional<std::vector<GeneratedSource>> linked = CompileFilesLinked(sourceFiles);
+        if (!linked)
+            return fail();
+        generatedSources = std::move(*linked);
+        for (const GeneratedSource& generated : generatedSources)
+            compileHostObject(generated, hostObjectPath(generated, ""));
+    } else if (Jobs == 1 || sourceFiles.size() == 1) {
+        for (std::size_t i = 0; i < sourceFiles.size(); i++) {
+            std::optional<GeneratedSource> generated = CompileFile(sourceFiles[i], cache.get());
+            if (!generated)
+                return fail();
+            generatedSources[i] = std::move(*generated);
+            compileHostObject(generatedSources[i], hostObjectPath(generatedSources[i], sourceFiles[i]));
         }
-
-        assert(mbuf.vec.size() % 4 == 0 && "Generated SPIR-V is corrupt, exiting.");
-        std::vector<uint32_t> optSPV;
-
-        // Optimize SPIR-V
-        spv_target_env env;
-        switch (SpvVersion) {
-        case SPIRV::VersionNumber::SPIRV_1_0:
-            env = SPV_ENV_UNIVERSAL_1_0;
-        case SPIRV::VersionNumber::SPIRV_1_1:
-            env = SPV_ENV_UNIVERSAL_1_1;
-        case SPIRV::VersionNumber::SPIRV_1_2:
-            env = SPV_ENV_UNIVERSAL_1_2;
-        case SPIRV::VersionNumber::SPIRV_1_3:
-            env = SPV_ENV_UNIVERSAL_1_3;
-        case SPIRV::VersionNumber::SPIRV_1_4:
-            env = SPV_ENV_UNIVERSAL_1_4;
-        case SPIRV::VersionNumber::SPIRV_1_5:
-            env = SPV_ENV_UNIVERSAL_1_5;
-        }
-
-        spvtools::Optimizer opt(env);
-        opt.RegisterPerformancePasses(!Debug);
-        opt.SetMessageConsumer(optimizerMessageConsumer);
-        opt.SetValidateAfterAll(true);
-        success = opt.Run(reinterpret_cast<const uint32_t*>(mbuf.vec.data()), mbuf.vec.size() / 4, &optSPV);
-        if (!success) {
-            fmt::print(err, "Optimization Passes for `a.out` failed\n");
-            return 1;
+    } else {
+        llvm::ThreadPool pool(llvm::hardware_concurrency(Jobs));
+        if (Verbose)
+            Print("Debug: Compiling {} files on {} threads\n", sourceFiles.size(), pool.getThreadCount());
+
+        // Every file is compiled even if another fails, so all errors are reported. Their output is printed in input order.
+        std::vector<std::string> outputs(sourceFiles.size());
+        // Not `std::vector<bool>`, whose packed elements can't be set from several threads
+        std::vector<char> failed(sourceFiles.size(), false);
+        for (std::size_t i = 0; i < sourceFiles.size(); i++) {
+            pool.async([&generatedSources, &sourceFiles, &cache, &hostObjectPath, &compileHostObject, &outputs, &failed, i] {
+                openclc::TimeTraceThread traceThread;
+                TaskOutput = &outputs[i];
+                std::optional<GeneratedSource> generated = CompileFile(sourceFiles[i], cache.get());
+                TaskOutput = nullptr;
+                if (!generated) {
+                    failed[i] = true;
+                    return;
+                }
+                generatedSources[i] = std::move(*generated);
+                compileHostObject(generatedSources[i], hostObjectPath(generatedSources[i], sourceFiles[i]));
+            });
         }
+        pool.wait();
 
-        // Convert generated SPIR-V to a c initializer list
-        std::stringstream spvInitListStream;
-        spvInitListStream << "static const unsigned char __spv_bin[] = {";
-        const uint8_t* optSpvBytePtr = reinterpret_cast<const uint8_t*>(optSPV.data());
-        for (int byte_i = 0; byte_i < optSPV.size() * 4; byte_i++) {
-            spvInitListStream << "0x" << std::hex << (int)optSpvBytePtr[byte_i] << ",";
-        }
-        spvInitListStream << "};\n";
-        std::string spvInitList = spvInitListStream.str();
+        for (const std::string& output : outputs)
+            fmt::print("{}", output);
+        if (llvm::is_contained(failed, true))
+            return fail();
+    }
 
-        // Write the new contents to ./openclc-tmp/<input_file>.[c,cc,cxx,cpp]
-        std::filesystem::create_directory("./openclc-tmp");
-        std::string outFileName = std::string(std::filesystem::path(fileName).filename().string());
-        if (outFileName.ends_with(".cl")) {
-            outFileName.replace(outFileName.size() - 3, 3, ".c");
-        } else if (outFileName.ends_with(".ocl")) {
-            outFileName.replace(outFileName.size() - 4, 4, ".c");
-        } else {
-            fmt::print(err, "Wrong File Extension for file, {}", outFileName);
-            std::exit(1);
+    // The library kernels launched anywhere get their stubs and program in one more generated source. With `-c` the sources
+    // only declare them, the invocation linking the objects defines them once.
+    if (!DeviceLink && !CompileOnly && !LoadedDeviceLibraries().kernels.empty()) {
+        std::vector<const LibraryKernel*> launched = LaunchedLibraryKernels();
+        if (!launched.empty()) {
+            std::optional<GeneratedSource> generated = CompileLibraryKernels(launched);
+            if (!generated)
+                return fail();
+            generatedSources.push_back(std::move(*generated));
+            compileHostObject(generatedSources.back(), hostObjectPath(generatedSources.back(), ""));
         }
-        std::string outFilePath = fmt::format("./openclc-tmp/{}", outFileName);
-        hostCompilerInputFiles.push_back(outFilePath);
+    }
 
-        std::ofstream postProcessedOutFile(outFilePath);
-        postProcessedOutFile.write(spvInitList.c_str(), spvInitList.size());
-        std::size_t offset = 0;
-        for (auto kDecl : KernelDecls) {
-            std::size_t start = kDecl.beginSourceOffset(fileContents);
-            std::size_t end = kDecl.endSourceOffset(fileContents);
+    if (cache)
+        cache->evict();
 
-            postProcessedOutFile.write(fileContents.c_str() + offset, start); // write until kernel start
+    if (Verbose)
+        Print("Debug: Peak compiler memory {:.1f} MiB\n", openclc::PeakMemoryUsage() / (1024.0 * 1024.0));
 
-            std::string replacementRoutine = GenerateKernelInvocation(kDecl); // write new invocation
-            postProcessedOutFile.write(replacementRoutine.c_str(), replacementRoutine.size());
+    hostPool.wait();
+    if (hostFailed)
+        return 1;
 
-            offset += end + 1; // move fileContents offset to start after the kernel
-        }
-        if (offset != fileContents.size()) { // we may have some source left to write out
-            postProcessedOutFile.write(fileContents.c_str() + offset, fileContents.size() - offset);
+    if (CompileOnly) {
+        if (DepFile || !DepFileName.empty()) {
+            for (std::size_t i = 0; i < sourceFiles.size(); i++) {
+                std::string object = hostObjectPath(generatedSources[i], sourceFiles[i]);
+                std::vector<std::string> dependencies = generatedSources[i].dependencies;
+                dependencies.push_back(runtimeHeader);
+                // Next to the object under its stem, as C compilers name it
+                WriteDepFile(DepFileName.empty() ? std::filesystem::path(object).replace_extension(".d").string() : std::string(DepFileName), object, dependencies);
+            }
         }
-
-        KernelDecls = std::vector<Kernel>();
+        return 0;
     }
 
-    // Invoke host compiler on the generated file
-    std::filesystem::path runtimeSourceDir = GetRuntimeSourcesDir();
-    std::filesystem::path runtimeSource(runtimeSourceDir);
-    runtimeSource.append("openclc_rt.c");
-
-    std::string hostCompilerInputs;
-    for (auto hostCompilerInput : hostCompilerInputFiles) {
-        hostCompilerInputs.append(hostCompilerInput);
-        hostCompilerInputs.push_back(' ');
+    std::string runtimeLibraryPath = runtimeLibrary.get();
+    if (runtimeLibraryPath.empty()) {
+        PrintError("Failed to build the runtime library with `{}` and `{}`\n", std::string(CCBin), std::string(ARBin));
+        return 1;
     }
 
-    std::string includesAndDefines;
-    for (auto include : Includes) {
-        includesAndDefines.append("-I");
-        includesAndDefines.append(include);
-        includesAndDefines.push_back(' ');
+    // Link the objects, the runtime comes last so the stubs resolve against it. C++ objects need the C++ standard library.
+    std::vector<std::string> linkInputs;
+    bool linksCXX = false;
+    for (const GeneratedSource& generated : generatedSources) {
+        linkInputs.push_back(hostObjectPath(generated, ""));
+        linksCXX |= llvm::StringRef(generated.path).ends_with(".cpp");
     }
-    for (auto define : Defines) {
-        includesAndDefines.append("-D");
-        includesAndDefines.append(define);
-        includesAndDefines.push_back(' ');
+    llvm::append_range(linkInputs, objectFiles);
+    linksCXX = linksCXX || llvm::any_of(objectFiles, IsCXXObject);
+    std::string hostLinkInvocation = fmt::format("{} {} {} -lOpenCL -o {}", std::string(linksCXX ? CXXBin : CCBin), fmt::join(linkInputs, " "), runtimeLibraryPath, std::string(OutputFileName));
+    linkInputs.push_back(runtimeLibraryPath);
+
+    if (DepFile || !DepFileName.empty()) {
+        std::vector<std::string> dependencies;
+        llvm::StringSet<> seen;
+        for (const GeneratedSource& generated : generatedSources) {
+            for (const std::string& dependency : generated.dependencies) {
+                if (seen.insert(dependency).second)
+                    dependencies.push_back(dependency);
+            }
+        }
+        llvm::append_range(dependencies, objectFiles);
+        dependencies.push_back(runtimeSource);
+        dependencies.push_back(runtimeHeader);
+        WriteDepFile(DepFileName.empty() ? OutputFileName + ".d" : std::string(DepFileName), OutputFileName, dependencies);
     }
 
-    // TODO: pass on Defines, Includes, and Debug.
-    std::string hostCompilerInvocation = fmt::format("{} {} {} -I{} {} -lOpenCL -o {}", CCBin, hostCompilerInputs, runtimeSource.string(), runtimeSourceDir.string(), includesAndDefines, OutputFileName);
-    if (Verbose)
-        fmt::print("Debug: Host compiler invocation '{}'\n", hostCompilerInvocation);
-    std::system(hostCompilerInvocation.c_str());
+    // The host linker is skipped when the output was linked by the same command from the current objects
+    if (!RunHostCompiler(OutputFileName, "link", hostLinkInvocation, linkInputs))
+        return 1;
+    return 0;
+}
+
+/// `Compile` under `--time-report` and `--time-trace`, which are written when it returns
+///
+/// Invocations that fail with an error exit before that, and leave neither.
+int CompileWithReports()
+{
+    if (!TimeTrace.empty())
+        openclc::StartTimeTrace(TimeTraceGranularity);
+    if (TimeReport)
+        openclc::StartTimeReport();
+
+    int status = Compile();
+
+    if (TimeReport)
+        Print("{}", openclc::FormatTimeReport());
+    std::string error;
+    if (!TimeTrace.empty() && !openclc::FinishTimeTrace(TimeTrace, error)) {
+        PrintError("Failed to write the time trace '{}': {}\n", std::string(TimeTrace), error);
+        return 1;
+    }
+    return status;
+}
+
+/// `--daemon`: precompiles the device headers for the daemon's flags, then compiles the requests of other invocations
+///
+/// The PCHs go to `--cache-dir`, or to a directory next to the socket without one, so every request reuses them. Requests
+/// only use a SPIR-V cache if their own flags or environment ask for one, as they would when compiled in process.
+int ServeCompiles(const std::string& socketPath)
+{
+    DaemonPCHDir = std::filesystem::absolute(CacheDir.empty() ? socketPath + ".pch" : std::string(CacheDir) + "/pch").string();
+
+    // A prelude may change between requests, so only the headers every compile shares are warmed up
+    // A PCH that failed would be inherited as failed by every child, without its errors
+    if (DevicePrelude.empty() && (DevicePCH("openclc-daemon.cl").empty() || DevicePCH("openclc-daemon.clpp").empty()))
+        return 1;
+
+    return openclc::RunDaemon(socketPath, [&](llvm::ArrayRef<const char*> argv) {
+        // Options keep their values across parses, and `--cache-dir` defaults to the client's `$OPENCLC_CACHE_DIR`
+        cli::ResetAllOptionOccurrences();
+        CacheDir.setInitialValue(std::getenv("OPENCLC_CACHE_DIR") ? std::getenv("OPENCLC_CACHE_DIR") : "");
+        if (!cli::ParseCommandLineOptions(argv.size(), argv.data(), "OpenCL Compiler", &llvm::errs()))
+            return 1;
+        return CompileWithReports();
+    });
+}
+
+int main(int argc, const char** argv)
+{
+    cli::SetVersionPrinter(PrintVersion);
+    cli::HideUnrelatedOptions(OpenCLCOptions);
+    cli::ParseCommandLineOptions(argc, argv, "OpenCL Compiler");
+
+    std::string socketPath = DaemonSocket.empty() ? openclc::DefaultDaemonSocketPath(DeviceLibraryProducer()) : std::string(DaemonSocket);
+    if (Daemon)
+        return ServeCompiles(socketPath);
+
+    // A running daemon compiles with its warm state, the same command line gives the same outputs either way
+    if (!NoDaemon) {
+        if (std::optional<int> status = openclc::ForwardToDaemon(socketPath, llvm::ArrayRef(argv, argc))) {
+            if (Verbose)
+                Print("Debug: Compiled by the daemon on '{}'\n", socketPath);
+            return *status;
+        }
+    }
+    return CompileWithReports();
 }
@@ -1,7 +1,13 @@
 #include "openclc_rt.h"
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 
 static cl_device_id dev = NULL;
 static cl_context ctx = NULL;
@@ -77,6 +83,7 @@ const char* opencl_errstr(cl_int err)
         CaseReturnString(CL_INVALID_COMPILER_OPTIONS);
         CaseReturnString(CL_INVALID_LINKER_OPTIONS);
         CaseReturnString(CL_INVALID_DEVICE_PARTITION_COUNT);
+        CaseReturnString(CL_INVALID_SPEC_ID);
     default:
         return "Unknown OpenCL error code";
     }
@@ -139,6 +146,59 @@ static int get_first_gpu()
     return 1;
 }
 
+/// SPIR-V versions the device accepts, encoded as in the module header
+///
+/// Queried by `oclcInit` and only read afterwards, so kernels may be launched from several threads.
+static cl_uint* spv_versions = NULL;
+static size_t n_spv_versions = 0;
+
+static void add_spv_version(cl_uint major, cl_uint minor)
+{
+    spv_versions = (cl_uint*)realloc(spv_versions, (n_spv_versions + 1) * sizeof(cl_uint));
+    spv_versions[n_spv_versions++] = (major << 16) | (minor << 8);
+}
+
+static int query_spv_versions()
+{
+    cl_int err;
+    size_t size = 0;
+
+    // OpenCL 3.0 reports numeric versions
+    err = clGetDeviceInfo(dev, CL_DEVICE_ILS_WITH_VERSION, 0, NULL, &size);
+    if (err == CL_SUCCESS && size > 0) {
+        cl_name_version* ils = (cl_name_version*)malloc(size);
+        err = clGetDeviceInfo(dev, CL_DEVICE_ILS_WITH_VERSION, size, ils, NULL);
+        CL_CHECK(err)
+        for (size_t i = 0; i < size / sizeof(cl_name_version); i++) {
+            if (strcmp(ils[i].name, "SPIR-V") == 0)
+                add_spv_version(CL_VERSION_MAJOR(ils[i].version), CL_VERSION_MINOR(ils[i].version));
+        }
+        free(ils);
+        return 0;
+    }
+
+    // OpenCL 2.1 and 2.2, and 1.2 devices with cl_khr_il_program, only have a list like "SPIR-V_1.0 SPIR-V_1.1".
+    // Other 1.2 devices reject the query, they accept no SPIR-V.
+    err = clGetDeviceInfo(dev, CL_DEVICE_IL_VERSION_KHR, 0, NULL, &size);
+    if (err != CL_SUCCESS || size == 0)
+        return 0;
+    char* ils = (char*)malloc(size + 1);
+    err = clGetDeviceInfo(dev, CL_DEVICE_IL_VERSION_KHR, size, ils, NULL);
+    if (err != CL_SUCCESS) {
+        free(ils);
+        return 0;
+    }
+    ils[size] = '\0';
+
+    for (char* il = strtok(ils, " "); il != NULL; il = strtok(NULL, " ")) {
+        unsigned major, minor;
+        if (sscanf(il, "SPIR-V_%u.%u", &major, &minor) == 2)
+            add_spv_version(major, minor);
+    }
+    free(ils);
+    return 0;
+}
+
 int oclcInit()
 {
     int _err = get_first_gpu();
@@ -155,6 +215,9 @@ int oclcInit()
     queue = clCreateCommandQueueWithProperties(ctx, dev, NULL, &err);
     CL_CHECK(err)
 
+    if (query_spv_versions() != 0)
+        return 1;
+
     cl_initialized = true;
 
     return 0;
@@ -231,13 +294,25 @@ void oclcCrash()
 #endif
 }
 
-int oclcBuildSpv(const unsigned char* spv, size_t spv_size, cl_program* prog)
+/// Creates a program from `spv`, applies the set specialization constants in `consts` and builds it
+static int build_spv(const unsigned char* spv, size_t spv_size, const OclcSpecConst* consts, size_t n_consts, cl_program* prog)
 {
     // TODO: Fallback to use of kernel source if SPV isn't supported
 
     cl_int err;
     *prog = clCreateProgramWithIL(ctx, spv, spv_size, &err);
     CL_CHECK(err);
+
+    for (size_t i = 0; i < n_consts; i++) {
+        if (consts[i].value == NULL)
+            continue;
+        err = clSetProgramSpecializationConstant(*prog, consts[i].id, consts[i].size, consts[i].value);
+        // constants that no kernel reads are optimized out of the module, setting them is a no-op
+        if (err == CL_INVALID_SPEC_ID)
+            continue;
+        CL_CHECK(err)
+    }
+
     err = clBuildProgram(*prog, 1, &dev, NULL, NULL, NULL);
 
     // since we use validated SPIR-V, this is unlikely to fail.
@@ -258,6 +333,128 @@ int oclcBuildSpv(const unsigned char* spv, size_t spv_size, cl_program* prog)
     return 0;
 }
 
+int oclcBuildSpv(const unsigned char* spv, size_t spv_size, cl_program* prog)
+{
+    return build_spv(spv, spv_size, NULL, 0, prog);
+}
+
+const OclcSpvVariant* oclcSelectSpvVariant(const OclcSpvVariant* variants, size_t n_variants)
+{
+    const OclcSpvVariant* best = NULL;
+    for (size_t i = 0; i < n_variants; i++) {
+        for (size_t j = 0; j < n_spv_versions; j++) {
+            if (variants[i].version == spv_versions[j] && (best == NULL || variants[i].version > best->version))
+                best = &variants[i];
+        }
+    }
+
+    if (best == NULL) {
+        fputs("The OpenCL device accepts none of the embedded SPIR-V versions:", stderr);
+        for (size_t i = 0; i < n_variants; i++)
+            fprintf(stderr, " %u.%u", (unsigned)(variants[i].version >> 16), (unsigned)(variants[i].version >> 8) & 0xff);
+        fputs("\n", stderr);
+        oclcCrash();
+    }
+    return best;
+}
+
+/// A program built by `oclcBuildSpecializedSpv`
+///
+/// `values` holds a set flag for every constant, followed by its value if it was set.
+typedef struct {
+    const unsigned char* spv;
+    unsigned char* values;
+    size_t values_size;
+    cl_program prog;
+} SpecializedProgram;
+
+/// Guarded by `spec_lock`, like the values of the specialization constants the generated setters write
+static SpecializedProgram* specialized_progs = NULL;
+static size_t n_specialized_progs = 0;
+
+#if defined(_WIN32)
+static SRWLOCK spec_lock = SRWLOCK_INIT;
+
+void oclcLockSpecConsts()
+{
+    AcquireSRWLockExclusive(&spec_lock);
+}
+
+void oclcUnlockSpecConsts()
+{
+    ReleaseSRWLockExclusive(&spec_lock);
+}
+#else
+static pthread_mutex_t spec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void oclcLockSpecConsts()
+{
+    pthread_mutex_lock(&spec_lock);
+}
+
+void oclcUnlockSpecConsts()
+{
+    pthread_mutex_unlock(&spec_lock);
+}
+#endif
+
+static bool spec_values_match(const SpecializedProgram* sp, const OclcSpecConst* consts, size_t n_consts)
+{
+    size_t pos = 0;
+    for (size_t i = 0; i < n_consts; i++) {
+        bool set = consts[i].value != NULL;
+        if (pos >= sp->values_size || sp->values[pos++] != set)
+            return false;
+        if (!set)
+            continue;
+        if (pos + consts[i].size > sp->values_size || memcmp(sp->values + pos, consts[i].value, consts[i].size) != 0)
+            return false;
+        pos += consts[i].size;
+    }
+    return pos == sp->values_size;
+}
+
+static int build_specialized_spv(const unsigned char* spv, size_t spv_size, const OclcSpecConst* consts, size_t n_consts, cl_program* prog)
+{
+    for (size_t i = 0; i < n_specialized_progs; i++) {
+        if (specialized_progs[i].spv == spv && spec_values_match(&specialized_progs[i], consts, n_consts)) {
+            *prog = specialized_progs[i].prog;
+            return 0;
+        }
+    }
+
+    if (build_spv(spv, spv_size, consts, n_consts, prog) != 0)
+        return 1;
+
+    size_t values_size = 0;
+    for (size_t i = 0; i < n_consts; i++)
+        values_size += 1 + (consts[i].value != NULL ? consts[i].size : 0);
+
+    SpecializedProgram sp = { spv, (unsigned char*)malloc(values_size), values_size, *prog };
+    size_t pos = 0;
+    for (size_t i = 0; i < n_consts; i++) {
+        sp.values[pos++] = consts[i].value != NULL;
+        if (consts[i].value != NULL) {
+            memcpy(sp.values + pos, consts[i].value, consts[i].size);
+            pos += consts[i].size;
+        }
+    }
+
+    specialized_progs = (SpecializedProgram*)realloc(specialized_progs, (n_specialized_progs + 1) * sizeof(SpecializedProgram));
+    specialized_progs[n_specialized_progs++] = sp;
+
+    return 0;
+}
+
+int oclcBuildSpecializedSpv(const unsigned char* spv, size_t spv_size, const OclcSpecConst* consts, size_t n_consts, cl_program* prog)
+{
+    // Programs are built under the lock too, so threads launching with the same values build them once
+    oclcLockSpecConsts();
+    int err = build_specialized_spv(spv, spv_size, consts, n_consts, prog);
+    oclcUnlockSpecConsts();
+    return err;
+}
+
 int oclcValidateWorkDims(dim3 gd, dim3 bd, cl_uint* work_dim)
 {
     *work_dim = 3;
@@ -6,6 +6,17 @@
 #include "CL/cl_ext.h"
 #include <stddef.h>
 
+/// Wraps what openclc generates into host sources, so stubs keep C linkage in the host sources of `.clpp` inputs
+#ifdef __cplusplus
+#define OCLC_EXTERN_C_BEGIN extern "C" {
+#define OCLC_EXTERN_C_END }
+#else
+#define OCLC_EXTERN_C_BEGIN
+#define OCLC_EXTERN_C_END
+#endif
+
+OCLC_EXTERN_C_BEGIN
+
 /***************/
 /* Runtime API */
 /***************/
@@ -78,7 +89,75 @@ void oclcCrash();
 /// Returns 0 on success.
 int oclcBuildSpv(const unsigned char* spv, size_t spv_size, cl_program* prog);
 
+/// A SPIR-V module embedded by openclc, `version` is encoded as in the module header, e.g. `0x00010400` for 1.4
+typedef struct {
+    cl_uint version;
+    const unsigned char* begin;
+    const unsigned char* end;
+} OclcSpvVariant;
+
+/// Picks the variant with the highest SPIR-V version the device accepts
+///
+/// Accepted versions come from `CL_DEVICE_ILS_WITH_VERSION`, or `CL_DEVICE_IL_VERSION_KHR` before OpenCL 3.0, queried by `oclcInit`.
+/// If the device accepts none of them, prints the embedded versions and calls `oclcCrash`, then returns NULL.
+const OclcSpvVariant* oclcSelectSpvVariant(const OclcSpvVariant* variants, size_t n_variants);
+
+/// A specialization constant for `oclcBuildSpecializedSpv`
+///
+/// Constants with a NULL `value` keep the default they have in the SPIR-V module.
+typedef struct {
+    cl_uint id;
+    size_t size;
+    const void* value;
+} OclcSpecConst;
+
+/// Utility function to build spv program with the specialization constants in `consts` set
+///
+/// One program is built and cached per module and distinct set of values, later calls with the same values return it.
+/// `consts` are read under `oclcLockSpecConsts`, so it may be called from several threads. Returns 0 on success.
+int oclcBuildSpecializedSpv(const unsigned char* spv, size_t spv_size, const OclcSpecConst* consts, size_t n_consts, cl_program* prog);
+
+/// Guards the specialized programs and the values the generated setters write, which every thread shares
+void oclcLockSpecConsts();
+void oclcUnlockSpecConsts();
+
 /// Ensures that the gd and bd are valid before launching kernel
 int oclcValidateWorkDims(dim3 gd, dim3 bd, cl_uint* work_dim);
 
+OCLC_EXTERN_C_END
+
+/******************/
+/* SPIR-V Linkage */
+/******************/
+
+#if defined(__APPLE__)
+#define OCLC_SPV_SECTION ".pushsection __TEXT,__openclc_spv\n"
+#define OCLC_SPV_SECTION_END ".popsection\n"
+#define OCLC_SPV_VISIBILITY ".private_extern"
+#define OCLC_SPV_HIDDEN __attribute__((visibility("hidden")))
+#elif defined(_WIN32)
+#define OCLC_SPV_SECTION ".section .rdata,\"dr\"\n"
+#define OCLC_SPV_SECTION_END ".text\n"
+#define OCLC_SPV_VISIBILITY ".globl"
+#define OCLC_SPV_HIDDEN
+#else
+#define OCLC_SPV_SECTION ".pushsection .openclc_spv,\"a\"\n"
+#define OCLC_SPV_SECTION_END ".popsection\n"
+#define OCLC_SPV_VISIBILITY ".hidden"
+#define OCLC_SPV_HIDDEN __attribute__((visibility("hidden")))
+#endif
+
+/// Links the file at `path` into a read only section as the byte arrays `name` and `name##_end`.
+///
+/// `symbol` must be unique within the program, it is used verbatim as the assembler name.
+/// `path` should be absolute since the assembler resolves it from the working directory.
+#define OCLC_INCBIN(name, symbol, path)                                       \
+    __asm__(OCLC_SPV_SECTION                                                  \
+        ".globl " symbol "\n" OCLC_SPV_VISIBILITY " " symbol "\n"             \
+        ".globl " symbol "_end\n" OCLC_SPV_VISIBILITY " " symbol "_end\n"     \
+        ".balign 4\n" symbol ":\n"                                            \
+        ".incbin \"" path "\"\n" symbol "_end:\n" OCLC_SPV_SECTION_END);      \
+    extern OCLC_SPV_HIDDEN const unsigned char name[] __asm__(symbol);        \
+    extern OCLC_SPV_HIDDEN const unsigned char name##_end[] __asm__(symbol "_end")
+
 #endif // __OPENCLC_RT_H
\ No newline at end of file